@@ -1,4 +1,5 @@
 #include "p2b/core.hpp"
+#include "p2b/pipeline.hpp"
 #include "p2b/utils.hpp"
 
 #include <algorithm>
@@ -41,7 +42,10 @@ map<string, string> parseArgs(int argc, char** argv){
         {"mode", ""},
         {"pixel_size", ""},
         {"resizing", ""},
-        {"color",""}
+        {"color",""},
+        {"video", ""},
+        {"pipeline", ""},
+        {"batch", ""}
     };
 
     string arg;
@@ -64,6 +68,11 @@ map<string, string> parseArgs(int argc, char** argv){
                     "\t\tdefault = false\n"
                 "\t-c, --color : boolean flag to specify if output has to be shown in color\n"
                     "\t\tdefault = false\n"
+                "\t-v, --video : a video file to stream through the multi-threaded pipeline\n"
+                "\t-p, --pipeline : boolean flag to stream the input images through the pipeline\n"
+                    "\t\tinstead of showing them, default = false\n"
+                "\t-b, --batch : boolean flag to convert all the input images at once on the thread pool\n"
+                    "\t\tdefault = false\n"
             << endl;
             exit(0);
         }
@@ -96,6 +105,18 @@ map<string, string> parseArgs(int argc, char** argv){
             ret_map["color"] = "true";
         }
 
+        if (arg == "-v" || arg == "--video"){
+            ret_map["video"] = (string) argv[i+1];
+        }
+
+        if (arg == "-p" || arg == "--pipeline"){
+            ret_map["pipeline"] = "true";
+        }
+
+        if (arg == "-b" || arg == "--batch"){
+            ret_map["batch"] = "true";
+        }
+
     }
 
     return ret_map;
@@ -218,7 +239,7 @@ void aux_testRoutineGrayscale(
                 aux_imshow(msg, *input_img_ptr);
                 
                 start = chrono::high_resolution_clock::now();
-                updateBitmap(bitmap_ptr, input_img_ptr);
+                updateBitmap(bitmap_ptr, input_img_ptr, true);
                 end = chrono::high_resolution_clock::now();
 
                 snprintf(
@@ -227,7 +248,9 @@ void aux_testRoutineGrayscale(
                     i, (chrono::duration_cast<chrono::milliseconds>(end-start)).count()
                 );
                 cout << msg << endl;
-                bitmap_ptr->toGrayscaleImage_parallel(output_img_ptr, gs_palette);
+                //? Only the regions that changed since the previous frame are expanded again
+                bitmap_ptr->updateGrayscaleImage(output_img_ptr, gs_palette);
+                bitmap_ptr->clearDirtyRects();
                 aux_imshow("Resulting bitmap", *output_img_ptr);
 
             }
@@ -243,6 +266,51 @@ void aux_testRoutineGrayscale(
 
 
 
+//? Streams frames through the decode, quantize and sink threads and prints how each stage performed
+void aux_pipelineRoutine(const FrameSource& source, uint8_t pixel_size, const vector<uint8_t>& th_vector){
+
+    //? Released payloads and scratch buffers are kept for the next frames
+    sharedBufferPool().setEnabled(true);
+    Pipeline pipeline = Pipeline(pixel_size, th_vector);
+    size_t total_bytes = 0;
+
+    int ret = pipeline.run(
+        source,
+        [&total_bytes](const Bitmap& bitmap, long frame_index) -> void {
+            total_bytes += bitmap.getRows() * bitmap.getCols();
+        }
+    );
+    if (ret != 0) ERROR_MSG("some frames could not be converted");
+
+    PipelineStats stats = pipeline.getStats();
+    char msg[128];
+    cout << "---- Pipeline ----" << endl;
+    snprintf(msg, 128, "Frames = %ld in %.1f ms (%.1f fps)", stats.sink.frames, stats.wall_ms, stats.fps);
+    cout << msg << endl;
+    snprintf(msg, 128, "Latency = %.2f ms average, %.2f ms max", stats.avg_latency_ms, stats.max_latency_ms);
+    cout << msg << endl;
+
+    const pair<string, StageStats> stages[3] = {{"decode", stats.decode}, {"quantize", stats.quantize}, {"sink", stats.sink}};
+    for (const pair<string, StageStats>& stage : stages){
+        snprintf(
+            msg, 128, "%-8s : %.2f ms/frame average, %.2f ms max",
+            stage.first.c_str(),
+            (stage.second.frames > 0) ? stage.second.busy_ms / stage.second.frames : 0.0,
+            stage.second.max_ms
+        );
+        cout << msg << endl;
+    }
+
+    PoolStats pool_stats = sharedBufferPool().getStats();
+    snprintf(msg, 128, "Buffer blocks = %zu allocated, %zu reused", pool_stats.allocations, pool_stats.reuses);
+    cout << msg << endl;
+    cout << "Packed bytes produced = " << total_bytes << "\n" << endl;
+
+}
+
+
+
+
 void aux_testRoutineColor(
     Bitmap* bitmap_ptr,
     vector<string> images,
@@ -294,8 +362,9 @@ int main(int argc, char** argv){
 
     string img_paths = arg_map["image"];
     string dir_path = arg_map["dir"];
-    if (img_paths == "" && dir_path == ""){
-        ERROR_MSG("one of --image and --dir argument is required");
+    string video_path = arg_map["video"];
+    if (img_paths == "" && dir_path == "" && video_path == ""){
+        ERROR_MSG("one of --image, --dir and --video argument is required");
         exit(1);
     }
     if (img_paths != "" && dir_path != ""){
@@ -362,6 +431,33 @@ int main(int argc, char** argv){
     };
 
 
+    if (video_path != "" || arg_map["pipeline"] == "true"){
+        const vector<uint8_t>& th_vector = (pixel_size == 1) ? th_vector_1b : (pixel_size == 4) ? th_vector_4b : th_vector_2b;
+        aux_pipelineRoutine(
+            (video_path != "") ? videoSource(video_path) : imageSequenceSource(images),
+            pixel_size,
+            th_vector
+        );
+        return 0;
+    }
+
+    if (arg_map["batch"] == "true"){
+        const vector<uint8_t>& th_vector = (pixel_size == 1) ? th_vector_1b : (pixel_size == 4) ? th_vector_4b : th_vector_2b;
+        vector<Bitmap> bitmaps;
+
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        toBitmapBatch(images, pixel_size, th_vector, &bitmaps);
+        chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
+
+        size_t total_bytes = 0;
+        for (const Bitmap& bitmap : bitmaps) total_bytes += bitmap.getAllocatedBytes();
+        cout << "Converted " << bitmaps.size() << " images in "
+             << (chrono::duration_cast<chrono::milliseconds>(end-start)).count() << " ms, "
+             << total_bytes << " bytes of bitmaps\n" << endl;
+        return 0;
+    }
+
+
     //? tmp initializations
     cv::Mat input_img;
     cv::Mat out_img;
@@ -484,8 +580,7 @@ int main(int argc, char** argv){
 
     if (mode == 'a' && images.size() > 1){
         size_t final_bmp_size = (
-            bmp.getRows() * bmp.getCols() +
-            bmp.getRows() * sizeof(bmp.getVec()[0]) +
+            bmp.getAllocatedBytes() +
             sizeof(bmp)
         );
         cout << "\nFinal bitmap size = " << final_bmp_size << " bytes" << endl;
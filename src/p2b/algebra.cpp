@@ -0,0 +1,166 @@
+#include "algebra.hpp"
+#include "bitmap.hpp"
+#include "kernels.hpp"
+#include "threadpool.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <opencv2/core/mat.hpp>
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+enum Operator{ OP_AND, OP_OR, OP_XOR, OP_NOT, OP_MIN, OP_MAX, OP_SELECT };
+
+template <int PIXEL_SIZE, int OP>
+static inline __attribute__((always_inline)) uint64_t combineWords(uint64_t x, uint64_t y, uint64_t s){
+    typedef p2b::PackedWordOps<PIXEL_SIZE> F;
+
+    if constexpr (OP == OP_AND) return x & y;
+    else if constexpr (OP == OP_OR) return x | y;
+    else if constexpr (OP == OP_XOR) return x ^ y;
+    else if constexpr (OP == OP_NOT) return ~x;
+    else if constexpr (OP == OP_MIN){
+        //? The reserved value is the biggest one, so it already gives way to the other level
+        uint64_t ge = F::greaterEqual(x, y);
+        return (y & ge) | (x & ~ge);
+    }
+    else if constexpr (OP == OP_MAX) return F::maxKnown(x, y);
+    else {
+        uint64_t take_x = F::nonZero(s);
+        return (x & take_x) | (y & ~take_x) | F::reserved(s);
+    }
+}
+
+
+
+//? Combines whole 64 bit words, returning how many bytes it consumed
+template <int PIXEL_SIZE, int OP>
+static inline __attribute__((always_inline)) long combineWordsRow(const uint8_t* x, const uint8_t* y, const uint8_t* s, uint8_t* dst, long n_bytes){
+    long j = 0;
+    for (; j+8 <= n_bytes; j+=8){
+        uint64_t wx, wy = 0, ws = 0;
+        memcpy(&wx, x+j, 8);
+        if constexpr (OP != OP_NOT) memcpy(&wy, y+j, 8);
+        if constexpr (OP == OP_SELECT) memcpy(&ws, s+j, 8);
+        uint64_t ret = combineWords<PIXEL_SIZE, OP>(wx, wy, ws);
+        memcpy(dst+j, &ret, 8);
+    }
+    return j;
+}
+
+
+
+/*
+    Whole words go through the word loop, the last partial word through a zero padded copy
+*/
+template <int PIXEL_SIZE, int OP>
+static void combineRow(const uint8_t* x, const uint8_t* y, const uint8_t* s, uint8_t* dst, long n_bytes){
+    long j = combineWordsRow<PIXEL_SIZE, OP>(x, y, s, dst, n_bytes);
+    if (j < n_bytes){
+        const long n = n_bytes - j;
+        uint64_t wx = 0, wy = 0, ws = 0;
+        memcpy(&wx, x+j, n);
+        if constexpr (OP != OP_NOT) memcpy(&wy, y+j, n);
+        if constexpr (OP == OP_SELECT) memcpy(&ws, s+j, n);
+        uint64_t ret = combineWords<PIXEL_SIZE, OP>(wx, wy, ws);
+        memcpy(dst+j, &ret, n);
+    }
+}
+
+
+
+static bool sameGeometry(const p2b::Bitmap& a, const p2b::Bitmap& b){
+    return a.getRows() == b.getRows() && a.getCols() == b.getCols() && a.getPixelSize() == b.getPixelSize();
+}
+
+
+
+/*
+    Checks the operands, prepares dst and runs the row combiner over chunks of rows.
+    dst always takes the thresholds, luma weights and width of the first operand, whether it is reallocated or not.
+    Only the cols meaningful bytes of every row are written, the row padding keeps its all-ones value.
+    The boolean operators would also flip the padding bits past the width in the last byte of each row
+    (not and xor of two 1s give 0), so those bits are set back to the reserved 1.
+    The write is reported to dst so that its dirty regions, count index and write log see it
+*/
+template <int OP>
+static int combine(const p2b::Bitmap& x, const p2b::Bitmap* y, const p2b::Bitmap* s, p2b::Bitmap* dst){
+
+    const uint8_t pixel_size = x.getPixelSize();
+    const bool level_op = (OP == OP_MIN || OP == OP_MAX || OP == OP_SELECT);
+    if (level_op && pixel_size == 1){
+        p2b::ERROR_MSG("min, max and select need 2 or 4 bit bitmaps, use the boolean operators on 1 bit ones");
+        return 1;
+    }
+    if (!level_op && pixel_size != 1){
+        p2b::ERROR_MSG("boolean operators need 1 bit bitmaps, use min, max and select on 2 and 4 bit ones");
+        return 1;
+    }
+    if ((y != nullptr && !sameGeometry(x, *y)) || (s != nullptr && !sameGeometry(x, *s))){
+        p2b::ERROR_MSG("bitmaps must have the same rows, cols and pixel_size to be combined");
+        return 1;
+    }
+    if (dst->isReadOnly()){
+        p2b::ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+    if (!sameGeometry(x, *dst)) *dst = p2b::Bitmap(x.getRows(), x.getCols(), pixel_size, x.getThresholds());
+    else if (dst->getThresholds() != x.getThresholds()) dst->setThresholds(x.getThresholds());
+    dst->setLumaWeights(x.getLumaWeights());
+    dst->setWidth(x.getWidth());
+    const int used_bits = (x.getWidth() % (8/pixel_size))*pixel_size;
+    const uint8_t padding_mask = (used_bits != 0) ? (0xFF >> used_bits) : 0;
+
+    void (*combine_row)(const uint8_t*, const uint8_t*, const uint8_t*, uint8_t*, long) =
+        (pixel_size == 1) ? combineRow<1, OP> : (pixel_size == 2) ? combineRow<2, OP> : combineRow<4, OP>;
+
+    //? Rows are written at the same position they are read from, so dst can alias any operand
+    cv::Mat dst_view = dst->getMatView();
+    const long cols = x.getCols();
+    p2b::parallelRows(
+        x.getRows(),
+        4*cols,
+        [&](long first, long last) -> void {
+            for (long i=first; i<last; ++i){
+                combine_row(
+                    x.getRow(i).data(),
+                    (y != nullptr) ? y->getRow(i).data() : nullptr,
+                    (s != nullptr) ? s->getRow(i).data() : nullptr,
+                    dst_view.ptr<uint8_t>(i),
+                    cols
+                );
+                dst_view.ptr<uint8_t>(i)[cols - 1] |= padding_mask;
+            }
+        }
+    );
+    dst->markWritten(0, 0, x.getRows(), cols);
+
+    return 0;
+
+}
+
+
+
+
+
+int p2b::bitmapAnd(const Bitmap& a, const Bitmap& b, Bitmap* dst){ return combine<OP_AND>(a, &b, nullptr, dst); }
+
+int p2b::bitmapOr(const Bitmap& a, const Bitmap& b, Bitmap* dst){ return combine<OP_OR>(a, &b, nullptr, dst); }
+
+int p2b::bitmapXor(const Bitmap& a, const Bitmap& b, Bitmap* dst){ return combine<OP_XOR>(a, &b, nullptr, dst); }
+
+int p2b::bitmapNot(const Bitmap& a, Bitmap* dst){ return combine<OP_NOT>(a, nullptr, nullptr, dst); }
+
+int p2b::bitmapMin(const Bitmap& a, const Bitmap& b, Bitmap* dst){ return combine<OP_MIN>(a, &b, nullptr, dst); }
+
+int p2b::bitmapMax(const Bitmap& a, const Bitmap& b, Bitmap* dst){ return combine<OP_MAX>(a, &b, nullptr, dst); }
+
+int p2b::bitmapSelect(const Bitmap& mask, const Bitmap& a, const Bitmap& b, Bitmap* dst){ return combine<OP_SELECT>(a, &b, &mask, dst); }
@@ -0,0 +1,115 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstddef>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+/*
+    Operators combining packed bitmaps of the same rows, cols and pixel_size without unpacking them:
+    rows are processed 8 bytes at a time, in parallel over cache sized chunks of rows.
+    dst can be one of the operands to work in place, otherwise it is reallocated when its geometry
+    doesn't match. It always takes the thresholds, luma weights and width of the first operand, the padding
+    past the width keeps the reserved value, and the write is recorded like the ones of Bitmap's member
+    functions (dirty regions, count index, write log).
+
+    1 bit bitmaps are plain masks (their all-ones value is also their only level), so they get boolean operators.
+    2 and 4 bit bitmaps get per-pixel level operators, in which the reserved all-ones value
+    ("no information", what addImage leaves in uncovered areas) is never mistaken for the highest level
+*/
+
+
+
+/**
+    @brief dst = a AND b, for 1 bit bitmaps
+    @return 0 if ok, 1 if the geometries don't match, pixel_size isn't 1 or dst is read-only
+*/
+int bitmapAnd(const Bitmap& a, const Bitmap& b, Bitmap* dst);
+
+/**
+    @brief dst = a OR b, for 1 bit bitmaps
+    @return 0 if ok, 1 if the geometries don't match, pixel_size isn't 1 or dst is read-only
+*/
+int bitmapOr(const Bitmap& a, const Bitmap& b, Bitmap* dst);
+
+/**
+    @brief dst = a XOR b, for 1 bit bitmaps
+    @return 0 if ok, 1 if the geometries don't match, pixel_size isn't 1 or dst is read-only
+*/
+int bitmapXor(const Bitmap& a, const Bitmap& b, Bitmap* dst);
+
+/**
+    @brief dst = NOT a, for 1 bit bitmaps
+    @return 0 if ok, 1 if pixel_size isn't 1 or dst is read-only
+*/
+int bitmapNot(const Bitmap& a, Bitmap* dst);
+
+
+/**
+    @brief Per-pixel minimum level of a and b, for 2 and 4 bit bitmaps.
+    A pixel without information takes the level of the other bitmap
+    @return 0 if ok, 1 if the geometries don't match, pixel_size is 1 or dst is read-only
+*/
+int bitmapMin(const Bitmap& a, const Bitmap& b, Bitmap* dst);
+
+/**
+    @brief Per-pixel maximum level of a and b, for 2 and 4 bit bitmaps.
+    A pixel without information takes the level of the other bitmap
+    @return 0 if ok, 1 if the geometries don't match, pixel_size is 1 or dst is read-only
+*/
+int bitmapMax(const Bitmap& a, const Bitmap& b, Bitmap* dst);
+
+/**
+    @brief Per-pixel choice between a and b, for 2 and 4 bit bitmaps:
+    the pixel of a where mask has a level above 0, the pixel of b where it is 0,
+    no information where the mask has none
+    @param mask: the bitmap choosing the operand, with the same geometry
+    @return 0 if ok, 1 if the geometries don't match, pixel_size is 1 or dst is read-only
+*/
+int bitmapSelect(const Bitmap& mask, const Bitmap& a, const Bitmap& b, Bitmap* dst);
+
+
+
+}   //? End of p2b namespace
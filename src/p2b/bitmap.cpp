@@ -1,15 +1,28 @@
 #include "bitmap.hpp"
 #include "core.hpp"
+#include "format.hpp"
+#include "kernels.hpp"
+#include "threadpool.hpp"
 #include "utils.hpp"
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <utility>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/core/matx.hpp>
 #include <opencv2/highgui.hpp>
 #include <vector>
 #include <opencv2/imgproc.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 
@@ -23,15 +36,19 @@ using namespace std;
 p2b::Bitmap::Bitmap(){
     this->rows = 1;
     this->cols = 1;
+    this->width = 4;
     this->pixel_size = 2;
     this->pixels_per_byte = 4;
     this->pixel_values = 3;
-    this->thresholds_v = {125};
+    this->thresholds_v = {85, 170, 255};    //? pixel_size 2 requires 3 thresholds
+    this->luma_weights = LUMA_BT601;
     this->last_add_r0 = -1;
     this->last_add_c0 = -1;
     this->last_add_height = -1;
     this->last_add_width = -1;
-    this->vec = vector<vector<uint8_t>>(1,vector<uint8_t>(1));
+    this->write_log_start = 0;
+    this->buildLookupTables();
+    if (this->allocate(1, 1) != 0) exit(1);
 }
 
 
@@ -69,357 +86,692 @@ p2b::Bitmap::Bitmap(long rows, long cols, uint8_t pixel_size, const vector<uint8
     this->pixels_per_byte = 8/pixel_size;
     this->pixel_values = (1 << pixel_size) -1;
     this->thresholds_v = thresholds_v;
+    this->luma_weights = LUMA_BT601;
+    this->buildLookupTables();
 
     this->last_add_r0 = -1;
     this->last_add_c0 = -1;
     this->last_add_height = -1;
     this->last_add_width = -1;
+    this->write_log_start = 0;
 
-    this->vec = vector<vector<uint8_t>>(rows, vector<uint8_t>(cols,255));
+    if (this->allocate(rows, cols) != 0) exit(1);
 
 }
 
 p2b::Bitmap::~Bitmap(){
     this->thresholds_v.clear();
-    this->vec.clear();
 }
 
 
 
+/*
+    (Re)allocates the payload as one contiguous buffer of rows*stride bytes without headroom,
+    every byte (padding included) set to 0b11111111. File backed payloads resize their file instead,
+    and an allocated payload of the same size is only refilled, so per-frame updates do not allocate
+*/
+int p2b::Bitmap::allocate(long rows, long cols){
+    this->rows = rows;
+    this->cols = cols;
+    this->width = cols*this->pixels_per_byte;
+    this->stride = paddedStride(cols);
+    this->cap_rows = rows;
+    this->org_r = 0;
+    this->org_c = 0;
+    if (this->buf.isFileBacked()){
+        if (this->buf.resize(rows*this->stride) != 0) return 1;
+        memset(this->buf.getData(), 255, rows*this->stride);
+    }
+    else if (!this->buf.isMapped() && this->buf.getSize() == (size_t) (rows*this->stride)){
+        memset(this->buf.getData(), 255, rows*this->stride);
+    }
+    else this->buf = Buffer(rows*this->stride, 255);
+    this->dirty_rects.assign(1, {0, 0, rows, cols});
+    this->resetWriteLog();
+    return 0;
+}
+
+
+
+/*
+    Records a written region, a region covering the whole bitmap replaces every other one
+*/
+void p2b::Bitmap::markDirty(long row, long col, long height, long width){
+    this->recordWrite(row, col, height, width);
+    if (row == 0 && col == 0 && height >= this->rows && width >= this->cols){
+        this->dirty_rects.assign(1, {0, 0, this->rows, this->cols});
+        return;
+    }
+    this->dirty_rects.push_back({row, col, height, width});
+}
 
 
-long p2b::Bitmap::getRows(){ return this->rows; }
-long p2b::Bitmap::getCols(){ return this->cols; }
-uint8_t p2b::Bitmap::getPixelSize(){ return this->pixel_size; }
-uint8_t p2b::Bitmap::getPixelValues(){ return this->pixel_values; }
-vector<uint8_t> p2b::Bitmap::getThresholds(){ return this->thresholds_v; }
-vector<vector<uint8_t>> p2b::Bitmap::getVec(){ return this->vec; }
 
+/*
+    Everything derived from the payload is told about a written region here
+*/
+void p2b::Bitmap::recordWrite(long row, long col, long height, long width){
+    this->refreshCountIndex(row, col, height, width);
+    if (this->write_log.size() >= WRITE_LOG_MAX) this->resetWriteLog();
+    else this->write_log.push_back({row, col, height, width});
+}
 
 
 
+//? Skipping a write number makes every previous generation older than the log
+void p2b::Bitmap::resetWriteLog(){
+    this->write_log_start += this->write_log.size() + 1;
+    this->write_log.clear();
+}
 
-int p2b::Bitmap::increaseSize(const long new_rows, const long new_cols, const int resize_direction){
-    if ((new_rows < this->rows) || (new_cols < this->cols)){
-        ERROR_MSG("new_rows and new_cols must be greater than the existing rows and cols");
-        return 1;
+
+
+/*
+    Updates the count index over a written region in rows and bytes, or rebuilds it
+    for the whole bitmap if the geometry changed since it was built
+*/
+void p2b::Bitmap::refreshCountIndex(long row, long col, long height, long width){
+    if (!this->count_index.isEnabled()) return;
+
+    if (!this->count_index.matches(this->rows, this->cols, this->pixel_size)){
+        const vector<uint8_t> levels = this->count_index.getLevels();
+        if (this->count_index.build(this->row(0), this->stride, this->rows, this->cols, this->pixel_size, levels) != 0){
+            this->count_index.clear();
+        }
+        return;
     }
+    this->count_index.update(this->row(0), this->stride, row, col*this->pixels_per_byte, height, width*this->pixels_per_byte);
+}
+
+
+
+/*
+    Makes room for top/bottom rows and left/right bytes around the current window.
+    Every axis that lacks headroom at least doubles its capacity and the window is centered in it,
+    so a sequence of growths in the same direction costs amortized O(added bytes)
+*/
+int p2b::Bitmap::reserve(long top, long bottom, long left, long right){
 
-    this->vec.resize(new_rows);
-    for (vector<uint8_t>& row_v : this->vec){
-        row_v.resize(new_cols);
+    long need_rows = this->rows + top + bottom;
+    long need_cols = this->cols + left + right;
+
+    long new_cap_rows = this->cap_rows;
+    long new_org_r = this->org_r - top;
+    if (top > this->org_r || this->org_r + this->rows + bottom > this->cap_rows){
+        new_cap_rows = MAX_SIZE(2*this->cap_rows, need_rows);
+        new_org_r = (new_cap_rows - need_rows)/2;
     }
 
-    for (long i=0; i<new_rows; ++i){
-        for (long j=0; j<new_cols; ++j){
-            if (i >= this->rows || j >= this->cols)
-                this->vec[i][j] = 255;  //? Byte set to 0b11111111
-        }
+    long new_stride = this->stride;
+    long new_org_c = this->org_c - left;
+    if (left > this->org_c || this->org_c + this->cols + right > this->stride){
+        new_stride = paddedStride(MAX_SIZE(2*this->stride, need_cols));
+        new_org_c = (new_stride - need_cols)/2;
     }
 
-    //? Moving original image if it has to be displaced
-    uint8_t tmp_swap;
-    long row_diff = new_rows - this->rows;
-    long col_diff = new_cols - this->cols;
+    if (new_cap_rows == this->cap_rows && new_stride == this->stride) return 0;
 
-    switch (resize_direction) {
+    if (this->buf.isFileBacked()){
+        return this->relayoutFileBacked(new_cap_rows, new_stride, new_org_r + top, new_org_c + left);
+    }
 
-        case p2b::DIR_UP:
-            for (long i=this->rows-1; i>=0; --i){
-                for (long j=this->cols-1; j>=0; --j){
-                    if (this->vec[i][j] != 255){
-                        tmp_swap = this->vec[i][j];
-                        this->vec[i][j] = this->vec[i+row_diff][j];
-                        this->vec[i+row_diff][j] = tmp_swap;
-                    }
-                }
+    Buffer new_buf = Buffer(new_cap_rows*new_stride, 255);
+    uint8_t* new_data = new_buf.getData();
+    p2b::parallelRows(
+        this->rows,
+        2*this->cols,
+        [&](long first, long last) -> void {
+            for (long i=first; i<last; ++i){
+                const uint8_t* src_row = this->row(i);
+                copy(src_row, src_row + this->cols, new_data + (new_org_r + top + i)*new_stride + new_org_c + left);
             }
-            this->last_add_r0 += row_diff;   //? Now the r0 of the last image is increased
-            break;
-        
-        case p2b::DIR_LEFT:
-            for (long i=this->rows-1; i>=0; --i){
-                for (long j=this->cols-1; j>=0; --j){
-                    if (this->vec[i][j] != 255){
-                        tmp_swap = this->vec[i][j];
-                        this->vec[i][j] = this->vec[i][j+col_diff];
-                        this->vec[i][j+col_diff] = tmp_swap; 
-                    }
-                }
+        }
+    );
+
+    this->buf = std::move(new_buf);
+    this->stride = new_stride;
+    this->cap_rows = new_cap_rows;
+    this->org_r = new_org_r + top;
+    this->org_c = new_org_c + left;
+    return 0;
+
+}
+
+
+
+
+
+/*
+    Growth of a file backed payload: the file and its mapping grow in place with ftruncate and mremap,
+    then the rows are moved to their new position inside the same mapping.
+    The shift of row i is linear in i, so the rows moving towards the start of the mapping are a prefix
+    (moved first to last) and the ones moving towards the end a suffix (moved last to first),
+    and no row is overwritten before it is moved.
+    Each part is moved in waves of rows whose destinations don't overlap the sources of the other rows
+    of the wave: a wave runs through parallelRows, the waves follow the order above.
+    The headroom is not filled, increaseSize fills the bytes it exposes: the bands above and below
+    the window are punched out of the file, the few bytes around each row keep their stale value
+*/
+int p2b::Bitmap::relayoutFileBacked(long new_cap_rows, long new_stride, long new_org_r, long new_org_c){
+
+    if (this->buf.resize(new_cap_rows*new_stride) != 0) return 1;
+    uint8_t* data = this->buf.getData();
+
+    auto old_offset = [this](long i) -> long { return (this->org_r + i)*this->stride + this->org_c; };
+    auto new_offset = [new_org_r, new_stride, new_org_c](long i) -> long { return (new_org_r + i)*new_stride + new_org_c; };
+
+    auto move_row = [this, data, &old_offset, &new_offset](long i) -> void {
+        memmove(data + new_offset(i), data + old_offset(i), this->cols);
+    };
+    //? Distance in rows of the closest source the destination of row i overlaps, in the direction it moves, 0 if none.
+    //? Those sources are d rows away with d*stride in (shift - cols, shift + cols)
+    auto overlap_distance = [this, &old_offset, &new_offset](long i) -> long {
+        if (this->cols == 0) return 0;
+        const long shift = labs(new_offset(i) - old_offset(i));
+        const long d = MAX_SIZE(1L, (shift - this->cols)/this->stride + 1);
+        return (d*this->stride < shift + this->cols) ? d : 0;
+    };
+
+    long first_forward = 0;
+    while (first_forward < this->rows && new_offset(first_forward) < old_offset(first_forward)) ++first_forward;
+
+    for (long lo=0; lo<first_forward; ){
+        long hi = lo + 1;
+        while (hi < first_forward && (overlap_distance(hi) == 0 || hi - overlap_distance(hi) < lo)) ++hi;
+        p2b::parallelRows(
+            hi - lo,
+            2*this->cols,
+            [lo, &move_row](long first, long last) -> void {
+                for (long i=lo+first; i<lo+last; ++i) move_row(i);
             }
-            this->last_add_c0 += col_diff;  //? Now the c0 of the last image is increased
-            break;
-    
+        );
+        lo = hi;
+    }
+    for (long hi=this->rows; hi>first_forward; ){
+        long lo = hi - 1;
+        while (lo > first_forward && (overlap_distance(lo - 1) == 0 || lo - 1 + overlap_distance(lo - 1) >= hi)) --lo;
+        p2b::parallelRows(
+            hi - lo,
+            2*this->cols,
+            [hi, &move_row](long first, long last) -> void {
+                for (long i=hi-1-first; i>=hi-last; --i) move_row(i);
+            }
+        );
+        hi = lo;
     }
 
-    this->rows = new_rows;
-    this->cols = new_cols;
+    this->buf.discard(0, new_org_r*new_stride);
+    this->buf.discard((new_org_r + this->rows)*new_stride, (new_cap_rows - new_org_r - this->rows)*new_stride);
+
+    this->stride = new_stride;
+    this->cap_rows = new_cap_rows;
+    this->org_r = new_org_r;
+    this->org_c = new_org_c;
+    return 0;
+
+}
+
+
+
+/*
+    Moves the payload to a file created at path, keeping its layout, every later growth resizes the file.
+    Only the window is copied: the headroom stays a hole of the file, so it takes no disk space until exposed
+*/
+int p2b::Bitmap::useFileStorage(const string& path){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+
+    Buffer file_buf = Buffer::fromFile(path, this->buf.getSize());
+    if (! file_buf.isFileBacked()) return 1;
+
+    p2b::parallelRows(
+        this->rows,
+        2*this->cols,
+        [this, &file_buf](long first, long last) -> void {
+            for (long i=first; i<last; ++i){
+                const long offset = (this->org_r + i)*this->stride + this->org_c;
+                memcpy(file_buf.getData() + offset, this->buf.getData() + offset, this->cols);
+            }
+        }
+    );
+    this->buf = std::move(file_buf);
     return 0;
 }
 
 
 
 
+
 /*
-    Wrapper for increaseSize(rows*2, cols*2, resize_direction)
+    Precomputes the pixel value of every possible grayscale value, so that
+    the conversion costs a single lookup regardless of pixel_size
 */
-int p2b::Bitmap::doubleSize(const int resize_direction){
-    return this->increaseSize(this->rows*2, this->cols*2, resize_direction);
+void p2b::Bitmap::buildLookupTables(){
+    p2b::buildEncodeTables(this->pixel_size, this->thresholds_v.data(), this->level_lut, this->packed_lut);
 }
 
 
 
+int p2b::makeLumaWeights(float b, float g, float r, LumaWeights* luma_weights){
+    if (!isfinite(b) || !isfinite(g) || !isfinite(r) || b < 0 || g < 0 || r < 0){
+        ERROR_MSG("luma weights must be finite and non negative");
+        return 1;
+    }
+    if (fabs(b + g + r - 1.0f) > 1e-3f){
+        ERROR_MSG("luma weights must sum to 1");
+        return 1;
+    }
 
+    const float scale = (float) (1 << LUMA_SHIFT);
+    long w[3] = {lroundf(b*scale), lroundf(g*scale), lroundf(r*scale)};
+    int largest = 0;
+    for (int c=1; c<3; ++c) if (w[c] > w[largest]) largest = c;
+    w[largest] += (1 << LUMA_SHIFT) - (w[0] + w[1] + w[2]);    //? Keeps the sum exact, white stays 255
 
+    luma_weights->b = (uint16_t) w[0];
+    luma_weights->g = (uint16_t) w[1];
+    luma_weights->r = (uint16_t) w[2];
+    return 0;
+}
 
 
 
 
 
+long p2b::Bitmap::getRows() const { return this->rows; }
+long p2b::Bitmap::getCols() const { return this->cols; }
+long p2b::Bitmap::getWidth() const { return this->width; }
+uint8_t p2b::Bitmap::getPixelSize() const { return this->pixel_size; }
+uint8_t p2b::Bitmap::getPixelValues() const { return this->pixel_values; }
+const vector<uint8_t>& p2b::Bitmap::getThresholds() const { return this->thresholds_v; }
+long p2b::Bitmap::getStride() const { return this->stride; }
 
+int p2b::Bitmap::setThresholds(const vector<uint8_t>& thresholds_v){
+    if (thresholds_v.size() != (size_t) this->pixel_values){
+        ERROR_MSG("thresholds_v is not a vector of 8/pixel_size thresholds to apply");
+        return 1;
+    }
+    if (! is_sorted(thresholds_v.begin(), thresholds_v.end())){
+        ERROR_MSG("thresholds_v is not sorted in ascending order");
+        return 1;
+    }
+    this->thresholds_v = thresholds_v;
+    this->buildLookupTables();
+    return 0;
+}
+int p2b::Bitmap::setWidth(long width){
+    if (width <= (this->cols - 1)*this->pixels_per_byte || width > this->cols*this->pixels_per_byte){
+        ERROR_MSG("width must end in the last byte of every row");
+        return 1;
+    }
+    this->width = width;
+    return 0;
+}
+size_t p2b::Bitmap::getAllocatedBytes() const { return this->buf.getSize() + this->count_index.getAllocatedBytes(); }
+p2b::LumaWeights p2b::Bitmap::getLumaWeights() const { return this->luma_weights; }
+void p2b::Bitmap::setLumaWeights(const LumaWeights& luma_weights){ this->luma_weights = luma_weights; }
+
+span<const uint8_t> p2b::Bitmap::getRow(long i) const { return span<const uint8_t>(this->row(i), this->cols); }
+const uint8_t* p2b::Bitmap::getData() const { return this->row(0); }
+const vector<p2b::DirtyRect>& p2b::Bitmap::getDirtyRects() const { return this->dirty_rects; }
+void p2b::Bitmap::clearDirtyRects(){ this->dirty_rects.clear(); }
 
 
-int p2b::Bitmap::fromImage_linear(cv::Mat* img_ptr){
 
-    size_t img_rows = img_ptr->rows;
-    size_t img_cols = img_ptr->cols;
-    cv::Mat gs_img = *img_ptr;
-    if (img_ptr->channels() > 1){
-        cv::cvtColor(*img_ptr, gs_img, cv::COLOR_BGR2GRAY);
+int p2b::Bitmap::enableCountIndex(const vector<uint8_t>& levels){
+    return this->count_index.build(this->row(0), this->stride, this->rows, this->cols, this->pixel_size, levels);
+}
+
+void p2b::Bitmap::disableCountIndex(){ this->count_index.clear(); }
+
+bool p2b::Bitmap::hasCountIndex() const { return this->count_index.isEnabled(); }
+
+size_t p2b::Bitmap::getCountIndexBytes() const { return this->count_index.getAllocatedBytes(); }
+
+uint64_t p2b::Bitmap::getWriteGeneration() const { return this->write_log_start + this->write_log.size(); }
+
+bool p2b::Bitmap::getWritesSince(uint64_t generation, vector<DirtyRect>* rects) const {
+    if (generation < this->write_log_start || generation > this->getWriteGeneration()) return false;
+    rects->assign(this->write_log.begin() + (generation - this->write_log_start), this->write_log.end());
+    return true;
+}
+
+long p2b::Bitmap::countInRect(uint8_t level, long row, long col, long height, long width) const {
+    if (!this->count_index.isEnabled()){
+        ERROR_MSG("the bitmap has no count index, call enableCountIndex first");
+        return -1;
     }
+    return this->count_index.count(level, row, col, height, width);
+}
 
-    size_t vec_j;
-    uint8_t p_value;
-    uint8_t l_shift;
-    
 
-    for (size_t i=0; i<img_rows; ++i){
-        for (size_t j=0; j<img_cols; ++j){
 
-            vec_j = j/this->pixels_per_byte;
-            
-            
-            //? Because of how this piece of code works, if we want to keep the 1, 11, 1111 values reserved
-            //? we have to ensure that the last threshold value is 255 for pixel_size != 1
-            //? This should be enforced in the source code that calls this function
-            
-            p_value = 0;
-            for (uint8_t& threshold : this->thresholds_v){
-                if (gs_img.at<uint8_t>(i,j) < threshold)
-                    break;
-                ++p_value;
-            }
+/*
+    Returns a CV_8UC1 header of rows x cols bytes whose step is the stride of the bitmap,
+    it wraps the packed payload without copying it. A cv::Mat cannot be made read-only,
+    so a read-only mapping gets no view at all instead of one that faults on the first write
+*/
+cv::Mat p2b::Bitmap::getMatView(){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, read it with getRow/getData or modify a copy of it");
+        return cv::Mat();
+    }
+    return cv::Mat(this->rows, this->cols, CV_8UC1, this->row(0), this->stride);
+}
 
-            //? Critical calculation of the left shift
-            l_shift = (8-this->pixel_size) - ((j%this->pixels_per_byte) * this->pixel_size);
 
-            //? This algorithm that performs bitwise operations only works
-            //? if the pixels of the bitmap we're accessing are initialized
-            //? in sequential order, like in this case, since the biwise OR
-            //? operations together with the &= could alter previously initialized
-            //? pixels if those are not 1, 11, 1111
 
-            switch (this->pixel_size) {
-                
-                case 1:
-                    switch (l_shift) {
-                        case 7:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_0);
-                            break;
-                        case 6:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_1);
-                            break;
-                        case 5:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_2);
-                            break;
-                        case 4:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_3);
-                            break;
-                        case 3:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_4);
-                            break;
-                        case 2:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_5);
-                            break;
-                        case 1:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_6);
-                            break;
-                        case 0:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_7);
-                            break;
-                        default:
-                            ERROR_MSG("unexpected l_shift value in fromImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
+int p2b::Bitmap::markWritten(long row, long col, long height, long width){
+    if (height <= 0 || width <= 0 || row < 0 || col < 0 || row + height > this->rows || col + width > this->cols){
+        ERROR_MSG("the written region is empty or not inside the bitmap");
+        return 1;
+    }
+    this->markDirty(row, col, height, width);
+    return 0;
+}
 
-                case 2:
-                    switch (l_shift) {
-                        case 6:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_0);
-                            break;
-                        case 4:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_1);
-                            break;
-                        case 2:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_2);
-                            break;
-                        case 0:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_3);
-                            break;
-                        default:
-                            ERROR_MSG("unexpected l_shift value in fromImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
 
-                case 4:
-                    switch (l_shift) {
-                        case 4:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P4_0);
-                            break;
-                        case 0:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P4_1);
-                            break;
-                        default:
-                            ERROR_MSG("unexpected l_shift value in fromImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
-                
-                default:
-                    ERROR_MSG("invalid pixel_size value in fromImage");
-                    exit(1);
-                    break;
 
-            }
+/*
+    Returns a copy of the payload without the row padding (rows*cols bytes, row-major)
+*/
+vector<uint8_t> p2b::Bitmap::getVec() const {
+    vector<uint8_t> ret_v(this->rows * this->cols);
+    for (long i=0; i<this->rows; ++i){
+        copy(this->row(i), this->row(i) + this->cols, ret_v.begin() + i*this->cols);
+    }
+    return ret_v;
+}
 
-        }
+
+
+p2b::Buffer p2b::Bitmap::releaseBuffer(){
+    this->rows = 0;
+    this->cols = 0;
+    this->width = 0;
+    this->stride = 0;
+    this->cap_rows = 0;
+    this->org_r = 0;
+    this->org_c = 0;
+    this->dirty_rects.clear();
+    this->count_index.clear();
+    this->resetWriteLog();
+    return std::move(this->buf);
+}
+
+
+
+
+bool p2b::Bitmap::isReadOnly() const { return this->buf.isReadOnly(); }
+bool p2b::Bitmap::isFileBacked() const { return this->buf.isFileBacked(); }
+
+
+
+/*
+    Writes the header, then every row of the window padded to paddedStride(cols) with 0b11111111,
+    the payload starting at the first multiple of P2B_PAYLOAD_ALIGNMENT after the header
+*/
+int p2b::Bitmap::save(const string& path) const {
+
+    const long file_stride = paddedStride(this->cols);
+
+    FileHeader header = makeHeader(
+        this->rows, this->cols, this->width, this->pixel_size, this->thresholds_v, this->luma_weights,
+        this->last_add_r0, this->last_add_c0, this->last_add_height, this->last_add_width
+    );
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr){
+        ERROR_MSG("unable to open " + path + " for writing");
+        return 1;
     }
 
-    this->last_add_r0 = 0;
-    this->last_add_c0 = 0;
-    this->last_add_height = img_rows;
-    this->last_add_width = (img_cols+this->pixels_per_byte-1)/this->pixels_per_byte;
-    return 0;    
+    vector<uint8_t> padding(header.payload_offset - sizeof(FileHeader), 0);
+    vector<uint8_t> file_row(file_stride, 255);
+    bool ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+    ok = ok && (fwrite(padding.data(), 1, padding.size(), file) == padding.size());
+    for (long i=0; ok && i<this->rows; ++i){
+        copy(this->row(i), this->row(i) + this->cols, file_row.begin());
+        ok = (fwrite(file_row.data(), 1, file_stride, file) == (size_t) file_stride);
+    }
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok){
+        ERROR_MSG("unable to write " + path);
+        return 1;
+    }
+    return 0;
 
 }
 
 
 
-int p2b::Bitmap::fromImage_parallel(cv::Mat* img_ptr){
-    
-    cv::Mat gs_img = *img_ptr;
-    if (img_ptr->channels() > 1){
-        cv::cvtColor(*img_ptr, gs_img, cv::COLOR_BGR2GRAY);
+/*
+    The whole file is mapped read-only and shared, the payload is used in place as the window of the bitmap.
+    Pages are only read from disk when they are first touched, so opening a file costs the same regardless of its size
+*/
+int p2b::Bitmap::load(const string& path){
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1){
+        ERROR_MSG("unable to open " + path);
+        return 1;
     }
-    
-    gs_img.forEach<uint8_t>(
-        [this](uint8_t& pixel, const int* position) -> void {
 
-            int i = position[0];
-            int j = position[1];
+    struct stat file_stat;
+    FileHeader header;
+    if (
+        (fstat(fd, &file_stat) != 0) ||
+        ((size_t) file_stat.st_size < sizeof(FileHeader)) ||
+        (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+    ){
+        ERROR_MSG("unable to read the header of " + path);
+        close(fd);
+        return 1;
+    }
+    if (validateHeader(header, file_stat.st_size) != 0){
+        close(fd);
+        return 1;
+    }
 
-            size_t vec_j = j/this->pixels_per_byte;
-            uint8_t p_value = 0;
-            uint8_t l_shift;
+    void* map_addr = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);    //? The mapping keeps the file alive
+    if (map_addr == MAP_FAILED){
+        ERROR_MSG("unable to map " + path);
+        return 1;
+    }
 
-            for (uint8_t& threshold : this->thresholds_v){
-                if (pixel < threshold)
-                    break;
-                ++p_value;
-            }
+    this->rows = header.rows;
+    this->cols = header.cols;
+    this->pixel_size = header.pixel_size;
+    this->pixels_per_byte = 8/header.pixel_size;
+    this->pixel_values = (1 << header.pixel_size) - 1;
+    this->width = (header.width > 0) ? header.width : header.cols*this->pixels_per_byte;    //? Files written before the field existed
+    this->thresholds_v.assign(header.thresholds, header.thresholds + header.n_thresholds);
+    this->luma_weights = {header.luma_b, header.luma_g, header.luma_r};
+    this->buildLookupTables();
+
+    this->last_add_r0 = header.last_add_r0;
+    this->last_add_c0 = header.last_add_c0;
+    this->last_add_height = header.last_add_height;
+    this->last_add_width = header.last_add_width;
+
+    this->buf = Buffer::fromMapping(map_addr, file_stat.st_size, header.payload_offset, header.payload_size);
+    this->stride = header.stride;
+    this->cap_rows = header.rows;
+    this->org_r = 0;
+    this->org_c = 0;
+    this->dirty_rects.assign(1, {0, 0, this->rows, this->cols});
+    this->refreshCountIndex(0, 0, this->rows, this->cols);
+    this->resetWriteLog();
 
-            l_shift = (8-this->pixel_size) - ((j%this->pixels_per_byte) * this->pixel_size);
+    return 0;
 
-            switch (this->pixel_size) {
-                
-                case 1:
-                    switch (l_shift) {
-                        case 7:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_0);
-                            break;
-                        case 6:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_1);
-                            break;
-                        case 5:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_2);
-                            break;
-                        case 4:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_3);
-                            break;
-                        case 3:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_4);
-                            break;
-                        case 2:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_5);
-                            break;
-                        case 1:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_6);
-                            break;
-                        case 0:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P1_7);
-                            break;
-                        default:
-                            ERROR_MSG("unexpected l_shift value in fromImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
+}
 
-                case 2:
-                    switch (l_shift) {
-                        case 6:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_0);
-                            break;
-                        case 4:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_1);
-                            break;
-                        case 2:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_2);
-                            break;
-                        case 0:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P2_3);
-                            break;
-                        default:
-                            ERROR_MSG("unexpected l_shift value in fromImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
 
-                case 4:
-                    switch (l_shift) {
-                        case 4:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P4_0);
-                            break;
-                        case 0:
-                            this->vec[i][vec_j] &= ((p_value << l_shift) | OR_MASK_P4_1);
-                            break;
-                        default:
-                            ERROR_MSG("unexpected l_shift value in fromImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
-                
-                default:
-                    ERROR_MSG("invalid pixel_size value in fromImage");
-                    exit(1);
-                    break;
 
-            }
 
+
+int p2b::Bitmap::increaseSize(const long new_rows, const long new_cols, const int resize_direction){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+    if ((new_rows < this->rows) || (new_cols < this->cols)){
+        ERROR_MSG("new_rows and new_cols must be greater than the existing rows and cols");
+        return 1;
+    }
+
+    //? The bitmap grows at the top/left when resizing UP/LEFT, at the bottom/right otherwise
+    long top = (resize_direction == p2b::DIR_UP) ? new_rows - this->rows : 0;
+    long left = (resize_direction == p2b::DIR_LEFT) ? new_cols - this->cols : 0;
+    long bottom = new_rows - this->rows - top;
+    long right = new_cols - this->cols - left;
+
+    if (this->reserve(top, bottom, left, right) != 0){
+        ERROR_MSG("unable to make room for the new rows and cols, the bitmap is left unchanged");
+        return 1;
+    }
+
+    //? Growing moves the window over the headroom, whose exposed bytes are set to 0b11111111
+    const long old_rows = this->rows;
+    const long old_cols = this->cols;
+    this->org_r -= top;
+    this->org_c -= left;
+    this->rows = new_rows;
+    this->cols = new_cols;
+    //? New bytes on the right are all reserved, so the padding of the old last byte stops being padding
+    this->width = (right > 0) ? new_cols*this->pixels_per_byte : this->width + left*this->pixels_per_byte;
+    for (long i=0; i<new_rows; ++i){
+        if (i < top || i >= top + old_rows) memset(this->row(i), 255, new_cols);
+        else {
+            memset(this->row(i), 255, left);
+            memset(this->row(i) + left + old_cols, 255, right);
         }
-    );
+    }
+
+    this->last_add_r0 += top;   //? Now the r0 of the last image is increased
+    this->last_add_c0 += left;  //? Now the c0 of the last image is increased
+
+    for (DirtyRect& rect : this->dirty_rects){
+        rect.row += top;
+        rect.col += left;
+    }
+    //? The geometry changed, so the whole index is rebuilt and the write log restarted
+    this->refreshCountIndex(0, 0, this->rows, this->cols);
+    this->resetWriteLog();
+    return 0;
+}
+
+
+
+
+/*
+    Wrapper for increaseSize(rows*2, cols*2, resize_direction)
+*/
+int p2b::Bitmap::doubleSize(const int resize_direction){
+    return this->increaseSize(this->rows*2, this->cols*2, resize_direction);
+}
+
 
+
+
+
+
+
+
+
+
+
+
+
+/*
+    Quantizes img straight into the bitmap, its top-left pixel landing on pixel (start_row, start_col).
+    With merge_edges the pixels sharing the first and last byte of each row with img keep their value,
+    otherwise start_col must be the first pixel of a byte and the last byte of each row is overwritten,
+    the positions past the image getting the reserved 1, 11, 1111 value.
+    BGR(A) pixels are converted to luma on the fly by the fused kernel
+*/
+void p2b::Bitmap::encodeImage(const cv::Mat& img, long start_row, long start_col, bool merge_edges, bool parallel){
+
+    const long start_byte = start_col/this->pixels_per_byte;
+    const int first_pixel = start_col%this->pixels_per_byte;
+
+    auto encode_band = [this, &img, start_row, start_byte, first_pixel, merge_edges](long first, long last) -> void {
+        const uint8_t* img_data = img.ptr<uint8_t>(first);
+        uint8_t* bm_data = this->row(start_row + first) + start_byte;
+        if (merge_edges){
+            p2b::encodeRegionRows(
+                img_data, img.step[0], img.channels(), last - first, img.cols,
+                bm_data, this->stride, first_pixel,
+                this->pixel_size, this->thresholds_v.data(), this->packed_lut, this->luma_weights
+            );
+        }
+        else {
+            p2b::encodeRows(
+                img_data, img.step[0], img.channels(), last - first, img.cols,
+                bm_data, this->stride,
+                this->pixel_size, this->thresholds_v.data(), this->packed_lut, this->luma_weights
+            );
+        }
+    };
+
+    //? Every worker gets a chunk of whole rows and builds complete output bytes, so no byte
+    //? is ever written by two threads and chunks do not share cache lines except at their borders
+    if (parallel) p2b::parallelRows(img.rows, img.cols*img.channels() + this->cols, encode_band);
+    else encode_band(0, img.rows);
+
+}
+
+
+
+int p2b::Bitmap::fromImage_linear(cv::Mat* img_ptr){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+
+    if (img_ptr->channels() == 2 || img_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
+    }
+
+    this->encodeImage(*img_ptr, 0, 0, false, false);
+
+    if ((img_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte == this->cols) this->width = img_ptr->cols;
     this->last_add_r0 = 0;
     this->last_add_c0 = 0;
     this->last_add_height = img_ptr->rows;
     this->last_add_width = (img_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte;
+    this->markDirty(0, 0, this->last_add_height, this->last_add_width);
+    return 0;    
+
+}
+
+
+
+int p2b::Bitmap::fromImage_parallel(cv::Mat* img_ptr){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+    
+    if (img_ptr->channels() == 2 || img_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
+    }
+
+    this->encodeImage(*img_ptr, 0, 0, false, true);
+
+    if ((img_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte == this->cols) this->width = img_ptr->cols;
+    this->last_add_r0 = 0;
+    this->last_add_c0 = 0;
+    this->last_add_height = img_ptr->rows;
+    this->last_add_width = (img_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte;
+    this->markDirty(0, 0, this->last_add_height, this->last_add_width);
     return 0;
 
 }
@@ -430,12 +782,51 @@ int p2b::Bitmap::fromImage_parallel(cv::Mat* img_ptr){
 
 
 
+/*
+    Quantizes a strip of rows of an image as wide as the bitmap into the rows starting at start_row,
+    used to build a bitmap from an image that arrives a few rows at a time
+*/
+int p2b::Bitmap::fromImageStrip(cv::Mat* strip_ptr, long start_row){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+    if (
+        (start_row < 0) || (start_row + strip_ptr->rows > this->rows) ||
+        ((strip_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte != this->cols)
+    ){
+        ERROR_MSG("strip does not fit the bitmap, it must be as wide as the bitmap and end before its last row");
+        return 1;
+    }
+    if (strip_ptr->channels() == 2 || strip_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
+    }
+
+    this->encodeImage(*strip_ptr, start_row, 0, false, true);
+    this->width = strip_ptr->cols;
+
+    //? The bitmap is meant to hold a single image, as after fromImage
+    this->last_add_r0 = 0;
+    this->last_add_c0 = 0;
+    this->last_add_height = this->rows;
+    this->last_add_width = this->cols;
+    this->markDirty(start_row, 0, strip_ptr->rows, this->cols);
+    return 0;
+}
+
+
+
 /*
     Updates teh content of the bitmap according to the new img_ptr,
     a while loop can be used to call proper resizing of bitmap as it 
     returns 1 if dimensions do not suffice
 */
 int p2b::Bitmap::updateFromImage(cv::Mat* update_img_ptr){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
     /*
     if (
         (this->rows < update_img_ptr->rows) || 
@@ -446,25 +837,137 @@ int p2b::Bitmap::updateFromImage(cv::Mat* update_img_ptr){
     }
     */
 
-    this->vec = p2b::toBits(update_img_ptr, this->pixel_size, this->thresholds_v);
-    
-    this->rows = update_img_ptr->rows;
-    this->cols = (update_img_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte;
+    if (this->allocate(
+        update_img_ptr->rows,
+        (update_img_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte
+    ) != 0){
+        ERROR_MSG("unable to resize the backing file of the bitmap");
+        return 1;
+    }
+
+    //? fromImage_parallel also resets the last_add values to the whole bitmap
+    return this->fromImage_parallel(update_img_ptr);
+}
+
+/*
+    Incremental version of updateFromImage for frames that mostly repeat the previous one:
+    every band of DIRTY_TILE_ROWS rows is quantized in a scratch buffer and compared with the
+    stored bytes DIRTY_TILE_BYTES at a time, only the tiles that differ are written and marked dirty.
+    Dirty tiles are merged in horizontal runs, and runs spanning the same columns in consecutive bands
+    are merged vertically
+*/
+int p2b::Bitmap::updateFromImage_incremental(cv::Mat* update_img_ptr){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+
+    if (update_img_ptr->channels() == 2 || update_img_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
+    }
+    if (
+        (update_img_ptr->rows != this->rows) ||
+        ((update_img_ptr->cols+this->pixels_per_byte-1)/this->pixels_per_byte != this->cols)
+    ){
+        return this->updateFromImage(update_img_ptr);
+    }
+    this->width = update_img_ptr->cols;
+
+    //? The runs found in every band are kept in vectors of the calling thread reused across calls
+    static thread_local vector<vector<DirtyRect>> band_rects_scratch;
+    const long n_bands = (this->rows + DIRTY_TILE_ROWS - 1)/DIRTY_TILE_ROWS;
+    vector<vector<DirtyRect>>& band_rects = band_rects_scratch;
+    if ((long) band_rects.size() < n_bands) band_rects.resize(n_bands);
+    for (long b=0; b<n_bands; ++b) band_rects[b].clear();
+
+    //? Every band is a task of its own, the scratch rows of each thread are kept across bands and calls
+    //? and come from the buffer pool like the payloads
+    p2b::parallelFor(
+        n_bands,
+        [this, update_img_ptr, &band_rects](long b) -> void {
+            static thread_local Buffer scratch;
+            if (scratch.getSize() < (size_t) (DIRTY_TILE_ROWS*this->stride)) scratch = Buffer(DIRTY_TILE_ROWS*this->stride, 255);
+
+            const long r0 = b*DIRTY_TILE_ROWS;
+            const long height = min(DIRTY_TILE_ROWS, this->rows - r0);
+
+            p2b::encodeRows(
+                update_img_ptr->ptr<uint8_t>(r0), update_img_ptr->step[0], update_img_ptr->channels(),
+                height, update_img_ptr->cols, scratch.getData(), this->stride,
+                this->pixel_size, this->thresholds_v.data(), this->packed_lut, this->luma_weights
+            );
+
+            long run_start = -1;
+            for (long c=0; c<this->cols; c+=DIRTY_TILE_BYTES){
+                const long width = min(DIRTY_TILE_BYTES, this->cols - c);
+                bool changed = false;
+                for (long i=0; i<height; ++i){
+                    const uint8_t* new_bytes = scratch.getData() + i*this->stride + c;
+                    uint8_t* old_bytes = this->row(r0 + i) + c;
+                    if (memcmp(old_bytes, new_bytes, width) != 0){
+                        memcpy(old_bytes, new_bytes, width);
+                        changed = true;
+                    }
+                }
+                if (changed && run_start == -1) run_start = c;
+                if (!changed && run_start != -1){
+                    band_rects[b].push_back({r0, run_start, height, c - run_start});
+                    run_start = -1;
+                }
+            }
+            if (run_start != -1) band_rects[b].push_back({r0, run_start, height, this->cols - run_start});
+        }
+    );
+
+    for (long b=0; b<n_bands; ++b){
+        for (const DirtyRect& rect : band_rects[b]) this->recordWrite(rect.row, rect.col, rect.height, rect.width);
+    }
+
+    //? Runs of a band are only compared with the rects ending right above it
+    static thread_local vector<size_t> prev_rects;
+    static thread_local vector<size_t> band_ends;
+    prev_rects.clear();
+    for (long b=0; b<n_bands; ++b){
+        band_ends.clear();
+        for (const DirtyRect& rect : band_rects[b]){
+            size_t k = 0;
+            while (k < prev_rects.size() && (this->dirty_rects[prev_rects[k]].col != rect.col || this->dirty_rects[prev_rects[k]].width != rect.width)) ++k;
+            if (k < prev_rects.size()){
+                this->dirty_rects[prev_rects[k]].height += rect.height;
+                band_ends.push_back(prev_rects[k]);
+            }
+            else {
+                this->dirty_rects.push_back(rect);
+                band_ends.push_back(this->dirty_rects.size() - 1);
+            }
+        }
+        prev_rects.swap(band_ends);
+    }
 
     this->last_add_r0 = 0;
     this->last_add_c0 = 0;
     this->last_add_height = this->rows;
     this->last_add_width = this->cols;
-
     return 0;
+
 }
 
 /*
     Function to update only a region of the original bitmap,
     start_row and start_col are the indexes from which to start updating,
-    referring to image pixel indexes and not to bitmap's
+    referring to image pixel indexes and not to bitmap's.
+    The image is quantized in place, pixels outside the region are never modified
 */
 int p2b::Bitmap::updateRegionFromImage(cv::Mat* update_img_ptr, long start_row, long start_col){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+    if (start_row < 0 || start_col < 0){
+        ERROR_MSG("start_row and start_col must not be negative");
+        return 1;
+    }
     if (
         (start_row + update_img_ptr->rows > this->rows) || 
         ((start_col + update_img_ptr->cols +this->pixels_per_byte-1)/this->pixels_per_byte > this->cols)
@@ -473,13 +976,18 @@ int p2b::Bitmap::updateRegionFromImage(cv::Mat* update_img_ptr, long start_row,
         return 1;
     }
 
-    vector<vector<uint8_t>> tmp_vec = p2b::toBits(update_img_ptr, this->pixel_size, this->thresholds_v);
-    for (long i=0; i<update_img_ptr->rows; ++i){
-        for (long j=0; j<update_img_ptr->cols; ++j){
-            this->vec[i+start_row][j+start_col] = tmp_vec[i][j];
-        }
+    if (update_img_ptr->channels() == 2 || update_img_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
     }
 
+    this->encodeImage(*update_img_ptr, start_row, start_col, true, true);
+    this->markDirty(
+        start_row,
+        start_col/this->pixels_per_byte,
+        update_img_ptr->rows,
+        (start_col + update_img_ptr->cols + this->pixels_per_byte-1)/this->pixels_per_byte - start_col/this->pixels_per_byte
+    );
     return 0;
 }
 
@@ -491,13 +999,25 @@ int p2b::Bitmap::updateRegionFromImage(cv::Mat* update_img_ptr, long start_row,
 
 
 int p2b::Bitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minimal_resizing){
+    if (this->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
     if (add_direction < 0 || add_direction > 3){
         ERROR_MSG("invalid add_direction constant (UP=0, RIGHT=1, DOWN=2, LEFT=3)");
         return 1;
     }
+    if (img_ptr->channels() == 2 || img_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
+    }
 
     //? Way to use addImage also as a first initialization of the bitmap
     if (this->last_add_r0 == -1 && this->last_add_c0 == -1){
+        if (this->allocate(img_ptr->rows, (img_ptr->cols + this->pixels_per_byte - 1)/this->pixels_per_byte) != 0){
+            ERROR_MSG("unable to resize the backing file of the bitmap");
+            return 1;
+        }
         return this->fromImage_parallel(img_ptr);
     }
 
@@ -506,7 +1026,6 @@ int p2b::Bitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minima
 
     long start_row;
     long start_col;
-    vector<vector<uint8_t>> tmp_vec = p2b::toBits(img_ptr, this->pixel_size, this->thresholds_v);
 
     /*
         ? This part of the code is quite tricky and most likely requires some graphical aid
@@ -518,8 +1037,7 @@ int p2b::Bitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minima
         
         case p2b::DIR_UP:
             while ((this->last_add_r0 - img_rows) < 0 || (img_cols + this->last_add_c0) > this->cols){
-                (!minimal_resizing) ? this->doubleSize(add_direction) : 
-                this->increaseSize(
+                const int resized = (!minimal_resizing) ? this->doubleSize(add_direction) : this->increaseSize(
                     MAX_SIZE(
                         this->rows, 
                         img_rows + this->rows - this->last_add_r0
@@ -530,21 +1048,16 @@ int p2b::Bitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minima
                     ), 
                     add_direction
                 );
+                if (resized != 0) return 1;
             }
 
             start_row = this->last_add_r0 - img_rows;
             start_col = this->last_add_c0;
-            for (long i=0; i<img_rows; ++i){
-                for (long j=0; j<img_cols; ++j){
-                    this->vec[i+start_row][j+start_col] = tmp_vec[i][j];
-                }
-            }
             break;
 
         case p2b::DIR_RIGHT:
             while ((this->last_add_c0 + this->last_add_width + img_cols) > this->cols || (this->last_add_r0 + img_rows) > this->rows){
-                (!minimal_resizing) ? this->doubleSize(add_direction) : 
-                this->increaseSize(
+                const int resized = (!minimal_resizing) ? this->doubleSize(add_direction) : this->increaseSize(
                     MAX_SIZE(
                         this->rows, 
                         img_rows + this->last_add_r0
@@ -555,21 +1068,16 @@ int p2b::Bitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minima
                     ), 
                     add_direction
                 );
+                if (resized != 0) return 1;
             }
 
             start_row = this->last_add_r0;
             start_col = this->last_add_c0 + this->last_add_width;
-            for (long i=0; i<img_rows; ++i){
-                for (long j=0; j<img_cols; ++j){
-                    this->vec[i+start_row][j+start_col] = tmp_vec[i][j];
-                }
-            }
             break;
 
         case p2b::DIR_DOWN:
             while ((this->last_add_r0 + this->last_add_height + img_rows) > this->rows || (this->last_add_c0 + img_cols) > this->cols){
-                (!minimal_resizing) ? this->doubleSize(add_direction) 
-                : this->increaseSize(
+                const int resized = (!minimal_resizing) ? this->doubleSize(add_direction) : this->increaseSize(
                     MAX_SIZE(
                         this->rows, 
                         img_rows + this->last_add_r0 + this->last_add_height
@@ -580,21 +1088,16 @@ int p2b::Bitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minima
                     ), 
                     add_direction
                 );
+                if (resized != 0) return 1;
             }
 
             start_row = this->last_add_r0 + this->last_add_height;
             start_col = this->last_add_c0;
-            for (long i=0; i<img_rows; ++i){
-                for (long j=0; j<img_cols; ++j){
-                    this->vec[i+start_row][j+start_col] = tmp_vec[i][j];
-                }
-            }
             break;
 
         case p2b::DIR_LEFT:
             while ((this->last_add_c0 - img_cols) < 0 || (img_rows + this->last_add_r0) > this->rows){
-                (!minimal_resizing) ? this->doubleSize(add_direction) : 
-                this->increaseSize(
+                const int resized = (!minimal_resizing) ? this->doubleSize(add_direction) : this->increaseSize(
                     MAX_SIZE(
                         this->rows, 
                         img_rows + this->last_add_r0
@@ -605,24 +1108,25 @@ int p2b::Bitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minima
                     ), 
                     add_direction
                 );
+                if (resized != 0) return 1;
             }
 
             start_row = this->last_add_r0;
             start_col = this->last_add_c0 - img_cols;
-            for (long i=0; i<img_rows; ++i){
-                for (long j=0; j<img_cols; ++j){
-                    this->vec[i+start_row][j+start_col] = tmp_vec[i][j];
-                }
-            }
             break;
     
     }
 
+    //? The image is quantized straight into its place on the canvas
+    this->encodeImage(*img_ptr, start_row, start_col*this->pixels_per_byte, false, true);
+    if (start_col + img_cols == this->cols) this->width = start_col*this->pixels_per_byte + img_ptr->cols;
+
     //? Update the values of the last added image
     this->last_add_r0 = start_row;
     this->last_add_c0 = start_col;
     this->last_add_height = img_rows;
     this->last_add_width = img_cols;
+    this->markDirty(start_row, start_col, img_rows, img_cols);
 
     return 0;
 
@@ -647,98 +1151,45 @@ int p2b::Bitmap::toGrayscaleImage_linear(cv::Mat* dst_img, const vector<uint8_t>
     size_t img_cols = this->cols * this->pixels_per_byte;
     dst_img->create(img_rows,img_cols,CV_8UC1);
 
-    size_t vec_j;
-    uint8_t p_value;
-    uint8_t r_shift;
+    uint8_t decode_table[256][8];
+    p2b::buildDecodeTable(this->pixel_size, grayscale_palette.data(), decode_table);
 
-    for (size_t i=0; i<img_rows; ++i){
-        for (size_t j=0; j<img_cols; ++j){
+    p2b::decodeRows(
+        this->row(0), this->stride, img_rows, this->cols,
+        dst_img->ptr<uint8_t>(0), dst_img->step[0], this->pixel_size, decode_table
+    );
 
-            vec_j = j/this->pixels_per_byte;
-            r_shift = (8-this->pixel_size) - ((j%this->pixels_per_byte) * this->pixel_size);
+    return 0;
 
-            switch (this->pixel_size) {
-            
-                case 1:
-                    switch (r_shift) {
-                        case 7:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_0) >> r_shift;
-                            break;
-                        case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_1) >> r_shift;
-                            break;
-                        case 5:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_2) >> r_shift;
-                            break;
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_3) >> r_shift;
-                            break;
-                        case 3:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_4) >> r_shift;
-                            break;
-                        case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_5) >> r_shift;
-                            break;
-                        case 1:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_6) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_7) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toGrayscaleImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
+}
 
-                case 2:
-                    switch (r_shift) {
-                        case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_0) >> r_shift;
-                            break;
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_1) >> r_shift;
-                            break;
-                        case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_2) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_3) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toGrayscaleImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
 
-                case 4:
-                    switch (r_shift) {
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_0) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_1) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toGrayscaleImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
-                
-                default:
-                    ERROR_MSG("invalid pixel_size value in toGrayscaleImage");
-                    exit(1);
-                    break;
 
-            }
+int p2b::Bitmap::toGrayscaleImage_parallel(cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette){
+
+    if (grayscale_palette.size() != this->pixel_values){
+        ERROR_MSG("grayscale_palette size doesn't match pixel_values");
+        return 1;
+    }
 
-            dst_img->at<uint8_t>(i,j) = (p_value!=this->pixel_values) ? grayscale_palette[p_value] : 0;
+    size_t img_rows = this->rows;
+    size_t img_cols = this->cols * this->pixels_per_byte;
+    dst_img->create(img_rows,img_cols,CV_8UC1);
 
+    //? The table is built once per call and shared read-only by the workers
+    uint8_t decode_table[256][8];
+    p2b::buildDecodeTable(this->pixel_size, grayscale_palette.data(), decode_table);
+
+    p2b::parallelRows(
+        this->rows,
+        this->cols*(1 + this->pixels_per_byte),
+        [this, dst_img, &decode_table](long first, long last) -> void {
+            p2b::decodeRows(
+                this->row(first), this->stride, last - first, this->cols,
+                dst_img->ptr<uint8_t>(first), dst_img->step[0], this->pixel_size, decode_table
+            );
         }
-    }
+    );
 
     return 0;
 
@@ -746,108 +1197,132 @@ int p2b::Bitmap::toGrayscaleImage_linear(cv::Mat* dst_img, const vector<uint8_t>
 
 
 
-int p2b::Bitmap::toGrayscaleImage_parallel(cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette){
+
+
+
+
+
+
+
+
+/*
+    Brings a previous rendering of the bitmap up to date by expanding only the dirty regions,
+    the dirty regions are left in place so that other consumers can still read them
+*/
+int p2b::Bitmap::updateGrayscaleImage(cv::Mat* dst_img, const vector<uint8_t>& grayscale_palette){
 
     if (grayscale_palette.size() != this->pixel_values){
         ERROR_MSG("grayscale_palette size doesn't match pixel_values");
         return 1;
     }
 
-    size_t img_rows = this->rows;
-    size_t img_cols = this->cols * this->pixels_per_byte;
-    dst_img->create(img_rows,img_cols,CV_8UC1);
+    if (
+        (dst_img->rows != this->rows) ||
+        (dst_img->cols != this->cols * this->pixels_per_byte) ||
+        (dst_img->type() != CV_8UC1)
+    ){
+        return this->toGrayscaleImage_parallel(dst_img, grayscale_palette);
+    }
 
-    dst_img->forEach<uint8_t>(
-        [this, grayscale_palette](uint8_t& pixel, const int* position) -> void {
+    uint8_t decode_table[256][8];
+    p2b::buildDecodeTable(this->pixel_size, grayscale_palette.data(), decode_table);
+
+    for (const DirtyRect& rect : this->dirty_rects){
+        p2b::parallelRows(
+            rect.height,
+            rect.width*(1 + this->pixels_per_byte),
+            [this, dst_img, &decode_table, &rect](long first, long last) -> void {
+                p2b::decodeRows(
+                    this->row(rect.row + first) + rect.col, this->stride, last - first, rect.width,
+                    dst_img->ptr<uint8_t>(rect.row + first) + rect.col*this->pixels_per_byte, dst_img->step[0],
+                    this->pixel_size, decode_table
+                );
+            }
+        );
+    }
 
-            int i = position[0];
-            int j = position[1];
+    return 0;
 
-            size_t vec_j = j/this->pixels_per_byte;
-            uint8_t p_value;
-            uint8_t r_shift = (8-this->pixel_size) - ((j%this->pixels_per_byte) * this->pixel_size);
+}
 
-            switch (this->pixel_size) {
-            
-                case 1:
-                    switch (r_shift) {
-                        case 7:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_0) >> r_shift;
-                            break;
-                        case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_1) >> r_shift;
-                            break;
-                        case 5:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_2) >> r_shift;
-                            break;
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_3) >> r_shift;
-                            break;
-                        case 3:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_4) >> r_shift;
-                            break;
-                        case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_5) >> r_shift;
-                            break;
-                        case 1:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_6) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_7) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toGrayscaleImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
 
-                case 2:
-                    switch (r_shift) {
-                        case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_0) >> r_shift;
-                            break;
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_1) >> r_shift;
-                            break;
-                        case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_2) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_3) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toGrayscaleImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
 
-                case 4:
-                    switch (r_shift) {
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_0) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_1) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toGrayscaleImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
-                
-                default:
-                    ERROR_MSG("invalid pixel_size value in toGrayscaleImage");
-                    exit(1);
-                    break;
 
-            }
+/*
+    Every output column is mapped once to the byte and the position inside it of its source pixel, so a row
+    reads only the bytes it samples and expands single pixels through the decode table.
+    Output rows sampling the same source row are copies of the previous one, unscaled rows starting
+    on a byte boundary go through decodeRows
+*/
+int p2b::Bitmap::renderViewport(
+    long row, long col, long height, long width,
+    long out_rows, long out_cols,
+    cv::Mat* dst_img, const vector<uint8_t>& grayscale_palette
+){
 
-            pixel = (p_value!=this->pixel_values) ? grayscale_palette[p_value] : 0;
-            
+    if (grayscale_palette.size() != this->pixel_values){
+        ERROR_MSG("grayscale_palette size doesn't match pixel_values");
+        return 1;
+    }
+    if (height <= 0 || width <= 0 || out_rows <= 0 || out_cols <= 0){
+        ERROR_MSG("the viewport rectangle and the output size must not be empty");
+        return 1;
+    }
+
+    //? Mat::create keeps the current allocation when the size and type are the same
+    dst_img->create(out_rows, out_cols, CV_8UC1);
+
+    uint8_t decode_table[256][8];
+    p2b::buildDecodeTable(this->pixel_size, grayscale_palette.data(), decode_table);
+
+    //? The sampled pixels grow with the output column, so the columns inside the bitmap are [x_first, x_last)
+    static thread_local vector<long> sampled_byte;
+    static thread_local vector<uint8_t> sampled_pos;
+    vector<long>& col_byte = sampled_byte;
+    vector<uint8_t>& col_pos = sampled_pos;
+    col_byte.resize(out_cols);
+    col_pos.resize(out_cols);
+    const long bm_pixels = this->cols * this->pixels_per_byte;
+    long x_first = out_cols, x_last = 0;
+    for (long x=0; x<out_cols; ++x){
+        const long p = col + ((2*x + 1)*width)/(2*out_cols);
+        if (p < 0 || p >= bm_pixels) continue;
+        col_byte[x] = p / this->pixels_per_byte;
+        col_pos[x] = p % this->pixels_per_byte;
+        x_first = min(x_first, x);
+        x_last = x + 1;
+    }
+    const bool unscaled = (width == out_cols && col % this->pixels_per_byte == 0);
+
+    p2b::parallelRows(
+        out_rows,
+        2*out_cols,
+        [&](long first, long last) -> void {
+            long prev_r = 0;
+            for (long y=first; y<last; ++y){
+                uint8_t* out = dst_img->ptr<uint8_t>(y);
+                const long r = row + ((2*y + 1)*height)/(2*out_rows);
+                if (y > first && r == prev_r){
+                    memcpy(out, dst_img->ptr<uint8_t>(y-1), out_cols);
+                    continue;
+                }
+                prev_r = r;
+                if (r < 0 || r >= this->rows || x_first >= x_last){
+                    memset(out, 0, out_cols);
+                    continue;
+                }
 
+                memset(out, 0, x_first);
+                memset(out + x_last, 0, out_cols - x_last);
+                const uint8_t* src = this->row(r);
+                long x = x_first;
+                if (unscaled){
+                    const long n_bytes = (x_last - x_first) / this->pixels_per_byte;
+                    p2b::decodeRows(src + col_byte[x], this->stride, 1, n_bytes, out + x, dst_img->step[0], this->pixel_size, decode_table);
+                    x += n_bytes * this->pixels_per_byte;
+                }
+                for (; x<x_last; ++x) out[x] = decode_table[src[col_byte[x]]][col_pos[x]];
+            }
         }
     );
 
@@ -891,28 +1366,28 @@ int p2b::Bitmap::toBGRImage_linear(cv::Mat* dst_img, const vector<cv::Vec3b>& BG
                 case 1:
                     switch (r_shift) {
                         case 7:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_0) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_0) >> r_shift;
                             break;
                         case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_1) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_1) >> r_shift;
                             break;
                         case 5:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_2) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_2) >> r_shift;
                             break;
                         case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_3) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_3) >> r_shift;
                             break;
                         case 3:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_4) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_4) >> r_shift;
                             break;
                         case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_5) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_5) >> r_shift;
                             break;
                         case 1:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_6) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_6) >> r_shift;
                             break;
                         case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_7) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P1_7) >> r_shift;
                             break;
                         default:
                             ERROR_MSG("unexpected r_shift value in toBGRImage");
@@ -924,16 +1399,16 @@ int p2b::Bitmap::toBGRImage_linear(cv::Mat* dst_img, const vector<cv::Vec3b>& BG
                 case 2:
                     switch (r_shift) {
                         case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_0) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P2_0) >> r_shift;
                             break;
                         case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_1) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P2_1) >> r_shift;
                             break;
                         case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_2) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P2_2) >> r_shift;
                             break;
                         case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_3) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P2_3) >> r_shift;
                             break;
                         default:
                             ERROR_MSG("unexpected r_shift value in toBGRImage");
@@ -945,10 +1420,10 @@ int p2b::Bitmap::toBGRImage_linear(cv::Mat* dst_img, const vector<cv::Vec3b>& BG
                 case 4:
                     switch (r_shift) {
                         case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_0) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P4_0) >> r_shift;
                             break;
                         case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_1) >> r_shift;
+                            p_value = (this->row(i)[vec_j] & AND_MASK_P4_1) >> r_shift;
                             break;
                         default:
                             ERROR_MSG("unexpected r_shift value in toBGRImage");
@@ -987,107 +1462,114 @@ int p2b::Bitmap::toBGRImage_parallel(cv::Mat* dst_img, const std::vector<std::ve
     size_t img_cols = this->cols * this->pixels_per_byte;
     dst_img->create(img_rows,img_cols,CV_8SC3);
 
-    dst_img->forEach<cv::Vec3b>(
-        [this, BGR_palette](cv::Vec3b& pixel, const int* position) -> void {
-
-            int i = position[0];
-            int j = position[1];
+    //? Same per-pixel body forEach ran, but over cache-sized chunks of whole rows on the library executor
+    auto paint_pixel = [this, &BGR_palette](cv::Vec3b& pixel, long i, long j) -> void {
 
-            size_t vec_j = j/this->pixels_per_byte;
-            uint8_t p_value;
-            uint8_t r_shift = (8-this->pixel_size) - ((j%this->pixels_per_byte) * this->pixel_size);
+        size_t vec_j = j/this->pixels_per_byte;
+        uint8_t p_value;
+        uint8_t r_shift = (8-this->pixel_size) - ((j%this->pixels_per_byte) * this->pixel_size);
 
-            switch (this->pixel_size) {
+        switch (this->pixel_size) {
+        
+            case 1:
+                switch (r_shift) {
+                    case 7:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_0) >> r_shift;
+                        break;
+                    case 6:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_1) >> r_shift;
+                        break;
+                    case 5:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_2) >> r_shift;
+                        break;
+                    case 4:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_3) >> r_shift;
+                        break;
+                    case 3:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_4) >> r_shift;
+                        break;
+                    case 2:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_5) >> r_shift;
+                        break;
+                    case 1:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_6) >> r_shift;
+                        break;
+                    case 0:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P1_7) >> r_shift;
+                        break;
+                    default:
+                        ERROR_MSG("unexpected r_shift value in toBGRImage");
+                        exit(1);
+                        break;
+                }
+                break;
+
+            case 2:
+                switch (r_shift) {
+                    case 6:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P2_0) >> r_shift;
+                        break;
+                    case 4:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P2_1) >> r_shift;
+                        break;
+                    case 2:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P2_2) >> r_shift;
+                        break;
+                    case 0:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P2_3) >> r_shift;
+                        break;
+                    default:
+                        ERROR_MSG("unexpected r_shift value in toBGRImage");
+                        exit(1);
+                        break;
+                }
+                break;
+
+            case 4:
+                switch (r_shift) {
+                    case 4:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P4_0) >> r_shift;
+                        break;
+                    case 0:
+                        p_value = (this->row(i)[vec_j] & AND_MASK_P4_1) >> r_shift;
+                        break;
+                    default:
+                        ERROR_MSG("unexpected r_shift value in toBGRImage");
+                        exit(1);
+                        break;
+                }
+                break;
             
-                case 1:
-                    switch (r_shift) {
-                        case 7:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_0) >> r_shift;
-                            break;
-                        case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_1) >> r_shift;
-                            break;
-                        case 5:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_2) >> r_shift;
-                            break;
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_3) >> r_shift;
-                            break;
-                        case 3:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_4) >> r_shift;
-                            break;
-                        case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_5) >> r_shift;
-                            break;
-                        case 1:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_6) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P1_7) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toBGRImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
+            default:
+                ERROR_MSG("invalid pixel_size value in toBGRImage");
+                exit(1);
+                break;
 
-                case 2:
-                    switch (r_shift) {
-                        case 6:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_0) >> r_shift;
-                            break;
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_1) >> r_shift;
-                            break;
-                        case 2:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_2) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P2_3) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toBGRImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
+        }
 
-                case 4:
-                    switch (r_shift) {
-                        case 4:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_0) >> r_shift;
-                            break;
-                        case 0:
-                            p_value = (this->vec[i][vec_j] & AND_MASK_P4_1) >> r_shift;
-                            break;
-                        default:
-                            ERROR_MSG("unexpected r_shift value in toBGRImage");
-                            exit(1);
-                            break;
-                    }
-                    break;
-                
-                default:
-                    ERROR_MSG("invalid pixel_size value in toBGRImage");
-                    exit(1);
-                    break;
+        //TODO: why is the pixel set to a generic gray value?
+        if (p_value != this->pixel_values){
+            pixel[0] = BGR_palette[p_value][0];
+            pixel[1] = BGR_palette[p_value][1];
+            pixel[2] = BGR_palette[p_value][2];
+        }
+        else {
+            pixel[0] = 0;
+            pixel[1] = 0;
+            pixel[2] = 0;
+        }
+        //pixel = (p_value!=this->pixel_values) ? BGR_palette[p_value] : cv::Vec3b(0,0,0);
 
-            }
+    };
 
-            //TODO: why is the pixel set to a generic gray value?
-            if (p_value != this->pixel_values){
-                pixel[0] = BGR_palette[p_value][0];
-                pixel[1] = BGR_palette[p_value][1];
-                pixel[2] = BGR_palette[p_value][2];
-            }
-            else {
-                pixel[0] = 0;
-                pixel[1] = 0;
-                pixel[2] = 0;
+    p2b::parallelRows(
+        img_rows,
+        img_cols*3 + this->cols,
+        [dst_img, img_cols, &paint_pixel](long first, long last) -> void {
+            for (long i=first; i<last; ++i){
+                cv::Vec3b* dst_row = dst_img->ptr<cv::Vec3b>(i);
+                for (long j=0; j<(long) img_cols; ++j) paint_pixel(dst_row[j], i, j);
             }
-            //pixel = (p_value!=this->pixel_values) ? BGR_palette[p_value] : cv::Vec3b(0,0,0);
-
         }
     );
 
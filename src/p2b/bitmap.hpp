@@ -31,8 +31,13 @@
 
 #pragma once
 
+#include "buffer.hpp"
+#include "count_index.hpp"
+
 #include <cstdint>
 #include <cstddef>
+#include <span>
+#include <string>
 #include <vector>
 #include <opencv4/opencv2/core/mat.hpp>
 
@@ -93,6 +98,47 @@ const int DIR_DOWN = 2;
 const int DIR_LEFT = 3;
 
 
+//? Fixed point luma weights used to convert BGR(A) pixels, they sum to 1 << LUMA_SHIFT
+const int LUMA_SHIFT = 14;
+
+struct LumaWeights{
+    uint16_t b;
+    uint16_t g;
+    uint16_t r;
+};
+
+const LumaWeights LUMA_BT601 = {1868, 9617, 4899};    //? Same weights as cv::COLOR_BGR2GRAY
+const LumaWeights LUMA_BT709 = {1183, 11718, 3483};
+
+//? Granularity of the dirty regions tracked by Bitmap, in rows and bytes
+const long DIRTY_TILE_ROWS = 16;
+const long DIRTY_TILE_BYTES = 32;
+
+//? Written regions kept by Bitmap for consumers that track their own position in them,
+//? past this many the log is restarted and those consumers rebuild everything
+const size_t WRITE_LOG_MAX = 4096;
+
+/**
+* @brief Rectangle of a bitmap whose bytes changed, in rows and bytes (not image pixels)
+*/
+struct DirtyRect{
+    long row;
+    long col;
+    long height;
+    long width;
+};
+
+/**
+    @brief Converts floating point luma weights to their fixed point representation, to use with
+    Bitmap::setLumaWeights or toBitmap. The rounding error goes to the largest weight, so the fixed point
+    weights sum to exactly 1 << LUMA_SHIFT and white stays 255
+    @param b, g, r: the weights of each channel, non negative and summing to 1 (within 1e-3)
+    @param luma_weights: where the converted weights are written, left untouched on error
+    @return 0 if ok, 1 if a weight is negative or not finite or the weights do not sum to 1
+*/
+int makeLumaWeights(float b, float g, float r, LumaWeights* luma_weights);
+
+
 
 /**
 * @brief The Bitmap class used to store informations, what the library revolves around
@@ -106,17 +152,38 @@ class Bitmap{
         */
         long rows;
         long cols;
+        //? Width in pixels of the content: the positions past it in the last byte of every row are
+        //? padding holding the reserved value, operators that could change them mask them back
+        long width;
         uint8_t pixel_size;
         uint8_t pixels_per_byte;
         uint8_t pixel_values;
         std::vector<uint8_t> thresholds_v;
 
+        //? Lookup tables built once from thresholds_v, indexed by the grayscale value:
+        //? level_lut holds the pixel value, packed_lut the same value repeated in every position of a byte
+        uint8_t level_lut[256];
+        uint8_t packed_lut[256];
+
         //? Values used to store informations about the last added image to the bitmap
         long last_add_r0;
         long last_add_c0;
         long last_add_height;
         long last_add_width;
 
+        //? Weights of the fused BGR(A) to grayscale conversion
+        LumaWeights luma_weights;
+
+        //? Regions written since the last clearDirtyRects, in window coordinates
+        std::vector<DirtyRect> dirty_rects;
+
+        //? Optional summed-area index of some levels, refreshed on every write when enabled
+        CountIndex count_index;
+
+        //? Regions written since write number write_log_start, restarted when the geometry changes
+        std::vector<DirtyRect> write_log;
+        uint64_t write_log_start;
+
         /*TODO
         We can include values, such as
             unsigned square_size
@@ -127,34 +194,177 @@ class Bitmap{
         value to estabilish the correct indexes of the square and the next one to add.
         */
 
-        std::vector<std::vector<uint8_t>> vec;
+        //? Single contiguous payload of cap_rows*stride bytes: the rows x cols bitmap is a window
+        //? of it starting at row org_r and byte org_c, so that increaseSize can grow in any direction
+        //? by only moving the origin. The headroom around it holds no meaningful value (a file backed
+        //? payload leaves it as holes of the file), increaseSize fills the bytes it exposes
+        Buffer buf;
+        long stride;
+        long cap_rows;
+        long org_r;
+        long org_c;
+
+        uint8_t* row(long i){ return this->buf.getData() + (this->org_r + i)*this->stride + this->org_c; }
+        const uint8_t* row(long i) const { return this->buf.getData() + (this->org_r + i)*this->stride + this->org_c; }
+        int allocate(long rows, long cols);
+        int reserve(long top, long bottom, long left, long right);
+        int relayoutFileBacked(long new_cap_rows, long new_stride, long new_org_r, long new_org_c);
+        void buildLookupTables();
+        void encodeImage(const cv::Mat& img, long start_row, long start_col, bool merge_edges, bool parallel);
+        void markDirty(long row, long col, long height, long width);
+        void refreshCountIndex(long row, long col, long height, long width);
+        void recordWrite(long row, long col, long height, long width);
+        void resetWriteLog();
 
     public:
 
         Bitmap();
         Bitmap(long rows, long cols, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v);
+        Bitmap(const Bitmap& other) = default;
+        Bitmap(Bitmap&& other) noexcept = default;
+        Bitmap& operator=(const Bitmap& other) = default;
+        Bitmap& operator=(Bitmap&& other) noexcept = default;
         ~Bitmap();
         
-        long getRows();
-        long getCols();
-        uint8_t getPixelSize();
-        uint8_t getPixelValues();
-        std::vector<uint8_t> getThresholds();
-        std::vector<std::vector<uint8_t>> getVec();
+        long getRows() const;
+        long getCols() const;
+        long getWidth() const;
+        //? Sets the width in pixels of the content, it must end in the last byte of every row
+        int setWidth(long width);
+        uint8_t getPixelSize() const;
+        uint8_t getPixelValues() const;
+        const std::vector<uint8_t>& getThresholds() const;
+        //? Replaces the thresholds used by the next conversions, the stored levels are not quantized again
+        int setThresholds(const std::vector<uint8_t>& thresholds_v);
+        long getStride() const;
+        //? Bytes of the payload and of the count index, if enabled
+        size_t getAllocatedBytes() const;
+        LumaWeights getLumaWeights() const;
+        void setLumaWeights(const LumaWeights& luma_weights);
+
+        //? Non-owning views of the payload, valid until the bitmap is resized, released or destroyed.
+        //? Writes made through getMatView must be reported with markWritten, and a read-only bitmap gets an empty Mat
+        std::span<const uint8_t> getRow(long i) const;
+        const uint8_t* getData() const;
+        cv::Mat getMatView();
+
+        /**
+            @brief Reports a region written through getMatView, so that the dirty regions,
+            the count index and the write log see it as they see the writes of the member functions
+            @param row, col: the top left corner of the region, in rows and bytes
+            @param height, width: the size of the region, in rows and bytes
+            @return 0 if ok, 1 if the region is empty or not inside the bitmap
+        */
+        int markWritten(long row, long col, long height, long width);
+
+        //? Deep copy of the payload without the row padding
+        std::vector<uint8_t> getVec() const;
+        //? Moves the whole allocation out (headroom included), leaving an empty 0x0 bitmap behind
+        Buffer releaseBuffer();
+
+        /**
+            @brief Writes the bitmap to a versioned .p2b file: header, thresholds, last added image and padded payload
+            @param path: the path of the file to create or overwrite
+            @return 0 if ok, 1 otherwise
+        */
+        int save(const std::string& path) const;
+
+        /**
+            @brief Replaces the bitmap with the content of a .p2b file, mapping the payload in place without copying it.
+            The loaded bitmap is read-only: functions that would modify it fail, a copy of it is writable
+            @param path: the path of the file written by save
+            @return 0 if ok, 1 otherwise
+        */
+        int load(const std::string& path);
+
+        //? True while the payload is a read-only mapping of a .p2b file
+        bool isReadOnly() const;
+
+        /**
+            @brief Moves the payload to a memory-mapped file, so that the bitmap can grow past the physical memory:
+            the file grows with ftruncate and mremap and the kernel pages cold regions out to it.
+            Copies of the bitmap are kept in memory. Only the window is written to the file, the headroom stays sparse
+            @param path: the path of the backing file, created or truncated
+            @return 0 if ok, 1 otherwise
+        */
+        int useFileStorage(const std::string& path);
+        bool isFileBacked() const;
 
         int increaseSize(const long new_rows, const long new_cols, const int resize_direction);
         int doubleSize(const int resize_direction);
 
         int fromImage_linear(cv::Mat* img_ptr);
         int fromImage_parallel(cv::Mat* img_ptr);
+        int fromImageStrip(cv::Mat* strip_ptr, long start_row);
 
         int updateFromImage(cv::Mat* update_img_ptr);
+        //? Only writes the bytes that differ from the new image, falls back to updateFromImage if the dimensions differ
+        int updateFromImage_incremental(cv::Mat* update_img_ptr);
         int updateRegionFromImage(cv::Mat* update_img_ptr, long start_row, long start_col);
 
         int addImage(cv::Mat* add_img_ptr, const int add_direction, bool minimal_resizing);
         
         int toGrayscaleImage_linear(cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette);
         int toGrayscaleImage_parallel(cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette);
+        //? Re-renders only the dirty regions into a previous rendering of the bitmap, or the whole bitmap if dst_img does not match
+        int updateGrayscaleImage(cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette);
+
+        /**
+            @brief Renders a rectangle of the bitmap scaled to an output size with nearest neighbour sampling,
+            decoding only the bytes it samples. dst_img keeps its allocation while the output size doesn't change,
+            so it can be a view into a larger framebuffer. For strong zoom-outs render a BitmapPyramid level instead
+            @param row, col: the top left pixel of the rectangle, it can extend past the bitmap whose outside renders as 0
+            @param height, width: the size of the rectangle in pixels
+            @param out_rows, out_cols: the size of the rendering
+            @param dst_img: the destination image, CV_8UC1
+            @param grayscale_palette: the grayscale values of the pixel values
+            @return 0 if ok, 1 if the palette doesn't match or a size is not positive
+        */
+        int renderViewport(
+            long row, long col, long height, long width,
+            long out_rows, long out_cols,
+            cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette
+        );
+
+        //? Dirty regions accumulate across updates until the consumer clears them
+        const std::vector<DirtyRect>& getDirtyRects() const;
+        void clearDirtyRects();
+
+        /**
+            @brief Builds a summed-area index of the pixels at some levels, kept up to date by every function
+            writing the bitmap (addImage, updateRegionFromImage, ...) and by markWritten after writes made through getMatView
+            @param levels: the levels to index, pixel_values being the pixels without information.
+            Every level costs 2 bytes per pixel, so only the queried ones should be indexed
+            @return 0 if ok, 1 if levels is empty, a level is out of range or the bitmap has more than 2^32-1 pixels
+        */
+        int enableCountIndex(const std::vector<uint8_t>& levels);
+        void disableCountIndex();
+        bool hasCountIndex() const;
+        size_t getCountIndexBytes() const;
+
+        /**
+            @brief Number of pixels at level inside a rectangle, from the count index, in constant time independent of the size
+            of the rectangle. The first query after a write also rebuilds the per-tile table of the index (one entry per 128 x 128 pixels),
+            so queries are not thread safe until that one has returned
+            @param level: a level indexed by enableCountIndex
+            @param row, col: the top left pixel of the rectangle
+            @param height, width: the size of the rectangle in pixels
+            @return the count, -1 if there is no index, the level is not indexed or the rectangle is not inside the bitmap
+        */
+        long countInRect(uint8_t level, long row, long col, long height, long width) const;
+
+        //? Number of writes made to the bitmap, the position of a consumer in the write log
+        uint64_t getWriteGeneration() const;
+
+        /**
+            @brief Regions written since a previous getWriteGeneration, for consumers that cache data derived
+            from the bitmap (BitmapPyramid) and want to refresh only what changed
+            @param generation: the value of getWriteGeneration when the consumer was last up to date
+            @param rects: the destination vector of the written regions, in rows and bytes
+            @return true if rects holds every write since generation, false if the log was restarted
+            since then (resize, reallocation, too many writes) and everything has to be considered written
+        */
+        bool getWritesSince(uint64_t generation, std::vector<DirtyRect>* rects) const;
 
         //! toBGRImage functions do not work
         //TODO debug and fix
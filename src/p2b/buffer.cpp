@@ -0,0 +1,355 @@
+#include "buffer.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+p2b::BufferPool::BufferPool(){
+    this->enabled = false;
+    this->huge_pages = false;
+    this->max_cached_bytes = POOL_MAX_CACHED_BYTES;
+    this->allocations = 0;
+    this->reuses = 0;
+    this->cached_blocks = 0;
+    this->cached_bytes = 0;
+}
+
+p2b::BufferPool::~BufferPool(){
+    this->trim();
+}
+
+
+
+/*
+    Huge page blocks are anonymous mappings: MAP_HUGETLB only succeeds when huge pages have been
+    reserved by the administrator, otherwise the mapping is only advised to use transparent huge pages
+*/
+uint8_t* p2b::BufferPool::allocateBlock(size_t block_size, bool huge){
+    uint8_t* block = nullptr;
+    if (huge){
+        void* addr = mmap(nullptr, block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED){
+            addr = mmap(nullptr, block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (addr != MAP_FAILED) madvise(addr, block_size, MADV_HUGEPAGE);
+        }
+        block = (addr != MAP_FAILED) ? (uint8_t*) addr : nullptr;
+    }
+    else block = (uint8_t*) aligned_alloc(BUFFER_ALIGNMENT, block_size);
+
+    if (block == nullptr){
+        ERROR_MSG("unable to allocate bitmap buffer");
+        exit(1);
+    }
+    return block;
+}
+
+void p2b::BufferPool::freeBlock(uint8_t* block, size_t block_size, bool huge){
+    if (huge) munmap(block, block_size);
+    else free(block);
+}
+
+
+
+void p2b::BufferPool::setEnabled(bool enabled, size_t max_cached_bytes){
+    {
+        lock_guard<mutex> lock(this->pool_mutex);
+        this->enabled = enabled;
+        this->max_cached_bytes = max_cached_bytes;
+    }
+    if (!enabled) this->trim();
+}
+
+void p2b::BufferPool::setHugePages(bool huge_pages){
+    lock_guard<mutex> lock(this->pool_mutex);
+    this->huge_pages = huge_pages;
+}
+
+
+
+/*
+    Blocks are matched by their exact size, which is the requested size rounded up to the alignment
+    (aligned_alloc requires it) or to the huge page size
+*/
+uint8_t* p2b::BufferPool::acquire(size_t size, size_t* block_size, bool* huge){
+    {
+        lock_guard<mutex> lock(this->pool_mutex);
+        *huge = this->huge_pages && size >= HUGE_PAGE_SIZE;
+        const size_t unit = (*huge) ? HUGE_PAGE_SIZE : BUFFER_ALIGNMENT;
+        *block_size = (size + unit - 1) / unit * unit;
+
+        auto& free_map = (*huge) ? this->free_huge_blocks : this->free_blocks;
+        auto it = free_map.find(*block_size);
+        if (it != free_map.end() && !it->second.empty()){
+            uint8_t* block = it->second.back();
+            it->second.pop_back();
+            this->reuses++;
+            this->cached_blocks--;
+            this->cached_bytes -= *block_size;
+            return block;
+        }
+    }
+
+    this->allocations++;
+    return allocateBlock(*block_size, *huge);
+}
+
+void p2b::BufferPool::recycle(uint8_t* block, size_t block_size, bool huge){
+    {
+        lock_guard<mutex> lock(this->pool_mutex);
+        if (this->enabled && this->cached_bytes + block_size <= this->max_cached_bytes){
+            auto& free_map = huge ? this->free_huge_blocks : this->free_blocks;
+            free_map[block_size].push_back(block);
+            this->cached_blocks++;
+            this->cached_bytes += block_size;
+            return;
+        }
+    }
+    freeBlock(block, block_size, huge);
+}
+
+void p2b::BufferPool::trim(){
+    lock_guard<mutex> lock(this->pool_mutex);
+    for (auto& [block_size, blocks] : this->free_blocks){
+        for (uint8_t* block : blocks) freeBlock(block, block_size, false);
+    }
+    for (auto& [block_size, blocks] : this->free_huge_blocks){
+        for (uint8_t* block : blocks) freeBlock(block, block_size, true);
+    }
+    this->free_blocks.clear();
+    this->free_huge_blocks.clear();
+    this->cached_blocks = 0;
+    this->cached_bytes = 0;
+}
+
+p2b::PoolStats p2b::BufferPool::getStats() const {
+    lock_guard<mutex> lock(this->pool_mutex);
+    return {this->allocations.load(), this->reuses, this->cached_blocks, this->cached_bytes};
+}
+
+
+
+p2b::BufferPool& p2b::sharedBufferPool(){
+    //? Leaked on purpose, static and thread_local Buffers may be released after it would be destroyed
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+
+
+
+
+void p2b::Buffer::allocateBlock(size_t size){
+    this->data_ptr = sharedBufferPool().acquire(size, &this->block_size, &this->huge_block);
+}
+
+
+
+p2b::Buffer::Buffer(){
+    this->data_ptr = nullptr;
+    this->size = 0;
+    this->map_addr = nullptr;
+    this->map_size = 0;
+    this->fd = -1;
+    this->block_size = 0;
+    this->huge_block = false;
+}
+
+
+
+p2b::Buffer::Buffer(size_t size, uint8_t fill_value){
+    this->data_ptr = nullptr;
+    this->size = size;
+    this->map_addr = nullptr;
+    this->map_size = 0;
+    this->fd = -1;
+    this->block_size = 0;
+    this->huge_block = false;
+    if (size == 0) return;
+
+    this->allocateBlock(size);
+    memset(this->data_ptr, fill_value, size);
+}
+
+
+
+//? Copying a mapped Buffer allocates a private, writable copy of its bytes
+p2b::Buffer::Buffer(const Buffer& other){
+    this->data_ptr = nullptr;
+    this->size = other.size;
+    this->map_addr = nullptr;
+    this->map_size = 0;
+    this->fd = -1;
+    this->block_size = 0;
+    this->huge_block = false;
+    if (other.size == 0) return;
+
+    this->allocateBlock(other.size);
+    memcpy(this->data_ptr, other.data_ptr, other.size);
+}
+
+
+
+p2b::Buffer::Buffer(Buffer&& other) noexcept {
+    this->data_ptr = exchange(other.data_ptr, nullptr);
+    this->size = exchange(other.size, 0);
+    this->map_addr = exchange(other.map_addr, nullptr);
+    this->map_size = exchange(other.map_size, 0);
+    this->fd = exchange(other.fd, -1);
+    this->block_size = exchange(other.block_size, 0);
+    this->huge_block = exchange(other.huge_block, false);
+}
+
+
+
+/*
+    A heap Buffer of the same size is overwritten in place, so copying into it does not allocate
+*/
+p2b::Buffer& p2b::Buffer::operator=(const Buffer& other){
+    if (this != &other && this->data_ptr != nullptr && !this->isMapped() && this->size == other.size){
+        memcpy(this->data_ptr, other.data_ptr, other.size);
+    }
+    else if (this != &other){
+        Buffer tmp(other);
+        *this = move(tmp);
+    }
+    return *this;
+}
+
+
+
+p2b::Buffer& p2b::Buffer::operator=(Buffer&& other) noexcept {
+    if (this != &other){
+        this->release();
+        this->data_ptr = exchange(other.data_ptr, nullptr);
+        this->size = exchange(other.size, 0);
+        this->map_addr = exchange(other.map_addr, nullptr);
+        this->map_size = exchange(other.map_size, 0);
+        this->fd = exchange(other.fd, -1);
+        this->block_size = exchange(other.block_size, 0);
+        this->huge_block = exchange(other.huge_block, false);
+    }
+    return *this;
+}
+
+
+
+p2b::Buffer::~Buffer(){
+    this->release();
+}
+
+
+
+p2b::Buffer p2b::Buffer::fromMapping(void* map_addr, size_t map_size, size_t offset, size_t size){
+    Buffer ret_buf;
+    ret_buf.data_ptr = (uint8_t*) map_addr + offset;
+    ret_buf.size = size;
+    ret_buf.map_addr = map_addr;
+    ret_buf.map_size = map_size;
+    return ret_buf;
+}
+
+
+
+/*
+    The mapping is at least one byte long even for empty Buffers, mmap does not accept empty mappings
+*/
+p2b::Buffer p2b::Buffer::fromFile(const string& path, size_t size){
+    Buffer ret_buf;
+    size_t map_size = (size > 0) ? size : 1;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1){
+        ERROR_MSG("unable to create the backing file " + path);
+        return ret_buf;
+    }
+    if (ftruncate(fd, map_size) != 0){
+        ERROR_MSG("unable to resize the backing file " + path);
+        close(fd);
+        return ret_buf;
+    }
+    void* map_addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map_addr == MAP_FAILED){
+        ERROR_MSG("unable to map the backing file " + path);
+        close(fd);
+        return ret_buf;
+    }
+
+    ret_buf.data_ptr = (uint8_t*) map_addr;
+    ret_buf.size = size;
+    ret_buf.map_addr = map_addr;
+    ret_buf.map_size = map_size;
+    ret_buf.fd = fd;
+    return ret_buf;
+}
+
+
+
+/*
+    The file is extended before the mapping and shrunk after it, so that no page of the
+    mapping is ever past the end of the file
+*/
+int p2b::Buffer::resize(size_t new_size){
+    if (this->fd == -1){
+        ERROR_MSG("only file backed buffers can be resized in place");
+        return 1;
+    }
+    size_t new_map_size = (new_size > 0) ? new_size : 1;
+
+    if (new_map_size > this->map_size && ftruncate(this->fd, new_map_size) != 0){
+        ERROR_MSG("unable to grow the backing file");
+        return 1;
+    }
+    void* new_addr = mremap(this->map_addr, this->map_size, new_map_size, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED){
+        ERROR_MSG("unable to remap the backing file");
+        return 1;
+    }
+    if (new_map_size < this->map_size && ftruncate(this->fd, new_map_size) != 0){
+        ERROR_MSG("unable to shrink the backing file");
+    }
+
+    this->data_ptr = (uint8_t*) new_addr;
+    this->size = new_size;
+    this->map_addr = new_addr;
+    this->map_size = new_map_size;
+    return 0;
+}
+
+
+
+/*
+    Only the whole pages inside the range are given back, the bytes sharing a page with the rest are left as they are
+*/
+void p2b::Buffer::discard(size_t offset, size_t length){
+    if (this->fd == -1 || length == 0) return;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t first = (offset + page - 1)/page*page;
+    const size_t last = (offset + length)/page*page;
+    if (first < last) madvise(this->data_ptr + first, last - first, MADV_REMOVE);
+}
+
+
+
+void p2b::Buffer::release(){
+    if (this->map_addr != nullptr) munmap(this->map_addr, this->map_size);
+    else if (this->data_ptr != nullptr) sharedBufferPool().recycle(this->data_ptr, this->block_size, this->huge_block);
+    if (this->fd != -1) close(this->fd);
+    this->data_ptr = nullptr;
+    this->map_addr = nullptr;
+    this->fd = -1;
+}
@@ -0,0 +1,248 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Alignment of every bitmap payload, one cache line
+const size_t BUFFER_ALIGNMENT = 64;
+
+//? Every bitmap row is padded to a multiple of this many bytes (one AVX2 register)
+const size_t ROW_PADDING = 32;
+
+//? Blocks of at least this many bytes are backed by huge pages when the pool is asked to
+const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+
+//? Default limit of the bytes kept by the pool for reuse
+const size_t POOL_MAX_CACHED_BYTES = 256*1024*1024;
+
+
+
+/**
+* @brief Counters of a BufferPool, allocations going up after the first frames means the
+* steady state is not allocation-free
+*/
+struct PoolStats{
+    size_t allocations;     //? Buffer blocks obtained from the system, pool enabled or not
+    size_t reuses;          //? Blocks handed out again from the pool
+    size_t cached_blocks;   //? Free blocks currently kept by the pool
+    size_t cached_bytes;
+};
+
+
+
+/**
+* @brief Recycles the blocks of released Buffers and hands them out again to Buffers of the same size,
+* so that per-frame Bitmaps and scratch buffers of a fixed geometry stop allocating their blocks after the first frames.
+* Every heap Buffer goes through the pool, which only keeps released blocks once enabled.
+* Its statistics only count Buffer blocks, not the other heap allocations of the library
+*/
+class BufferPool{
+
+    private:
+
+        mutable std::mutex pool_mutex;
+        //? Free blocks by block size, huge page blocks are kept apart as they are released with munmap
+        std::unordered_map<size_t, std::vector<uint8_t*>> free_blocks;
+        std::unordered_map<size_t, std::vector<uint8_t*>> free_huge_blocks;
+
+        bool enabled;
+        bool huge_pages;
+        size_t max_cached_bytes;
+
+        std::atomic<size_t> allocations;
+        size_t reuses;
+        size_t cached_blocks;
+        size_t cached_bytes;
+
+        static uint8_t* allocateBlock(size_t block_size, bool huge);
+        static void freeBlock(uint8_t* block, size_t block_size, bool huge);
+
+    public:
+
+        BufferPool();
+        BufferPool(const BufferPool& other) = delete;
+        BufferPool& operator=(const BufferPool& other) = delete;
+        ~BufferPool();
+
+        /**
+            @brief Starts or stops keeping released blocks, stopping also frees the kept ones
+            @param enabled: boolean flag to keep released blocks for reuse
+            @param max_cached_bytes: blocks released past this many kept bytes are freed (default=POOL_MAX_CACHED_BYTES)
+        */
+        void setEnabled(bool enabled, size_t max_cached_bytes=POOL_MAX_CACHED_BYTES);
+
+        /**
+            @brief Backs new blocks of at least HUGE_PAGE_SIZE bytes with huge pages: explicit ones (MAP_HUGETLB)
+            when the system has them reserved, transparent ones (MADV_HUGEPAGE) otherwise
+            @param huge_pages: boolean flag to use huge pages for big blocks
+        */
+        void setHugePages(bool huge_pages);
+
+        /**
+            @brief Hands out a block of at least size bytes, aligned to BUFFER_ALIGNMENT
+            @param size: the number of bytes needed
+            @param block_size: where to write the actual size of the block, needed to recycle it
+            @param huge: where to write whether the block is backed by huge pages, needed to recycle it
+            @return the block, its content is undefined
+        */
+        uint8_t* acquire(size_t size, size_t* block_size, bool* huge);
+
+        //? Takes back a block handed out by acquire, keeping it if the pool is enabled and not full
+        void recycle(uint8_t* block, size_t block_size, bool huge);
+
+        //? Frees every kept block
+        void trim();
+
+        PoolStats getStats() const;
+
+};
+
+
+
+/**
+    @brief The pool every heap Buffer is allocated from, disabled until setEnabled(true) is called on it.
+    It is never destroyed, so Buffers can be released at any time, even during static destruction
+    @return the shared pool
+*/
+BufferPool& sharedBufferPool();
+
+
+
+/**
+* @brief Owning, cache-line-aligned and contiguous block of bytes used as the payload of a Bitmap.
+* It can also own a memory mapping, in which case the bytes are a window of the mapping,
+* or a shared mapping of a whole file used as out-of-core storage that grows with the file
+*/
+class Buffer{
+
+    private:
+
+        uint8_t* data_ptr;
+        size_t size;
+
+        //? Whole mapping to release with munmap, nullptr when data_ptr comes from alignedAlloc
+        void* map_addr;
+        size_t map_size;
+        //? Backing file of a writable mapping, -1 for read-only mappings and allocated memory
+        int fd;
+        //? Size and kind of the pool block behind data_ptr, to give it back to the pool
+        size_t block_size;
+        bool huge_block;
+
+        void allocateBlock(size_t size);
+
+        void release();
+
+    public:
+
+        Buffer();
+        Buffer(size_t size, uint8_t fill_value);
+        Buffer(const Buffer& other);
+        Buffer(Buffer&& other) noexcept;
+        Buffer& operator=(const Buffer& other);
+        Buffer& operator=(Buffer&& other) noexcept;
+        ~Buffer();
+
+        /**
+            @brief Takes ownership of a memory mapping, without copying it
+            @param map_addr, map_size: the mapping as returned by mmap, released by the Buffer
+            @param offset: where the bytes of the Buffer start inside the mapping
+            @param size: how many bytes of the mapping the Buffer exposes
+            @return the Buffer owning the mapping
+        */
+        static Buffer fromMapping(void* map_addr, size_t map_size, size_t offset, size_t size);
+
+        /**
+            @brief Creates (or truncates) a file and maps it shared and writable, the file being the storage of the Buffer:
+            pages are written back by the kernel and can be evicted, so the Buffer can be bigger than physical memory.
+            The file is sparse: every byte reads as 0 and takes no disk space until written
+            @param path: the path of the backing file
+            @param size: the size in bytes of the Buffer
+            @return the Buffer owning the mapping and the file, an empty Buffer if the file cannot be created or mapped
+        */
+        static Buffer fromFile(const std::string& path, size_t size);
+
+        /**
+            @brief Grows or shrinks a file backed Buffer in place with ftruncate and mremap, the first
+            min(size, new_size) bytes are kept and the new ones read as 0 until written
+            @param new_size: the new size in bytes
+            @return 0 if ok, 1 if the Buffer is not file backed or the file cannot be resized
+        */
+        int resize(size_t new_size);
+
+        /**
+            @brief Punches a hole in the backing file over a range of a file backed Buffer, freeing its disk space:
+            the range reads as 0 until written. Does nothing on other Buffers
+            @param offset: the first byte of the range
+            @param length: the length in bytes of the range
+        */
+        void discard(size_t offset, size_t length);
+
+        uint8_t* getData(){ return this->data_ptr; }
+        const uint8_t* getData() const { return this->data_ptr; }
+        size_t getSize() const { return this->size; }
+        bool isMapped() const { return this->map_addr != nullptr; }
+        bool isFileBacked() const { return this->fd != -1; }
+        bool isReadOnly() const { return this->map_addr != nullptr && this->fd == -1; }
+
+};
+
+
+
+/**
+    @brief Rounds a row length in bytes up to the padded stride used by Bitmap
+    @param cols: the number of meaningful bytes in a row
+    @return the stride in bytes, a multiple of ROW_PADDING
+*/
+inline long paddedStride(long cols){
+    return (long) (((size_t) cols + ROW_PADDING - 1) / ROW_PADDING * ROW_PADDING);
+}
+
+
+
+}   //? End of p2b namespace
@@ -1,17 +1,22 @@
 #include "core.hpp"
 #include "bitmap.hpp"
+#include "threadpool.hpp"
 #include "utils.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <opencv2/core/hal/interface.h>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/core/matx.hpp>
 #include <opencv2/highgui.hpp>
+#include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
+#include <string>
 #include <vector>
 
 
@@ -24,7 +29,7 @@ using namespace std;
 
 
 
-p2b::Bitmap p2b::toBitmap(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel){
+p2b::Bitmap p2b::toBitmap(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel, const LumaWeights& luma_weights){
     
     uint8_t pixels_per_byte = 8/pixel_size;
 
@@ -32,6 +37,7 @@ p2b::Bitmap p2b::toBitmap(cv::Mat* img_ptr, uint8_t pixel_size, const std::vecto
     size_t bm_cols = (img_ptr->cols + pixels_per_byte - 1)/pixels_per_byte;
 
     p2b::Bitmap ret_bm = Bitmap(bm_rows, bm_cols, pixel_size, thresholds_v);
+    ret_bm.setLumaWeights(luma_weights);
     
     if (parallel) ret_bm.fromImage_parallel(img_ptr);
     else ret_bm.fromImage_linear(img_ptr);
@@ -47,7 +53,94 @@ p2b::Bitmap p2b::toBitmap(cv::Mat* img_ptr, uint8_t pixel_size, const std::vecto
 
 
 
-vector<vector<uint8_t>> p2b::toBits(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel){
+/*
+    Each image is quantized by a single worker with the linear kernels: the parallelism is across images,
+    so there is no per-image thread synchronization at all
+*/
+static int quantizeInto(cv::Mat* img_ptr, uint8_t pixel_size, const vector<uint8_t>& thresholds_v, const p2b::LumaWeights& luma_weights, p2b::Bitmap* dst_ptr){
+    uint8_t pixels_per_byte = 8/pixel_size;
+    if (img_ptr->rows == 0 || img_ptr->cols == 0) return 1;
+
+    p2b::Bitmap bm = p2b::Bitmap(img_ptr->rows, (img_ptr->cols + pixels_per_byte - 1)/pixels_per_byte, pixel_size, thresholds_v);
+    bm.setLumaWeights(luma_weights);
+    if (bm.fromImage_linear(img_ptr) != 0) return 1;
+
+    *dst_ptr = std::move(bm);
+    return 0;
+}
+
+
+
+int p2b::toBitmapBatch(const vector<string>& img_paths, uint8_t pixel_size, const vector<uint8_t>& thresholds_v, vector<Bitmap>* dst_v, const LumaWeights& luma_weights){
+
+    //? Same argument checks as toBitmap, before any work is queued
+    Bitmap(1, 1, pixel_size, thresholds_v);
+
+    //? Buffers of each worker, kept across images and across calls so same sized images never allocate them again
+    struct BatchScratch{
+        vector<uchar> file_bytes;
+        cv::Mat decoded;
+    };
+
+    dst_v->assign(img_paths.size(), Bitmap());
+    atomic<bool> failed(false);
+
+    p2b::parallelFor(
+        img_paths.size(),
+        [&img_paths, pixel_size, &thresholds_v, &luma_weights, dst_v, &failed](long i) -> void {
+            static thread_local BatchScratch scratch;
+
+            ifstream file(img_paths[i], ios::binary | ios::ate);
+            if (! file){
+                ERROR_MSG("unable to read " + img_paths[i]);
+                failed = true;
+                return;
+            }
+            scratch.file_bytes.resize(file.tellg());
+            file.seekg(0);
+            file.read((char*) scratch.file_bytes.data(), scratch.file_bytes.size());
+
+            cv::imdecode(scratch.file_bytes, cv::IMREAD_COLOR, &scratch.decoded);
+            if (scratch.decoded.empty() || quantizeInto(&scratch.decoded, pixel_size, thresholds_v, luma_weights, &(*dst_v)[i]) != 0){
+                ERROR_MSG("unable to decode " + img_paths[i]);
+                failed = true;
+            }
+        }
+    );
+
+    return (failed) ? 1 : 0;
+
+}
+
+
+
+int p2b::toBitmapBatch(const vector<cv::Mat>& imgs, uint8_t pixel_size, const vector<uint8_t>& thresholds_v, vector<Bitmap>* dst_v, const LumaWeights& luma_weights){
+
+    Bitmap(1, 1, pixel_size, thresholds_v);
+
+    dst_v->assign(imgs.size(), Bitmap());
+    atomic<bool> failed(false);
+
+    p2b::parallelFor(
+        imgs.size(),
+        [&imgs, pixel_size, &thresholds_v, &luma_weights, dst_v, &failed](long i) -> void {
+            cv::Mat img = imgs[i];    //? Shallow copy of the header, the pixels are only read
+            if (quantizeInto(&img, pixel_size, thresholds_v, luma_weights, &(*dst_v)[i]) != 0) failed = true;
+        }
+    );
+
+    return (failed) ? 1 : 0;
+
+}
+
+
+
+
+
+
+
+
+p2b::Buffer p2b::toBits(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel, const LumaWeights& luma_weights){
     
     uint8_t pixels_per_byte = 8/pixel_size;
 
@@ -55,11 +148,12 @@ vector<vector<uint8_t>> p2b::toBits(cv::Mat* img_ptr, uint8_t pixel_size, const
     size_t bm_cols = (img_ptr->cols + pixels_per_byte - 1)/pixels_per_byte;
 
     p2b::Bitmap bm = Bitmap(bm_rows, bm_cols, pixel_size, thresholds_v);
+    bm.setLumaWeights(luma_weights);
     
     if (parallel) bm.fromImage_parallel(img_ptr);
     else bm.fromImage_linear(img_ptr);
     
-    return bm.getVec();
+    return bm.releaseBuffer();
 
 }
 
@@ -71,8 +165,8 @@ vector<vector<uint8_t>> p2b::toBits(cv::Mat* img_ptr, uint8_t pixel_size, const
 
 
 
-int p2b::updateBitmap(Bitmap* bitmap_p, cv::Mat* update_img_ptr){
-    return bitmap_p->updateFromImage(update_img_ptr);
+int p2b::updateBitmap(Bitmap* bitmap_p, cv::Mat* update_img_ptr, bool incremental){
+    return (incremental) ? bitmap_p->updateFromImage_incremental(update_img_ptr) : bitmap_p->updateFromImage(update_img_ptr);
 }
 
 
@@ -36,6 +36,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <opencv4/opencv2/core/mat.hpp>
+#include <string>
 #include <vector>
 
 
@@ -57,29 +58,60 @@ namespace p2b {
     @param pixel_size: how many bits to use per pixel (1, 2 or 4)
     @param thresholds_v: the vector of uint8_t to use as thresholding to decide how to represent info
     @param parallel: boolean flag to perform parallel operations (default=true)
-    @return the Bitmap object correctly initialized 
+    @param luma_weights: the weights used to convert BGR(A) images to grayscale (default=LUMA_BT601)
+    @return the Bitmap object correctly initialized, its payload taken from sharedBufferPool
+    (not allocated again once a Bitmap of the same size has been released with the pool enabled).
+    A new Bitmap still allocates its small thresholds and bookkeeping vectors, per-frame code that must not
+    allocate keeps one Bitmap and calls updateFromImage or updateFromImage_incremental on it
 */
-Bitmap toBitmap(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel=true);
+Bitmap toBitmap(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel=true, const LumaWeights& luma_weights=LUMA_BT601);
 
 
 /**
-    @brief Transforms an OpenCV image in a matrix of bytes that follow the p2b rules
+    @brief Reads and converts many images at once on the current executor (see setExecutor), every worker decoding and quantizing
+    whole images with its own reusable file and decode buffers
+    @param img_paths: the paths of the images to read
+    @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+    @param thresholds_v: the vector of uint8_t to use as thresholding to decide how to represent info
+    @param dst_v: the destination vector, resized to hold the bitmaps in the same order as img_paths
+    @param luma_weights: the weights used to convert BGR images to grayscale (default=LUMA_BT601)
+    @return 0 if ok, 1 if some image could not be read (its bitmap is left default constructed)
+*/
+int toBitmapBatch(const std::vector<std::string>& img_paths, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, std::vector<Bitmap>* dst_v, const LumaWeights& luma_weights=LUMA_BT601);
+
+
+/**
+    @brief Converts many images at once on the current executor (see setExecutor), every worker quantizing whole images
+    @param imgs: the images to convert
+    @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+    @param thresholds_v: the vector of uint8_t to use as thresholding to decide how to represent info
+    @param dst_v: the destination vector, resized to hold the bitmaps in the same order as imgs
+    @param luma_weights: the weights used to convert BGR(A) images to grayscale (default=LUMA_BT601)
+    @return 0 if ok, 1 if some image could not be converted
+*/
+int toBitmapBatch(const std::vector<cv::Mat>& imgs, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, std::vector<Bitmap>* dst_v, const LumaWeights& luma_weights=LUMA_BT601);
+
+
+/**
+    @brief Transforms an OpenCV image in a contiguous block of bytes that follow the p2b rules
     @param img_ptr: the input image read by OpenCV
     @param pixel_size: how many bits to use per pixel (1, 2 or 4)
     @param thresholds_v: the vector of uint8_t to use as thresholding to decide how to represent info
     @param parallel: boolean flag to perform parallel operations (default=true)
-    @return the matrix of uint8_t corresponding to the bitmap
+    @param luma_weights: the weights used to convert BGR(A) images to grayscale (default=LUMA_BT601)
+    @return the payload of the bitmap, moved out without copies: row i starts at byte i*paddedStride(cols)
 */
-std::vector<std::vector<uint8_t>> toBits(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel=true);
+Buffer toBits(cv::Mat* img_ptr, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, bool parallel=true, const LumaWeights& luma_weights=LUMA_BT601);
 
 
 /**
     @brief Updates the content of the bitmap with the new image
     @param bitmap_ptr: the pointer to the bitmap object
     @param update_img_ptr: the pointer to the image to perform updating with
+    @param incremental: boolean flag to only write the bytes that changed and track them as dirty regions (default=false)
     @return 0 if ok, 1 otherwise
 */
-int updateBitmap(Bitmap* bitmap_ptr, cv::Mat* update_img_ptr);
+int updateBitmap(Bitmap* bitmap_ptr, cv::Mat* update_img_ptr, bool incremental=false);
 
 
 /**
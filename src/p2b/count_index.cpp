@@ -0,0 +1,272 @@
+#include "count_index.hpp"
+#include "threadpool.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+p2b::CountIndex::CountIndex(){
+    this->rows = 0;
+    this->cols = 0;
+    this->pixel_size = 0;
+    this->tile_rows = 0;
+    this->tile_cols = 0;
+    this->coarse_stale = false;
+    memset(this->plane_of, -1, sizeof(this->plane_of));
+}
+
+
+
+int p2b::CountIndex::build(const uint8_t* data, long stride, long rows, long cols, uint8_t pixel_size, const vector<uint8_t>& levels){
+
+    const int n_values = 1 << pixel_size;
+    vector<uint8_t> new_levels;
+    if (levels.empty()){
+        ERROR_MSG("at least one level to index is required");
+        return 1;
+    }
+    for (const uint8_t& level : levels){
+        if (level >= n_values){
+            ERROR_MSG("every level to index must be between 0 and pixel_values");
+            return 1;
+        }
+        if (find(new_levels.begin(), new_levels.end(), level) == new_levels.end()) new_levels.push_back(level);
+    }
+    if ((uint64_t) rows * cols * (8/pixel_size) > UINT32_MAX){
+        ERROR_MSG("count indexes are limited to bitmaps of 2^32-1 pixels");
+        return 1;
+    }
+
+    this->rows = rows;
+    this->cols = cols * (8/pixel_size);
+    this->pixel_size = pixel_size;
+    this->tile_rows = (this->rows + COUNT_TILE - 1)/COUNT_TILE;
+    this->tile_cols = (this->cols + COUNT_TILE - 1)/COUNT_TILE;
+    this->levels = new_levels;
+    memset(this->plane_of, -1, sizeof(this->plane_of));
+    for (size_t k=0; k<this->levels.size(); ++k) this->plane_of[this->levels[k]] = k;
+
+    const size_t n_planes = this->levels.size();
+    this->local.assign(n_planes * this->rows * this->cols, 0);
+    this->tile_totals.assign(n_planes * this->tile_rows * this->tile_cols, 0);
+    this->coarse.assign(n_planes * (this->tile_rows + 1) * (this->tile_cols + 1), 0);
+    this->row_bands.assign(n_planes * this->rows * (this->tile_cols + 1), 0);
+    this->col_bands.assign(n_planes * this->cols * (this->tile_rows + 1), 0);
+
+    this->update(data, stride, 0, 0, this->rows, this->cols);
+    return 0;
+
+}
+
+
+
+/*
+    Rebuilds the local table of every indexed level for one tile, a running count per level along each row
+    plus the local table of the row above
+*/
+void p2b::CountIndex::buildTile(const uint8_t* data, long stride, long tr, long tc){
+    const int ppb = 8/this->pixel_size;
+    const uint8_t pixel_mask = (1 << this->pixel_size) - 1;
+    const size_t n_planes = this->levels.size();
+    const size_t plane_size = this->rows * this->cols;
+
+    const long r0 = tr*COUNT_TILE;
+    const long r1 = min(this->rows, r0 + COUNT_TILE);
+    const long c0 = tc*COUNT_TILE;
+    const long c1 = min(this->cols, c0 + COUNT_TILE);
+
+    for (long i=r0; i<r1; ++i){
+        const uint8_t* row = data + i*stride;
+        uint16_t running[16] = {};
+        for (long j=c0; j<c1; ++j){
+            const uint8_t value = (row[j/ppb] >> ((8-this->pixel_size) - (j%ppb)*this->pixel_size)) & pixel_mask;
+            if (this->plane_of[value] >= 0) running[this->plane_of[value]]++;
+            for (size_t k=0; k<n_planes; ++k){
+                uint16_t* plane = this->local.data() + k*plane_size;
+                plane[i*this->cols + j] = running[k] + ((i > r0) ? plane[(i-1)*this->cols + j] : 0);
+            }
+        }
+    }
+
+    for (size_t k=0; k<n_planes; ++k){
+        this->tile_totals[(k*this->tile_rows + tr)*this->tile_cols + tc] = this->local[k*plane_size + (r1-1)*this->cols + (c1-1)];
+    }
+}
+
+
+
+/*
+    Summed areas of the tile totals: entry (a, b) holds the tiles in [0, a) x [0, b).
+    One entry per tile, so even a 16k x 16k bitmap only has 128 x 128 of them
+*/
+void p2b::CountIndex::refreshCoarse() const {
+    const long coarse_cols = this->tile_cols + 1;
+    for (size_t k=0; k<this->levels.size(); ++k){
+        const uint32_t* totals = this->tile_totals.data() + k*this->tile_rows*this->tile_cols;
+        uint32_t* table = this->coarse.data() + k*(this->tile_rows + 1)*coarse_cols;
+        for (long a=0; a<this->tile_rows; ++a){
+            uint32_t running = 0;
+            for (long b=0; b<this->tile_cols; ++b){
+                running += totals[a*this->tile_cols + b];
+                table[(a+1)*coarse_cols + b+1] = table[a*coarse_cols + b+1] + running;
+            }
+        }
+    }
+    this->coarse_stale = false;
+}
+
+
+
+/*
+    The tiles are independent and rebuilt in parallel, the coarse table is only marked out of date
+    so that a burst of writes rebuilds it once, at the next query.
+    The row (column) bands are only rebuilt for the rows (columns) of the touched tiles
+*/
+void p2b::CountIndex::update(const uint8_t* data, long stride, long row, long col, long height, long width){
+    if (!this->isEnabled() || height <= 0 || width <= 0) return;
+
+    const long tr_a = row/COUNT_TILE;
+    const long tr_b = min(this->rows - 1, row + height - 1)/COUNT_TILE;
+    const long tc_a = col/COUNT_TILE;
+    const long tc_b = min(this->cols - 1, col + width - 1)/COUNT_TILE;
+    const long n_tc = tc_b - tc_a + 1;
+    const long n_tiles = (tr_b - tr_a + 1) * n_tc;
+    const size_t n_planes = this->levels.size();
+
+    p2b::parallelFor(
+        n_tiles,
+        [this, data, stride, tr_a, tc_a, n_tc](long t) -> void {
+            this->buildTile(data, stride, tr_a + t/n_tc, tc_a + t%n_tc);
+        }
+    );
+    this->coarse_stale = true;
+
+    const size_t plane_size = this->rows * this->cols;
+    const long coarse_cols = this->tile_cols + 1;
+
+    const long band_r0 = tr_a*COUNT_TILE;
+    const long band_r1 = min(this->rows, (tr_b + 1)*COUNT_TILE);
+    p2b::parallelRows(
+        band_r1 - band_r0,
+        n_planes * coarse_cols * sizeof(uint32_t),
+        [this, band_r0, n_planes, plane_size, coarse_cols](long first, long last) -> void {
+            for (size_t k=0; k<n_planes; ++k){
+                const uint16_t* plane = this->local.data() + k*plane_size;
+                uint32_t* bands = this->row_bands.data() + k*this->rows*coarse_cols;
+                for (long i=band_r0+first; i<band_r0+last; ++i){
+                    bands[i*coarse_cols] = 0;
+                    for (long b=0; b<this->tile_cols; ++b){
+                        const long last_col = min(this->cols, (b + 1)*COUNT_TILE) - 1;
+                        bands[i*coarse_cols + b+1] = bands[i*coarse_cols + b] + plane[i*this->cols + last_col];
+                    }
+                }
+            }
+        }
+    );
+
+    const long band_c0 = tc_a*COUNT_TILE;
+    const long band_c1 = min(this->cols, (tc_b + 1)*COUNT_TILE);
+    const long coarse_rows = this->tile_rows + 1;
+    p2b::parallelRows(
+        band_c1 - band_c0,
+        n_planes * coarse_rows * sizeof(uint32_t),
+        [this, band_c0, n_planes, plane_size, coarse_rows](long first, long last) -> void {
+            for (size_t k=0; k<n_planes; ++k){
+                const uint16_t* plane = this->local.data() + k*plane_size;
+                uint32_t* bands = this->col_bands.data() + k*this->cols*coarse_rows;
+                for (long j=band_c0+first; j<band_c0+last; ++j){
+                    bands[j*coarse_rows] = 0;
+                    for (long a=0; a<this->tile_rows; ++a){
+                        const long last_row = min(this->rows, (a + 1)*COUNT_TILE) - 1;
+                        bands[j*coarse_rows + a+1] = bands[j*coarse_rows + a] + plane[last_row*this->cols + j];
+                    }
+                }
+            }
+        }
+    );
+}
+
+
+
+void p2b::CountIndex::clear(){
+    this->rows = 0;
+    this->cols = 0;
+    this->tile_rows = 0;
+    this->tile_cols = 0;
+    this->levels.clear();
+    memset(this->plane_of, -1, sizeof(this->plane_of));
+    this->local = vector<uint16_t>();
+    this->tile_totals = vector<uint32_t>();
+    this->coarse = vector<uint32_t>();
+    this->row_bands = vector<uint32_t>();
+    this->col_bands = vector<uint32_t>();
+    this->coarse_stale = false;
+}
+
+
+
+/*
+    Pixels at the level in [0, i] x [0, j]: the tiles fully above and left of (i, j), the tiles left of it
+    in its tile row, the tiles above it in its tile column and its own tile
+*/
+long p2b::CountIndex::prefix(int plane, long i, long j) const {
+    const long ti = i/COUNT_TILE;
+    const long tj = j/COUNT_TILE;
+    return
+        (long) this->coarse[(plane*(this->tile_rows + 1) + ti)*(this->tile_cols + 1) + tj] +
+        (long) this->row_bands[(plane*this->rows + i)*(this->tile_cols + 1) + tj] +
+        (long) this->col_bands[(plane*this->cols + j)*(this->tile_rows + 1) + ti] +
+        (long) this->local[(plane*this->rows + i)*this->cols + j];
+}
+
+
+
+long p2b::CountIndex::count(uint8_t level, long row, long col, long height, long width) const {
+    if (level >= 16 || this->plane_of[level] < 0){
+        ERROR_MSG("level is not indexed by the count index");
+        return -1;
+    }
+    if (row < 0 || col < 0 || height <= 0 || width <= 0 || row + height > this->rows || col + width > this->cols){
+        ERROR_MSG("the rectangle is not inside the bitmap");
+        return -1;
+    }
+
+    if (this->coarse_stale) this->refreshCoarse();
+
+    const int plane = this->plane_of[level];
+    const long r1 = row + height - 1;
+    const long c1 = col + width - 1;
+    long ret_count = this->prefix(plane, r1, c1);
+    if (row > 0) ret_count -= this->prefix(plane, row - 1, c1);
+    if (col > 0) ret_count -= this->prefix(plane, r1, col - 1);
+    if (row > 0 && col > 0) ret_count += this->prefix(plane, row - 1, col - 1);
+    return ret_count;
+}
+
+
+
+bool p2b::CountIndex::matches(long rows, long cols, uint8_t pixel_size) const {
+    return this->isEnabled() && this->pixel_size == pixel_size && this->rows == rows && this->cols == cols * (8/pixel_size);
+}
+
+
+
+size_t p2b::CountIndex::getAllocatedBytes() const {
+    return
+        this->local.capacity() * sizeof(uint16_t) +
+        (
+            this->tile_totals.capacity() + this->coarse.capacity() + this->row_bands.capacity() +
+            this->col_bands.capacity()
+        ) * sizeof(uint32_t);
+}
@@ -0,0 +1,142 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Side in pixels of the square tiles of a CountIndex, small enough for 16 bit tile-local counts
+const long COUNT_TILE = 128;
+
+
+
+/**
+* @brief Summed-area tables of the pixels at some levels of a packed bitmap, answering
+* "how many pixels of this rectangle are at this level" with a constant number of lookups.
+* The tables are split in two levels so that a write only rebuilds what it covers:
+* every COUNT_TILE x COUNT_TILE tile has its own local table, a coarse summed-area table sums the tiles,
+* and every row (column) keeps the counts of the tiles on its left (above it) in its tile row (column).
+* The coarse table, one entry per tile, is rebuilt by the first query after a write, so a burst of writes
+* pays for it once: a query is O(1), or O(tile_rows*tile_cols) when it follows a write.
+* Queries are therefore not thread safe until the first one after a write has returned.
+* Every indexed level costs 2 bytes per pixel, so only the levels that are queried should be indexed.
+* It works on the rows of the payload and is kept inside Bitmap, which updates it on every write
+*/
+class CountIndex{
+
+    private:
+
+        long rows;
+        long cols;          //? In pixels
+        uint8_t pixel_size;
+        long tile_rows;     //? Number of tiles vertically
+        long tile_cols;     //? Number of tiles horizontally
+
+        //? Indexed levels, and the plane of every level (-1 when it is not indexed)
+        std::vector<uint8_t> levels;
+        int8_t plane_of[16];
+
+        //? Per plane: tile-local summed areas (rows x cols), tile totals (tile_rows x tile_cols),
+        //? the summed areas of the tile totals ((tile_rows+1) x (tile_cols+1)), the counts of every row
+        //? left of each tile border (rows x (tile_cols+1)) and of every column above each tile border (cols x (tile_rows+1))
+        std::vector<uint16_t> local;
+        std::vector<uint32_t> tile_totals;
+        mutable std::vector<uint32_t> coarse;
+        std::vector<uint32_t> row_bands;
+        std::vector<uint32_t> col_bands;
+
+        //? Set by every update, the coarse table is out of date until the next query
+        mutable bool coarse_stale;
+
+        long prefix(int plane, long i, long j) const;
+        void buildTile(const uint8_t* data, long stride, long tr, long tc);
+        void refreshCoarse() const;
+
+    public:
+
+        CountIndex();
+
+        /**
+            @brief Allocates the tables for a bitmap geometry and builds them from its payload
+            @param data, stride: the first row of the payload and the distance in bytes between rows
+            @param rows, cols: the size of the bitmap in rows and bytes
+            @param pixel_size: the pixel size of the bitmap
+            @param levels: the levels to index, at least one
+            @return 0 if ok, 1 if levels is empty, a level is out of range or the bitmap has more than 2^32-1 pixels
+        */
+        int build(const uint8_t* data, long stride, long rows, long cols, uint8_t pixel_size, const std::vector<uint8_t>& levels);
+
+        /**
+            @brief Rebuilds the tables of the tiles covering a written region and the bands crossing them,
+            leaving the coarse table to the next query
+            @param data, stride: the first row of the payload and the distance in bytes between rows
+            @param row, col: the top left corner of the region, in rows and pixels
+            @param height, width: the size of the region, in rows and pixels
+        */
+        void update(const uint8_t* data, long stride, long row, long col, long height, long width);
+
+        //? Frees every table, the index is disabled until the next build
+        void clear();
+
+        /**
+            @brief Number of pixels at level inside a rectangle, from 4 prefix lookups of 4 table reads each.
+            The first query after an update first rebuilds the coarse table from the tile totals
+            @param level: an indexed level
+            @param row, col: the top left pixel of the rectangle
+            @param height, width: the size of the rectangle in pixels
+            @return the count, -1 if the level is not indexed or the rectangle is not inside the bitmap
+        */
+        long count(uint8_t level, long row, long col, long height, long width) const;
+
+        bool isEnabled() const { return !this->levels.empty(); }
+        //? True when the tables were built for a bitmap of this size in rows and bytes and of this pixel size
+        bool matches(long rows, long cols, uint8_t pixel_size) const;
+        const std::vector<uint8_t>& getLevels() const { return this->levels; }
+        size_t getAllocatedBytes() const;
+
+};
+
+
+
+}   //? End of p2b namespace
@@ -0,0 +1,206 @@
+#include "delta.hpp"
+#include "bitmap.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <opencv2/core/mat.hpp>
+#include <vector>
+
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+static inline uint64_t load64(const uint8_t* p){
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+
+
+/*
+    Folds every pixel of a XOR word onto its lowest bit and keeps only those bits,
+    so that the popcount of the result is the number of changed pixels
+*/
+static inline uint64_t foldPixels(uint64_t x, uint8_t pixel_size){
+    switch (pixel_size) {
+        case 2:
+            return (x | (x >> 1)) & 0x5555555555555555ULL;
+        case 4:
+            x |= x >> 1;
+            x |= x >> 2;
+            return x & 0x1111111111111111ULL;
+        default:
+            return x;
+    }
+}
+
+
+
+static long countChangedBytes(const uint8_t* a, const uint8_t* b, long n_bytes, uint8_t pixel_size){
+    long count = 0;
+    long j = 0;
+    for (; j+8<=n_bytes; j+=8){
+        count += __builtin_popcountll(foldPixels(load64(a+j) ^ load64(b+j), pixel_size));
+    }
+    for (; j<n_bytes; ++j){
+        count += __builtin_popcountll(foldPixels(a[j] ^ b[j], pixel_size));
+    }
+    return count;
+}
+
+
+
+
+
+int p2b::computeDelta(const Bitmap& base, const Bitmap& next, BitmapDelta* delta){
+
+    if (
+        (base.getRows() != next.getRows()) ||
+        (base.getCols() != next.getCols()) ||
+        (base.getPixelSize() != next.getPixelSize())
+    ){
+        ERROR_MSG("bitmaps must have the same rows, cols and pixel_size to compute a delta");
+        return 1;
+    }
+
+    const long rows = base.getRows();
+    const long cols = base.getCols();
+    delta->rows = rows;
+    delta->cols = cols;
+    delta->pixel_size = base.getPixelSize();
+    delta->runs.clear();
+    delta->xor_bytes.clear();
+
+    for (long i=0; i<rows; ++i){
+        const uint8_t* a = base.getRow(i).data();
+        const uint8_t* b = next.getRow(i).data();
+
+        long j = 0;
+        while (j < cols){
+            //? Unchanged stretches are skipped a word at a time
+            while (j+8 <= cols && load64(a+j) == load64(b+j)) j += 8;
+            while (j < cols && a[j] == b[j]) ++j;
+            if (j >= cols) break;
+
+            //? The run goes on until DELTA_MAX_GAP unchanged bytes in a row are found
+            const long start = j;
+            long last = j;
+            while (j < cols && j - last <= DELTA_MAX_GAP){
+                if (a[j] != b[j]) last = j;
+                ++j;
+            }
+            const long end = last + 1;
+
+            delta->runs.push_back({i, start, end - start});
+            for (long k=start; k<end; ++k){
+                delta->xor_bytes.push_back(a[k] ^ b[k]);
+            }
+            j = end;
+        }
+    }
+
+    return 0;
+
+}
+
+
+
+int p2b::applyDelta(Bitmap* bitmap_ptr, const BitmapDelta& delta){
+
+    if (
+        (bitmap_ptr->getRows() != delta.rows) ||
+        (bitmap_ptr->getCols() != delta.cols) ||
+        (bitmap_ptr->getPixelSize() != delta.pixel_size)
+    ){
+        ERROR_MSG("delta geometry doesn't match the bitmap");
+        return 1;
+    }
+    if (bitmap_ptr->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+
+    cv::Mat payload = bitmap_ptr->getMatView();
+    const uint8_t* xor_data = delta.xor_bytes.data();
+
+    for (const DeltaRun& run : delta.runs){
+        uint8_t* dst = payload.ptr<uint8_t>(run.row) + run.col;
+        long k = 0;
+        for (; k+8<=run.length; k+=8){
+            uint64_t word = load64(dst+k) ^ load64(xor_data+k);
+            memcpy(dst+k, &word, sizeof(word));
+        }
+        for (; k<run.length; ++k){
+            dst[k] ^= xor_data[k];
+        }
+        xor_data += run.length;
+    }
+
+    //? Runs come in row order: the span of every row is recorded, consecutive rows with the same span as one region
+    DirtyRect rect = {-1, 0, 0, 0};
+    for (size_t r=0; r<delta.runs.size(); ){
+        const long row = delta.runs[r].row;
+        long col = delta.runs[r].col;
+        long end = col + delta.runs[r].length;
+        for (++r; r<delta.runs.size() && delta.runs[r].row == row; ++r){
+            col = min(col, delta.runs[r].col);
+            end = max(end, delta.runs[r].col + delta.runs[r].length);
+        }
+        if (rect.row + rect.height == row && rect.col == col && rect.width == end - col) ++rect.height;
+        else {
+            if (rect.row != -1) bitmap_ptr->markWritten(rect.row, rect.col, rect.height, rect.width);
+            rect = {row, col, 1, end - col};
+        }
+    }
+    if (rect.row != -1) bitmap_ptr->markWritten(rect.row, rect.col, rect.height, rect.width);
+
+    return 0;
+
+}
+
+
+
+long p2b::countChangedPixels(const Bitmap& bitmap_a, const Bitmap& bitmap_b){
+
+    if (
+        (bitmap_a.getRows() != bitmap_b.getRows()) ||
+        (bitmap_a.getCols() != bitmap_b.getCols()) ||
+        (bitmap_a.getPixelSize() != bitmap_b.getPixelSize())
+    ){
+        ERROR_MSG("bitmaps must have the same rows, cols and pixel_size to be compared");
+        return -1;
+    }
+
+    long count = 0;
+    for (long i=0; i<bitmap_a.getRows(); ++i){
+        count += countChangedBytes(bitmap_a.getRow(i).data(), bitmap_b.getRow(i).data(), bitmap_a.getCols(), bitmap_a.getPixelSize());
+    }
+    return count;
+
+}
+
+
+
+long p2b::countChangedPixels(const BitmapDelta& delta){
+    //? XOR bytes against zero are the XOR themselves
+    static const uint8_t zeros[64] = {0};
+    long count = 0;
+    const uint8_t* xor_data = delta.xor_bytes.data();
+    long remaining = delta.xor_bytes.size();
+    while (remaining > 0){
+        long n = (remaining < 64) ? remaining : 64;
+        count += countChangedBytes(xor_data, zeros, n, delta.pixel_size);
+        xor_data += n;
+        remaining -= n;
+    }
+    return count;
+}
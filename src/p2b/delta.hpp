@@ -0,0 +1,116 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Runs of changed bytes closer than this many bytes are stored as a single run
+const long DELTA_MAX_GAP = 8;
+
+
+
+/**
+* @brief Run of bytes of a row that differ between two bitmaps
+*/
+struct DeltaRun{
+    long row;
+    long col;
+    long length;
+};
+
+/**
+* @brief Packed difference between two bitmaps of the same geometry: the XOR of every
+* run of changed bytes, stored back to back in xor_bytes in the order of the runs
+*/
+struct BitmapDelta{
+    long rows;
+    long cols;
+    uint8_t pixel_size;
+    std::vector<DeltaRun> runs;
+    std::vector<uint8_t> xor_bytes;
+};
+
+
+
+/**
+    @brief Computes the delta that turns base into next, comparing 8 bytes at a time
+    @param base: the bitmap the delta will be applied to
+    @param next: the bitmap the delta rebuilds
+    @param delta: the destination delta, its previous content is replaced
+    @return 0 if ok, 1 if the two bitmaps have different rows, cols or pixel_size
+*/
+int computeDelta(const Bitmap& base, const Bitmap& next, BitmapDelta* delta);
+
+
+/**
+    @brief XORs a delta into a bitmap, turning the base it was computed from into the next one.
+    The changed rows are recorded as written (dirty regions, count index, write log) like any other update
+    @param bitmap_ptr: the pointer to the bitmap to update in place
+    @param delta: the delta computed by computeDelta
+    @return 0 if ok, 1 if the geometry of the delta does not match the bitmap
+*/
+int applyDelta(Bitmap* bitmap_ptr, const BitmapDelta& delta);
+
+
+/**
+    @brief Counts the pixels that differ between two bitmaps without unpacking them:
+    the XOR of each 8 bytes word is folded so that every changed pixel leaves a single bit, then counted
+    @param bitmap_a, bitmap_b: two bitmaps with the same geometry
+    @return the number of changed pixels, -1 if the two bitmaps have different rows, cols or pixel_size
+*/
+long countChangedPixels(const Bitmap& bitmap_a, const Bitmap& bitmap_b);
+
+
+/**
+    @brief Counts the pixels a delta changes, in the same way as countChangedPixels
+    @param delta: the delta computed by computeDelta
+    @return the number of changed pixels
+*/
+long countChangedPixels(const BitmapDelta& delta);
+
+
+
+}   //? End of p2b namespace
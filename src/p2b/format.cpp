@@ -0,0 +1,103 @@
+#include "format.hpp"
+#include "buffer.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+p2b::FileHeader p2b::makeHeader(
+    long rows,
+    long cols,
+    long width,
+    uint8_t pixel_size,
+    const vector<uint8_t>& thresholds_v,
+    const LumaWeights& luma_weights,
+    long last_add_r0,
+    long last_add_c0,
+    long last_add_height,
+    long last_add_width
+){
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, P2B_MAGIC, sizeof(P2B_MAGIC));
+    header.version = P2B_VERSION;
+    header.pixel_size = pixel_size;
+    header.n_thresholds = thresholds_v.size();
+    header.luma_b = luma_weights.b;
+    header.luma_g = luma_weights.g;
+    header.luma_r = luma_weights.r;
+    copy(thresholds_v.begin(), thresholds_v.end(), header.thresholds);
+    header.rows = rows;
+    header.cols = cols;
+    header.width = width;
+    header.stride = paddedStride(cols);
+    header.last_add_r0 = last_add_r0;
+    header.last_add_c0 = last_add_c0;
+    header.last_add_height = last_add_height;
+    header.last_add_width = last_add_width;
+    header.payload_offset = (sizeof(FileHeader) + P2B_PAYLOAD_ALIGNMENT - 1) / P2B_PAYLOAD_ALIGNMENT * P2B_PAYLOAD_ALIGNMENT;
+    header.payload_size = (uint64_t) rows * header.stride;
+    return header;
+
+}
+
+
+
+int p2b::validateHeader(const FileHeader& header, size_t file_size){
+
+    if (memcmp(header.magic, P2B_MAGIC, sizeof(P2B_MAGIC)) != 0){
+        ERROR_MSG("not a .p2b file");
+        return 1;
+    }
+    if (header.version != P2B_VERSION){
+        ERROR_MSG("unsupported .p2b version");
+        return 1;
+    }
+    if (
+        (header.pixel_size != 1 && header.pixel_size != 2 && header.pixel_size != 4) ||
+        (header.n_thresholds != (1 << header.pixel_size) - 1) ||
+        (! is_sorted(header.thresholds, header.thresholds + header.n_thresholds))
+    ){
+        ERROR_MSG("invalid pixel_size or thresholds in .p2b header");
+        return 1;
+    }
+
+    //? The width is compared through the number of bytes it needs, cols*(8/pixel_size) could overflow.
+    //? Files without a width take cols*(8/pixel_size), so cols must still fit it
+    const int64_t ppb = 8/header.pixel_size;
+    const int64_t width_cols = header.width/ppb + (header.width % ppb != 0);
+    if (
+        (header.rows < 0) || (header.cols < 0) || (header.cols > INT64_MAX/ppb) ||
+        (header.stride < header.cols) || (header.stride % ROW_PADDING != 0) ||
+        (header.width < 0) || (header.width > 0 && width_cols != header.cols)
+    ){
+        ERROR_MSG("invalid dimensions in .p2b header");
+        return 1;
+    }
+
+    //? Bounds are checked against what's left of the file before any product or sum, which could overflow
+    if (
+        (header.payload_offset < sizeof(FileHeader)) || (header.payload_offset > file_size) ||
+        (header.payload_offset % P2B_PAYLOAD_ALIGNMENT != 0) ||
+        (header.stride > 0 && (uint64_t) header.rows > (file_size - header.payload_offset) / header.stride) ||
+        (header.payload_size != (uint64_t) header.rows * header.stride) ||
+        (header.payload_size > file_size - header.payload_offset)
+    ){
+        ERROR_MSG("truncated or corrupted .p2b payload");
+        return 1;
+    }
+    return 0;
+
+}
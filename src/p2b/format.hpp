@@ -0,0 +1,126 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Identifies .p2b files, followed by the version of the layout
+const char P2B_MAGIC[8] = {'P', '2', 'B', 'I', 'T', 'M', 'A', 'P'};
+const uint32_t P2B_VERSION = 1;
+
+//? The payload starts at a page boundary so that it can be mapped and used in place
+const size_t P2B_PAYLOAD_ALIGNMENT = 4096;
+
+
+
+/**
+* @brief Fixed size header at the start of every .p2b file, stored in the byte order of the machine
+* that wrote it (little endian on every platform we build for).
+* The payload follows at payload_offset: rows rows of stride bytes, each row padded with 0b11111111
+*/
+struct FileHeader{
+    char magic[8];
+    uint32_t version;
+    uint8_t pixel_size;
+    uint8_t n_thresholds;
+    uint16_t luma_b;
+    uint16_t luma_g;
+    uint16_t luma_r;
+    uint8_t thresholds[15];
+    uint8_t reserved_0[5];
+    int64_t rows;
+    int64_t cols;
+    int64_t stride;
+    int64_t last_add_r0;
+    int64_t last_add_c0;
+    int64_t last_add_height;
+    int64_t last_add_width;
+    uint64_t payload_offset;
+    uint64_t payload_size;
+    int64_t width;              //? Width of the content in pixels, 0 in files written before it was stored
+    uint8_t reserved_1[8];
+};
+
+static_assert(sizeof(FileHeader) == 128, "FileHeader must keep its on-disk size");
+
+
+
+/**
+    @brief Builds the header of a bitmap, the payload being rows rows of paddedStride(cols) bytes
+    @param rows, cols: the dimensions of the bitmap, cols in bytes
+    @param width: the width of the content in pixels, see Bitmap::getWidth
+    @param pixel_size: how many bits are used per pixel (1, 2 or 4)
+    @param thresholds_v: the thresholds of the bitmap
+    @param luma_weights: the weights used to convert BGR(A) images to grayscale
+    @param last_add_r0, last_add_c0, last_add_height, last_add_width: the last added image of the bitmap
+    @return the header to write at the start of the file
+*/
+FileHeader makeHeader(
+    long rows,
+    long cols,
+    long width,
+    uint8_t pixel_size,
+    const std::vector<uint8_t>& thresholds_v,
+    const LumaWeights& luma_weights,
+    long last_add_r0,
+    long last_add_c0,
+    long last_add_height,
+    long last_add_width
+);
+
+
+/**
+    @brief Checks that a header read from a file describes a payload this version can map.
+    Every size is checked against what's left of the file without overflowing, and the thresholds must be sorted
+    @param header: the header read from the start of the file
+    @param file_size: the size in bytes of the whole file
+    @return 0 if ok, 1 otherwise
+*/
+int validateHeader(const FileHeader& header, size_t file_size);
+
+
+
+}   //? End of p2b namespace
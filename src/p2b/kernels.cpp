@@ -0,0 +1,618 @@
+#include "kernels.hpp"
+#include "bitmap.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define P2B_X86 1
+#include <immintrin.h>
+#endif
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+//? SIMD kernels quantize and pack whole blocks of pixels, returning how many pixels they consumed
+typedef long (*BlockEncoder)(const uint8_t*, long, uint8_t*, const uint8_t*);
+
+//? SIMD kernels expanding whole blocks of 4 bit bytes, returning how many bytes they consumed
+typedef long (*NibbleDecoder)(const uint8_t*, long, uint8_t*, const uint8_t*);
+
+
+
+#ifdef P2B_X86
+
+template <int PIXEL_SIZE>
+__attribute__((target("avx2")))
+static long encodeBlocks_avx2(const uint8_t* gs_row, long n_pixels, uint8_t* bm_row, const uint8_t* thresholds){
+
+    typedef p2b::PixelTraits<PIXEL_SIZE> PT;
+
+    __m256i th_v[PT::n_thresholds];
+    for (int t=0; t<PT::n_thresholds; ++t){
+        th_v[t] = _mm256_set1_epi8((char) thresholds[t]);
+    }
+
+    //? Reverses every group of 8 bytes, so that movemask puts the first pixel in the MSB
+    const __m256i reverse_8 = _mm256_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+    );
+    //? maddubs weights: (p0 << 2) + p1 for 2 bit pixels, (p0 << 4) + p1 for 4 bit pixels
+    const __m256i mul_pairs = _mm256_set1_epi16((PIXEL_SIZE == 2) ? 0x0104 : 0x0110);
+    //? madd weights: (pair0 << 4) + pair1
+    const __m256i mul_quads = _mm256_set1_epi32(0x00010010);
+    //? Gathers the low byte of every 32 bit word in the low 4 bytes of each lane
+    const __m256i gather_dw = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    );
+
+    long j = 0;
+    for (; j+32 <= n_pixels; j+=32){
+
+        __m256i pixels = _mm256_loadu_si256((const __m256i*) (gs_row + j));
+
+        //? Pixel value = number of thresholds <= pixel, (max(p,t) == p) is an unsigned p >= t
+        __m256i levels = _mm256_setzero_si256();
+        for (int t=0; t<PT::n_thresholds; ++t){
+            __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(pixels, th_v[t]), pixels);
+            levels = _mm256_sub_epi8(levels, ge);
+        }
+
+        if constexpr (PIXEL_SIZE == 1){
+            __m256i msb = _mm256_shuffle_epi8(_mm256_slli_epi16(levels, 7), reverse_8);
+            uint32_t bits = (uint32_t) _mm256_movemask_epi8(msb);
+            memcpy(bm_row + j/8, &bits, 4);
+        }
+        else if constexpr (PIXEL_SIZE == 2){
+            __m256i quads = _mm256_madd_epi16(_mm256_maddubs_epi16(levels, mul_pairs), mul_quads);
+            __m256i packed = _mm256_shuffle_epi8(quads, gather_dw);
+            uint32_t lo = (uint32_t) _mm256_extract_epi32(packed, 0);
+            uint32_t hi = (uint32_t) _mm256_extract_epi32(packed, 4);
+            memcpy(bm_row + j/4, &lo, 4);
+            memcpy(bm_row + j/4 + 4, &hi, 4);
+        }
+        else {
+            __m256i pairs = _mm256_maddubs_epi16(levels, mul_pairs);
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0b00001000);
+            _mm_storeu_si128((__m128i*) (bm_row + j/2), _mm256_castsi256_si128(packed));
+        }
+
+    }
+
+    return j;
+
+}
+
+
+
+template <int PIXEL_SIZE>
+__attribute__((target("sse4.1")))
+static long encodeBlocks_sse41(const uint8_t* gs_row, long n_pixels, uint8_t* bm_row, const uint8_t* thresholds){
+
+    typedef p2b::PixelTraits<PIXEL_SIZE> PT;
+
+    __m128i th_v[PT::n_thresholds];
+    for (int t=0; t<PT::n_thresholds; ++t){
+        th_v[t] = _mm_set1_epi8((char) thresholds[t]);
+    }
+
+    const __m128i reverse_8 = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m128i mul_pairs = _mm_set1_epi16((PIXEL_SIZE == 2) ? 0x0104 : 0x0110);
+    const __m128i mul_quads = _mm_set1_epi32(0x00010010);
+    const __m128i gather_dw = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    long j = 0;
+    for (; j+16 <= n_pixels; j+=16){
+
+        __m128i pixels = _mm_loadu_si128((const __m128i*) (gs_row + j));
+
+        __m128i levels = _mm_setzero_si128();
+        for (int t=0; t<PT::n_thresholds; ++t){
+            __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(pixels, th_v[t]), pixels);
+            levels = _mm_sub_epi8(levels, ge);
+        }
+
+        if constexpr (PIXEL_SIZE == 1){
+            __m128i msb = _mm_shuffle_epi8(_mm_slli_epi16(levels, 7), reverse_8);
+            uint16_t bits = (uint16_t) _mm_movemask_epi8(msb);
+            memcpy(bm_row + j/8, &bits, 2);
+        }
+        else if constexpr (PIXEL_SIZE == 2){
+            __m128i quads = _mm_madd_epi16(_mm_maddubs_epi16(levels, mul_pairs), mul_quads);
+            uint32_t packed = (uint32_t) _mm_cvtsi128_si32(_mm_shuffle_epi8(quads, gather_dw));
+            memcpy(bm_row + j/4, &packed, 4);
+        }
+        else {
+            __m128i pairs = _mm_maddubs_epi16(levels, mul_pairs);
+            _mm_storel_epi64((__m128i*) (bm_row + j/2), _mm_packus_epi16(pairs, pairs));
+        }
+
+    }
+
+    return j;
+
+}
+
+
+
+__attribute__((target("avx2")))
+static long decodeNibbles_avx2(const uint8_t* bm_row, long n_bytes, uint8_t* gs_row, const uint8_t* palette_16){
+
+    const __m256i palette = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) palette_16));
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+    long j = 0;
+    for (; j+32 <= n_bytes; j+=32){
+
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (bm_row + j));
+        __m256i first = _mm256_shuffle_epi8(palette, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_nibble));
+        __m256i second = _mm256_shuffle_epi8(palette, _mm256_and_si256(bytes, low_nibble));
+
+        //? unpack interleaves inside each 128 bit lane, permute puts the lanes back in order
+        __m256i lo = _mm256_unpacklo_epi8(first, second);
+        __m256i hi = _mm256_unpackhi_epi8(first, second);
+        _mm256_storeu_si256((__m256i*) (gs_row + 2*j), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*) (gs_row + 2*j + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+
+    }
+
+    return j;
+
+}
+
+
+
+__attribute__((target("sse4.1")))
+static long decodeNibbles_sse41(const uint8_t* bm_row, long n_bytes, uint8_t* gs_row, const uint8_t* palette_16){
+
+    const __m128i palette = _mm_loadu_si128((const __m128i*) palette_16);
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+
+    long j = 0;
+    for (; j+16 <= n_bytes; j+=16){
+
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (bm_row + j));
+        __m128i first = _mm_shuffle_epi8(palette, _mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibble));
+        __m128i second = _mm_shuffle_epi8(palette, _mm_and_si128(bytes, low_nibble));
+
+        _mm_storeu_si128((__m128i*) (gs_row + 2*j), _mm_unpacklo_epi8(first, second));
+        _mm_storeu_si128((__m128i*) (gs_row + 2*j + 16), _mm_unpackhi_epi8(first, second));
+
+    }
+
+    return j;
+
+}
+
+#endif
+
+
+
+static p2b::SimdLevel supportedSimdLevel(){
+#ifdef P2B_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return p2b::SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return p2b::SIMD_SSE41;
+#endif
+    return p2b::SIMD_SCALAR;
+}
+
+static atomic<int>& simdLevel(){
+    static atomic<int> level(supportedSimdLevel());
+    return level;
+}
+
+
+
+p2b::SimdLevel p2b::setSimdLevel(SimdLevel level){
+    const SimdLevel supported = supportedSimdLevel();
+    const SimdLevel ret_level = (level < supported) ? level : supported;
+    simdLevel().store(ret_level, memory_order_relaxed);
+    return ret_level;
+}
+
+p2b::SimdLevel p2b::getSimdLevel(){ return (SimdLevel) simdLevel().load(memory_order_relaxed); }
+
+
+
+//? The kernels are selected once per call, so that setSimdLevel applies to the next one
+template <int PIXEL_SIZE>
+static BlockEncoder selectBlockEncoder(){
+#ifdef P2B_X86
+    switch (p2b::getSimdLevel()){
+        case p2b::SIMD_AVX2: return encodeBlocks_avx2<PIXEL_SIZE>;
+        case p2b::SIMD_SSE41: return encodeBlocks_sse41<PIXEL_SIZE>;
+        default: break;
+    }
+#endif
+    return nullptr;
+}
+
+
+
+static NibbleDecoder selectNibbleDecoder(){
+#ifdef P2B_X86
+    switch (p2b::getSimdLevel()){
+        case p2b::SIMD_AVX2: return decodeNibbles_avx2;
+        case p2b::SIMD_SSE41: return decodeNibbles_sse41;
+        default: break;
+    }
+#endif
+    return nullptr;
+}
+
+
+
+
+
+/*
+    Quantizes and packs one row of grayscale pixels, SIMD blocks first and then the packed lookup table.
+    Every byte is built in a register and written once, each OR mask keeps only the
+    PIXEL_SIZE bits of the corresponding position
+*/
+template <int PIXEL_SIZE>
+static void encodeGrayRow(const uint8_t* gs_row, long n_pixels, uint8_t* bm_row, BlockEncoder block_encoder, const uint8_t* thresholds, const uint8_t* packed_lut){
+
+    typedef p2b::PixelTraits<PIXEL_SIZE> PT;
+
+    //? SIMD blocks always end on a byte boundary
+    long j = (block_encoder != nullptr) ? block_encoder(gs_row, n_pixels, bm_row, thresholds) : 0;
+    long vec_j = j/PT::pixels_per_byte;
+
+    for (; j+PT::pixels_per_byte <= n_pixels; j+=PT::pixels_per_byte){
+        uint8_t byte = 255;
+        for (int k=0; k<PT::pixels_per_byte; ++k){
+            byte &= (packed_lut[gs_row[j+k]] | PT::orMask(k));
+        }
+        bm_row[vec_j++] = byte;
+    }
+
+    //? Pixels missing from the last byte keep the reserved 1, 11, 1111 value
+    if (j < n_pixels){
+        uint8_t byte = 255;
+        for (int k=0; j+k<n_pixels; ++k){
+            byte &= (packed_lut[gs_row[j+k]] | PT::orMask(k));
+        }
+        bm_row[vec_j] = byte;
+    }
+
+}
+
+
+
+template <int CHANNELS>
+static void lumaChunk(const uint8_t* bgr, long n_pixels, uint8_t* luma, const p2b::LumaWeights& w){
+    const uint32_t w_b = w.b, w_g = w.g, w_r = w.r;
+    const uint32_t round = 1 << (p2b::LUMA_SHIFT - 1);
+    for (long k=0; k<n_pixels; ++k){
+        const uint8_t* px = bgr + k*CHANNELS;
+        luma[k] = (uint8_t) ((px[0]*w_b + px[1]*w_g + px[2]*w_r + round) >> p2b::LUMA_SHIFT);
+    }
+}
+
+
+
+template <int PIXEL_SIZE, int CHANNELS>
+static void encodeRowsT(
+    const uint8_t* img_data, size_t img_step, long n_rows, long n_pixels,
+    uint8_t* bm_data, long bm_stride, const uint8_t* thresholds, const uint8_t* packed_lut,
+    const p2b::LumaWeights& luma_weights
+){
+
+    const BlockEncoder block_encoder = selectBlockEncoder<PIXEL_SIZE>();
+
+    for (long i=0; i<n_rows; ++i){
+
+        const uint8_t* img_row = img_data + i*img_step;
+        uint8_t* bm_row = bm_data + i*bm_stride;
+
+        if constexpr (CHANNELS == 1){
+            encodeGrayRow<PIXEL_SIZE>(img_row, n_pixels, bm_row, block_encoder, thresholds, packed_lut);
+        }
+        else {
+            //? LUMA_CHUNK is a multiple of 8, so every chunk starts on a byte boundary
+            alignas(p2b::BUFFER_ALIGNMENT) uint8_t luma[p2b::LUMA_CHUNK];
+            for (long j=0; j<n_pixels; j+=p2b::LUMA_CHUNK){
+                long n_chunk = (n_pixels-j < p2b::LUMA_CHUNK) ? n_pixels-j : p2b::LUMA_CHUNK;
+                lumaChunk<CHANNELS>(img_row + j*CHANNELS, n_chunk, luma, luma_weights);
+                encodeGrayRow<PIXEL_SIZE>(
+                    luma, n_chunk, bm_row + j/p2b::PixelTraits<PIXEL_SIZE>::pixels_per_byte,
+                    block_encoder, thresholds, packed_lut
+                );
+            }
+        }
+
+    }
+
+}
+
+
+
+template <int PIXEL_SIZE>
+static void encodeRowsChannels(
+    const uint8_t* img_data, size_t img_step, int channels, long n_rows, long n_pixels,
+    uint8_t* bm_data, long bm_stride, const uint8_t* thresholds, const uint8_t* packed_lut,
+    const p2b::LumaWeights& luma_weights
+){
+    switch (channels) {
+        case 1:
+            encodeRowsT<PIXEL_SIZE, 1>(img_data, img_step, n_rows, n_pixels, bm_data, bm_stride, thresholds, packed_lut, luma_weights);
+            break;
+        case 3:
+            encodeRowsT<PIXEL_SIZE, 3>(img_data, img_step, n_rows, n_pixels, bm_data, bm_stride, thresholds, packed_lut, luma_weights);
+            break;
+        case 4:
+            encodeRowsT<PIXEL_SIZE, 4>(img_data, img_step, n_rows, n_pixels, bm_data, bm_stride, thresholds, packed_lut, luma_weights);
+            break;
+    }
+}
+
+
+
+void p2b::encodeRows(
+    const uint8_t* img_data,
+    size_t img_step,
+    int channels,
+    long n_rows,
+    long n_pixels,
+    uint8_t* bm_data,
+    long bm_stride,
+    uint8_t pixel_size,
+    const uint8_t* thresholds,
+    const uint8_t* packed_lut,
+    const LumaWeights& luma_weights
+){
+    switch (pixel_size) {
+        case 1:
+            encodeRowsChannels<1>(img_data, img_step, channels, n_rows, n_pixels, bm_data, bm_stride, thresholds, packed_lut, luma_weights);
+            break;
+        case 2:
+            encodeRowsChannels<2>(img_data, img_step, channels, n_rows, n_pixels, bm_data, bm_stride, thresholds, packed_lut, luma_weights);
+            break;
+        case 4:
+            encodeRowsChannels<4>(img_data, img_step, channels, n_rows, n_pixels, bm_data, bm_stride, thresholds, packed_lut, luma_weights);
+            break;
+    }
+}
+
+
+
+
+
+template <int CHANNELS>
+static inline uint8_t grayAt(const uint8_t* img_row, long j, const p2b::LumaWeights& w){
+    if constexpr (CHANNELS == 1){
+        return img_row[j];
+    }
+    else {
+        const uint8_t* px = img_row + j*CHANNELS;
+        return (uint8_t) ((px[0]*w.b + px[1]*w.g + px[2]*w.r + (1 << (p2b::LUMA_SHIFT - 1))) >> p2b::LUMA_SHIFT);
+    }
+}
+
+
+
+/*
+    Writes n pixels starting at position first_pixel of a single byte, the other positions are preserved
+*/
+template <int PIXEL_SIZE, int CHANNELS>
+static inline void mergeByte(
+    const uint8_t* img_row, long n, uint8_t* bm_byte, int first_pixel,
+    const uint8_t* packed_lut, const p2b::LumaWeights& luma_weights
+){
+    typedef p2b::PixelTraits<PIXEL_SIZE> PT;
+    uint8_t byte = *bm_byte;
+    for (long k=0; k<n; ++k){
+        int pos = first_pixel + (int) k;
+        byte = (byte & PT::orMask(pos)) | (packed_lut[grayAt<CHANNELS>(img_row, k, luma_weights)] & PT::andMask(pos));
+    }
+    *bm_byte = byte;
+}
+
+
+
+template <int PIXEL_SIZE, int CHANNELS>
+static void encodeRegionRowsT(
+    const uint8_t* img_data, size_t img_step, long n_rows, long n_pixels,
+    uint8_t* bm_data, long bm_stride, int first_pixel, const uint8_t* thresholds, const uint8_t* packed_lut,
+    const p2b::LumaWeights& luma_weights
+){
+
+    typedef p2b::PixelTraits<PIXEL_SIZE> PT;
+
+    //? Pixels completing the first byte, then whole bytes, then the pixels starting the last byte
+    long lead = (first_pixel == 0) ? 0 : PT::pixels_per_byte - first_pixel;
+    if (lead > n_pixels) lead = n_pixels;
+    long full = (n_pixels - lead)/PT::pixels_per_byte * PT::pixels_per_byte;
+    long tail = n_pixels - lead - full;
+
+    uint8_t* full_data = bm_data + ((lead > 0) ? 1 : 0);
+
+    for (long i=0; i<n_rows; ++i){
+        const uint8_t* img_row = img_data + i*img_step;
+        uint8_t* bm_row = bm_data + i*bm_stride;
+        if (lead > 0){
+            mergeByte<PIXEL_SIZE, CHANNELS>(img_row, lead, bm_row, first_pixel, packed_lut, luma_weights);
+        }
+        if (tail > 0){
+            mergeByte<PIXEL_SIZE, CHANNELS>(
+                img_row + (lead+full)*CHANNELS, tail, full_data + i*bm_stride + full/PT::pixels_per_byte, 0,
+                packed_lut, luma_weights
+            );
+        }
+    }
+
+    if (full > 0){
+        encodeRowsT<PIXEL_SIZE, CHANNELS>(
+            img_data + lead*CHANNELS, img_step, n_rows, full, full_data, bm_stride, thresholds, packed_lut, luma_weights
+        );
+    }
+
+}
+
+
+
+template <int PIXEL_SIZE>
+static void encodeRegionRowsChannels(
+    const uint8_t* img_data, size_t img_step, int channels, long n_rows, long n_pixels,
+    uint8_t* bm_data, long bm_stride, int first_pixel, const uint8_t* thresholds, const uint8_t* packed_lut,
+    const p2b::LumaWeights& luma_weights
+){
+    switch (channels) {
+        case 1:
+            encodeRegionRowsT<PIXEL_SIZE, 1>(img_data, img_step, n_rows, n_pixels, bm_data, bm_stride, first_pixel, thresholds, packed_lut, luma_weights);
+            break;
+        case 3:
+            encodeRegionRowsT<PIXEL_SIZE, 3>(img_data, img_step, n_rows, n_pixels, bm_data, bm_stride, first_pixel, thresholds, packed_lut, luma_weights);
+            break;
+        case 4:
+            encodeRegionRowsT<PIXEL_SIZE, 4>(img_data, img_step, n_rows, n_pixels, bm_data, bm_stride, first_pixel, thresholds, packed_lut, luma_weights);
+            break;
+    }
+}
+
+
+
+void p2b::encodeRegionRows(
+    const uint8_t* img_data,
+    size_t img_step,
+    int channels,
+    long n_rows,
+    long n_pixels,
+    uint8_t* bm_data,
+    long bm_stride,
+    int first_pixel,
+    uint8_t pixel_size,
+    const uint8_t* thresholds,
+    const uint8_t* packed_lut,
+    const LumaWeights& luma_weights
+){
+    switch (pixel_size) {
+        case 1:
+            encodeRegionRowsChannels<1>(img_data, img_step, channels, n_rows, n_pixels, bm_data, bm_stride, first_pixel, thresholds, packed_lut, luma_weights);
+            break;
+        case 2:
+            encodeRegionRowsChannels<2>(img_data, img_step, channels, n_rows, n_pixels, bm_data, bm_stride, first_pixel, thresholds, packed_lut, luma_weights);
+            break;
+        case 4:
+            encodeRegionRowsChannels<4>(img_data, img_step, channels, n_rows, n_pixels, bm_data, bm_stride, first_pixel, thresholds, packed_lut, luma_weights);
+            break;
+    }
+}
+
+
+
+
+
+/*
+    Because of how the thresholding works, if we want to keep the 1, 11, 1111 values reserved
+    we have to ensure that the last threshold value is 255 for pixel_size != 1.
+    This should be enforced in the source code that calls this function
+*/
+void p2b::buildEncodeTables(uint8_t pixel_size, const uint8_t* thresholds, uint8_t level_lut[256], uint8_t packed_lut[256]){
+
+    const uint8_t pixels_per_byte = 8/pixel_size;
+    const int n_thresholds = (1 << pixel_size) - 1;
+
+    for (int gs_value=0; gs_value<256; ++gs_value){
+        uint8_t p_value = 0;
+        while (p_value < n_thresholds && gs_value >= thresholds[p_value]) ++p_value;
+
+        uint8_t packed = 0;
+        for (uint8_t k=0; k<pixels_per_byte; ++k){
+            packed = (packed << pixel_size) | p_value;
+        }
+
+        if (level_lut != nullptr) level_lut[gs_value] = p_value;
+        packed_lut[gs_value] = packed;
+    }
+
+}
+
+
+
+void p2b::buildDecodeTable(uint8_t pixel_size, const uint8_t* grayscale_palette, uint8_t decode_table[256][8]){
+
+    const uint8_t pixels_per_byte = 8/pixel_size;
+    const uint8_t pixel_values = (1 << pixel_size) - 1;
+
+    for (int byte=0; byte<256; ++byte){
+        for (uint8_t k=0; k<pixels_per_byte; ++k){
+            uint8_t r_shift = (8-pixel_size) - (k*pixel_size);
+            uint8_t p_value = (byte >> r_shift) & pixel_values;
+            decode_table[byte][k] = (p_value != pixel_values) ? grayscale_palette[p_value] : 0;
+        }
+        for (uint8_t k=pixels_per_byte; k<8; ++k){
+            decode_table[byte][k] = 0;
+        }
+    }
+
+}
+
+
+
+template <int PIXEL_SIZE>
+static void decodeRowsT(
+    const uint8_t* bm_data, long bm_stride, long n_rows, long n_bytes,
+    uint8_t* img_data, size_t img_step, const uint8_t decode_table[256][8]
+){
+
+    typedef p2b::PixelTraits<PIXEL_SIZE> PT;
+
+    NibbleDecoder nibble_decoder = nullptr;
+    uint8_t palette_16[16];
+    if constexpr (PIXEL_SIZE == 4){
+        nibble_decoder = selectNibbleDecoder();
+        //? The first pixel of the bytes 0xN0 is the palette entry of N
+        for (int p_value=0; p_value<16; ++p_value){
+            palette_16[p_value] = decode_table[p_value << 4][0];
+        }
+    }
+
+    for (long i=0; i<n_rows; ++i){
+
+        const uint8_t* bm_row = bm_data + i*bm_stride;
+        uint8_t* gs_row = img_data + i*img_step;
+
+        long j = (nibble_decoder != nullptr) ? nibble_decoder(bm_row, n_bytes, gs_row, palette_16) : 0;
+        for (; j<n_bytes; ++j){
+            memcpy(gs_row + PT::pixels_per_byte*j, decode_table[bm_row[j]], PT::pixels_per_byte);
+        }
+
+    }
+
+}
+
+
+
+void p2b::decodeRows(
+    const uint8_t* bm_data,
+    long bm_stride,
+    long n_rows,
+    long n_bytes,
+    uint8_t* img_data,
+    size_t img_step,
+    uint8_t pixel_size,
+    const uint8_t decode_table[256][8]
+){
+    switch (pixel_size) {
+        case 1:
+            decodeRowsT<1>(bm_data, bm_stride, n_rows, n_bytes, img_data, img_step, decode_table);
+            break;
+        case 2:
+            decodeRowsT<2>(bm_data, bm_stride, n_rows, n_bytes, img_data, img_step, decode_table);
+            break;
+        case 4:
+            decodeRowsT<4>(bm_data, bm_stride, n_rows, n_bytes, img_data, img_step, decode_table);
+            break;
+    }
+}
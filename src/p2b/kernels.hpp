@@ -0,0 +1,268 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstddef>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Instruction sets the kernels are dispatched to, POPCNT counting as part of SSE4.1
+enum SimdLevel{ SIMD_SCALAR = 0, SIMD_SSE41 = 1, SIMD_AVX2 = 2 };
+
+/**
+    @brief Caps the instruction set used by the dispatched kernels, the best one the CPU supports being
+    the default. Meant to run every kernel against the scalar path, not to be changed while converting
+    @param level: the highest instruction set to use
+    @return the level in use, level lowered to what the CPU supports
+*/
+SimdLevel setSimdLevel(SimdLevel level);
+SimdLevel getSimdLevel();
+
+
+
+/**
+* @brief Compile time constants of a pixel size, the kernels are instantiated once per pixel size
+* so that their inner loops have no branch on pixel_size or on the position inside the byte
+*/
+template <int PIXEL_SIZE>
+struct PixelTraits{
+
+    static_assert(PIXEL_SIZE == 1 || PIXEL_SIZE == 2 || PIXEL_SIZE == 4, "pixel_size is not one of {1, 2, 4}");
+
+    static constexpr int pixels_per_byte = 8/PIXEL_SIZE;
+    static constexpr uint8_t pixel_values = (1 << PIXEL_SIZE) - 1;
+    static constexpr int n_thresholds = (1 << PIXEL_SIZE) - 1;
+
+    //? Shift of the k-th pixel of a byte, the first pixel is stored in the most significant bits
+    static constexpr int shift(int k){ return (8-PIXEL_SIZE) - k*PIXEL_SIZE; }
+    //? Same as the AND_MASK_P* constants
+    static constexpr uint8_t andMask(int k){ return (uint8_t) (pixel_values << shift(k)); }
+    //? Same as the OR_MASK_P* constants
+    static constexpr uint8_t orMask(int k){ return (uint8_t) ~andMask(k); }
+
+};
+
+
+
+
+/*
+    Per-pixel operators on 64 bit words of packed 2 or 4 bit pixels: pixels never straddle a byte,
+    so shifts and subtractions only need masks to stay inside each pixel.
+    LOW has the lowest bit of every pixel set, HIGH the highest one
+*/
+template <int PIXEL_SIZE>
+struct PackedWordOps{
+
+    static constexpr uint64_t LOW = (PIXEL_SIZE == 2) ? 0x5555555555555555ULL : 0x1111111111111111ULL;
+    static constexpr uint64_t HIGH = (PIXEL_SIZE == 2) ? 0xAAAAAAAAAAAAAAAAULL : 0x8888888888888888ULL;
+
+    //? Spreads the highest bit of every pixel over the whole pixel
+    static inline uint64_t fromHigh(uint64_t x){
+        if constexpr (PIXEL_SIZE == 2) return x | (x >> 1);
+        else return x | (x >> 1) | (x >> 2) | (x >> 3);
+    }
+
+    //? Spreads the lowest bit of every pixel over the whole pixel
+    static inline uint64_t fromLow(uint64_t x){
+        if constexpr (PIXEL_SIZE == 2) return x | (x << 1);
+        else return x | (x << 1) | (x << 2) | (x << 3);
+    }
+
+    //? All-ones pixels, the reserved value
+    static inline uint64_t reserved(uint64_t x){
+        uint64_t y = x & (x >> 1);
+        if constexpr (PIXEL_SIZE == 4) y = y & (y >> 2);
+        return fromLow(y & LOW);
+    }
+
+    static inline uint64_t nonZero(uint64_t x){
+        uint64_t y = x | (x >> 1);
+        if constexpr (PIXEL_SIZE == 4) y = y | (y >> 2);
+        return fromLow(y & LOW);
+    }
+
+    //? Pixels of x greater than or equal to those of y: equal high bits are decided by
+    //? (x | HIGH) - (y & ~HIGH), which cannot borrow from the next pixel
+    static inline uint64_t greaterEqual(uint64_t x, uint64_t y){
+        uint64_t t = (x | HIGH) - (y & ~HIGH);
+        return fromHigh(((x & ~y) | (~(x ^ y) & t)) & HIGH);
+    }
+
+    //? Per-pixel maximum in which the reserved value gives way to the other pixel, reserved only if both are
+    static inline uint64_t maxKnown(uint64_t x, uint64_t y){
+        uint64_t ge = greaterEqual(x, y);
+        uint64_t ret = (x & ge) | (y & ~ge);
+        uint64_t res_x = reserved(x);
+        uint64_t res_y = reserved(y);
+        ret = (ret & ~res_x) | (y & res_x);
+        return (ret & ~res_y) | (x & res_y);
+    }
+
+};
+
+
+
+
+//? Number of pixels converted to luma at a time for BGR(A) images, small enough to stay in L1
+const long LUMA_CHUNK = 512;
+
+
+
+/**
+    @brief Quantizes rows of pixels and packs them into bitmap bytes.
+    Blocks of 32 (AVX2) or 16 (SSE4.1) pixels are compared against every threshold in parallel
+    when the CPU supports it, the rest of each row goes through the packed lookup table.
+    BGR(A) pixels are converted to luma LUMA_CHUNK pixels at a time in a small stack buffer with
+    fixed point weights and immediately quantized, so the source is read once and no grayscale image is allocated.
+    The kernel is dispatched on pixel_size once per call
+    @param img_data: the first pixel of the first row to convert
+    @param img_step: the distance in bytes between two rows of the image
+    @param channels: 1 for grayscale, 3 for BGR, 4 for BGRA pixels
+    @param n_rows: how many rows to convert
+    @param n_pixels: how many pixels each row contains
+    @param bm_data: the first destination byte, (n_pixels + pixels_per_byte - 1)/pixels_per_byte bytes are written per row
+    @param bm_stride: the distance in bytes between two rows of the bitmap
+    @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+    @param thresholds: the (1 << pixel_size) - 1 thresholds of the bitmap, sorted in ascending order
+    @param packed_lut: the 256 entries table of the bitmap holding the pixel value repeated in every position of a byte
+    @param luma_weights: the fixed point weights of the B, G and R channels
+*/
+void encodeRows(
+    const uint8_t* img_data,
+    size_t img_step,
+    int channels,
+    long n_rows,
+    long n_pixels,
+    uint8_t* bm_data,
+    long bm_stride,
+    uint8_t pixel_size,
+    const uint8_t* thresholds,
+    const uint8_t* packed_lut,
+    const LumaWeights& luma_weights
+);
+
+
+
+/**
+    @brief Same as encodeRows, but for a region starting anywhere inside a byte: the pixels that share
+    the first and last byte of each row with the region keep their current value in the bitmap
+    @param img_data: the first pixel of the first row to convert
+    @param img_step: the distance in bytes between two rows of the image
+    @param channels: 1 for grayscale, 3 for BGR, 4 for BGRA pixels
+    @param n_rows: how many rows to convert
+    @param n_pixels: how many pixels each row contains
+    @param bm_data: the byte of the first row holding the first pixel of the region
+    @param bm_stride: the distance in bytes between two rows of the bitmap
+    @param first_pixel: the position of the first pixel of the region inside its byte (0 to 8/pixel_size - 1)
+    @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+    @param thresholds: the (1 << pixel_size) - 1 thresholds of the bitmap, sorted in ascending order
+    @param packed_lut: the 256 entries table of the bitmap holding the pixel value repeated in every position of a byte
+    @param luma_weights: the fixed point weights of the B, G and R channels
+*/
+void encodeRegionRows(
+    const uint8_t* img_data,
+    size_t img_step,
+    int channels,
+    long n_rows,
+    long n_pixels,
+    uint8_t* bm_data,
+    long bm_stride,
+    int first_pixel,
+    uint8_t pixel_size,
+    const uint8_t* thresholds,
+    const uint8_t* packed_lut,
+    const LumaWeights& luma_weights
+);
+
+
+
+/**
+    @brief Precomputes the pixel value of every possible grayscale value, so that the conversion
+    costs a single lookup regardless of pixel_size. Shared by Bitmap and TiledBitmap
+    @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+    @param thresholds: the (1 << pixel_size) - 1 sorted thresholds
+    @param level_lut: the destination table of the pixel values, or nullptr if not needed
+    @param packed_lut: the destination table of the pixel values repeated in every position of a byte
+*/
+void buildEncodeTables(uint8_t pixel_size, const uint8_t* thresholds, uint8_t level_lut[256], uint8_t packed_lut[256]);
+
+
+
+/**
+    @brief Precomputes the grayscale pixels every possible bitmap byte expands to,
+    the reserved 1, 11, 1111 value is mapped to 0 and every other value to its palette entry
+    @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+    @param grayscale_palette: the (1 << pixel_size) - 1 grayscale values of the pixel values
+    @param decode_table: the destination table, the first 8/pixel_size bytes of each entry are used
+*/
+void buildDecodeTable(uint8_t pixel_size, const uint8_t* grayscale_palette, uint8_t decode_table[256][8]);
+
+
+
+/**
+    @brief Expands rows of bitmap bytes into grayscale pixels through a table built by buildDecodeTable.
+    With 4 bit pixels the palette is applied to 32 (AVX2) or 16 (SSE4.1) bytes at a time with a byte shuffle
+    when the CPU supports it, otherwise each byte is expanded with a single 8, 4 or 2 bytes store.
+    The kernel is dispatched on pixel_size once per call
+    @param bm_data: the first byte of the first row to expand
+    @param bm_stride: the distance in bytes between two rows of the bitmap
+    @param n_rows: how many rows to expand
+    @param n_bytes: how many bytes each row contains
+    @param img_data: the first destination pixel, n_bytes*8/pixel_size pixels are written per row
+    @param img_step: the distance in bytes between two rows of the image
+    @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+    @param decode_table: the table built by buildDecodeTable
+*/
+void decodeRows(
+    const uint8_t* bm_data,
+    long bm_stride,
+    long n_rows,
+    long n_bytes,
+    uint8_t* img_data,
+    size_t img_step,
+    uint8_t pixel_size,
+    const uint8_t decode_table[256][8]
+);
+
+
+
+}   //? End of p2b namespace
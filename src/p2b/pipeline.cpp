@@ -0,0 +1,187 @@
+#include "pipeline.hpp"
+#include "bitmap.hpp"
+#include "utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core/mat.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+//? Index sent down the queues once the source is exhausted
+static const int END_OF_STREAM = -1;
+
+
+
+static double elapsedMs(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end){
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+static void record(p2b::StageStats* stage, double ms){
+    stage->frames += 1;
+    stage->busy_ms += ms;
+    if (ms > stage->max_ms) stage->max_ms = ms;
+}
+
+
+
+
+
+p2b::FrameSource p2b::videoSource(const string& path){
+    shared_ptr<cv::VideoCapture> capture = make_shared<cv::VideoCapture>(path);
+    if (! capture->isOpened()){
+        ERROR_MSG("unable to open video " + path);
+    }
+    return [capture](cv::Mat* frame) -> bool {
+        return capture->isOpened() && capture->read(*frame);
+    };
+}
+
+
+
+/*
+    An image that cannot be read ends the sequence
+*/
+p2b::FrameSource p2b::imageSequenceSource(const vector<string>& paths){
+    return [paths, next = (size_t) 0](cv::Mat* frame) mutable -> bool {
+        if (next >= paths.size()) return false;
+        *frame = cv::imread(paths[next++]);
+        return ! frame->empty();
+    };
+}
+
+
+
+
+
+p2b::Pipeline::Pipeline(uint8_t pixel_size, const vector<uint8_t>& thresholds_v, size_t depth, const LumaWeights& luma_weights){
+    if (depth < 1){
+        ERROR_MSG("pipeline depth must be at least 1");
+        exit(1);
+    }
+    this->depth = depth;
+
+    //? Every slot keeps its bitmap across frames, so frames of the same size are quantized in place
+    Bitmap proto = Bitmap(1, 1, pixel_size, thresholds_v);
+    proto.setLumaWeights(luma_weights);
+    this->slots.resize(depth, {cv::Mat(), proto, -1, false, chrono::steady_clock::time_point()});
+
+    this->stats = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, 0, 0, 0, 0};
+}
+
+
+
+p2b::PipelineStats p2b::Pipeline::getStats() const { return this->stats; }
+
+
+
+/*
+    Slot indexes go round free -> decode -> quantize -> sink -> free, each queue having exactly
+    one producer and one consumer thread. Every stage keeps its own statistics, merged after the join.
+    The bitmap of a slot holds the frame depth frames back, so diffing against it would give the sink
+    dirty regions relative to that frame: the quantize stage instead updates one bitmap incrementally
+    against the previous frame and copies it into the slot (a memcpy of the payload once the sizes match).
+    A failure stops the decode stage and turns the frames still in flight into invalid slots, so the
+    queues drain and every thread reaches END_OF_STREAM
+*/
+int p2b::Pipeline::run(const FrameSource& source, const BitmapSink& sink){
+
+    SpscQueue<int> free_q(this->depth);
+    SpscQueue<int> decoded_q(this->depth);
+    SpscQueue<int> quantized_q(this->depth);
+    for (size_t s=0; s<this->depth; ++s) free_q.push(s);
+
+    PipelineStats run_stats = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, 0, 0, 0, 0};
+    double total_latency_ms = 0;
+    atomic<bool> failed(false);
+
+    const chrono::steady_clock::time_point t_run = chrono::steady_clock::now();
+
+    thread decode_thread([this, &source, &free_q, &decoded_q, &run_stats, &failed](){
+        long index = 0;
+        while (true){
+            int s = free_q.pop();
+            FrameSlot& slot = this->slots[s];
+            slot.t_start = chrono::steady_clock::now();
+            if (failed || ! source(&slot.frame) || slot.frame.empty()){
+                decoded_q.push(END_OF_STREAM);
+                break;
+            }
+            slot.index = index++;
+            record(&run_stats.decode, elapsedMs(slot.t_start, chrono::steady_clock::now()));
+            decoded_q.push(s);
+        }
+    });
+
+    thread quantize_thread([this, &decoded_q, &quantized_q, &run_stats, &failed](){
+        Bitmap previous = this->slots[0].bitmap;
+        while (true){
+            int s = decoded_q.pop();
+            if (s == END_OF_STREAM){
+                quantized_q.push(END_OF_STREAM);
+                break;
+            }
+            FrameSlot& slot = this->slots[s];
+            slot.valid = false;
+            if (! failed){
+                const chrono::steady_clock::time_point t_stage = chrono::steady_clock::now();
+                previous.clearDirtyRects();
+                if (previous.updateFromImage_incremental(&slot.frame) == 0){
+                    slot.bitmap = previous;
+                    slot.valid = true;
+                }
+                else failed = true;
+                record(&run_stats.quantize, elapsedMs(t_stage, chrono::steady_clock::now()));
+            }
+            quantized_q.push(s);
+        }
+    });
+
+    thread sink_thread([this, &sink, &quantized_q, &free_q, &run_stats, &total_latency_ms](){
+        while (true){
+            int s = quantized_q.pop();
+            if (s == END_OF_STREAM) break;
+            FrameSlot& slot = this->slots[s];
+            if (slot.valid){
+                const chrono::steady_clock::time_point t_stage = chrono::steady_clock::now();
+                sink(slot.bitmap, slot.index);
+                const chrono::steady_clock::time_point t_end = chrono::steady_clock::now();
+                record(&run_stats.sink, elapsedMs(t_stage, t_end));
+
+                const double latency_ms = elapsedMs(slot.t_start, t_end);
+                total_latency_ms += latency_ms;
+                if (latency_ms > run_stats.max_latency_ms) run_stats.max_latency_ms = latency_ms;
+            }
+            free_q.push(s);
+        }
+    });
+
+    decode_thread.join();
+    quantize_thread.join();
+    sink_thread.join();
+
+    run_stats.wall_ms = elapsedMs(t_run, chrono::steady_clock::now());
+    if (run_stats.sink.frames > 0){
+        run_stats.fps = run_stats.sink.frames * 1000.0 / run_stats.wall_ms;
+        run_stats.avg_latency_ms = total_latency_ms / run_stats.sink.frames;
+    }
+    this->stats = run_stats;
+
+    return (failed) ? 1 : 0;
+
+}
@@ -0,0 +1,221 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include <opencv4/opencv2/core/mat.hpp>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Failed attempts of a blocking SpscQueue operation before it sleeps until the other side moves
+const int SPSC_SPIN = 128;
+
+
+
+/**
+* @brief Bounded lock-free queue with a single producer thread and a single consumer thread.
+* The producer only writes tail and the consumer only writes head, each on its own cache line.
+* The blocking operations spin briefly, then sleep on the index of the other side with
+* std::atomic::wait (a futex on Linux), so an idle stage does not keep a core busy
+*/
+template <typename T>
+class SpscQueue{
+
+    private:
+
+        std::vector<T> slots;
+        size_t mask;
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+
+    public:
+
+        //? The capacity is rounded up to a power of two
+        explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+            size_t pow2 = 1;
+            while (pow2 < capacity) pow2 <<= 1;
+            this->slots.resize(pow2);
+            this->mask = pow2 - 1;
+        }
+
+        bool tryPush(const T& value){
+            const size_t t = this->tail.load(std::memory_order_relaxed);
+            if (t - this->head.load(std::memory_order_acquire) == this->slots.size()) return false;
+            this->slots[t & this->mask] = value;
+            this->tail.store(t + 1, std::memory_order_release);
+            this->tail.notify_one();
+            return true;
+        }
+
+        bool tryPop(T* value){
+            const size_t h = this->head.load(std::memory_order_relaxed);
+            if (h == this->tail.load(std::memory_order_acquire)) return false;
+            *value = this->slots[h & this->mask];
+            this->head.store(h + 1, std::memory_order_release);
+            this->head.notify_one();
+            return true;
+        }
+
+        //? Blocking versions, a full queue stalls the producer (backpressure).
+        //? A full queue has head == tail - capacity and an empty one tail == head, the wait returns as soon as that changes
+        void push(const T& value){
+            for (int spin=0; ! this->tryPush(value); ++spin){
+                if (spin >= SPSC_SPIN) this->head.wait(this->tail.load(std::memory_order_relaxed) - this->slots.size(), std::memory_order_acquire);
+            }
+        }
+        T pop(){
+            T value;
+            for (int spin=0; ! this->tryPop(&value); ++spin){
+                if (spin >= SPSC_SPIN) this->tail.wait(this->head.load(std::memory_order_relaxed), std::memory_order_acquire);
+            }
+            return value;
+        }
+
+};
+
+
+
+/**
+* @brief Time spent by one stage of a Pipeline
+*/
+struct StageStats{
+    long frames;
+    double busy_ms;
+    double max_ms;
+};
+
+/**
+* @brief Statistics of a whole Pipeline run, latency going from the start of the decoding of a frame to the end of its sink
+*/
+struct PipelineStats{
+    StageStats decode;
+    StageStats quantize;
+    StageStats sink;
+    double wall_ms;
+    double fps;
+    double avg_latency_ms;
+    double max_latency_ms;
+};
+
+
+
+//? Produces the next frame into the given Mat (reusing its memory), returns false at the end of the stream
+typedef std::function<bool(cv::Mat*)> FrameSource;
+
+//? Consumes the bitmap of a frame, the bitmap is reused once the sink returns
+typedef std::function<void(const Bitmap&, long)> BitmapSink;
+
+/**
+    @brief Frame source reading a video file (or anything else cv::VideoCapture can open)
+    @param path: the path of the video
+    @return the source, that ends immediately if the video cannot be opened
+*/
+FrameSource videoSource(const std::string& path);
+
+/**
+    @brief Frame source reading a sequence of images in order
+    @param paths: the paths of the images
+    @return the source
+*/
+FrameSource imageSequenceSource(const std::vector<std::string>& paths);
+
+
+
+/**
+* @brief Converts a stream of frames to bitmaps with decoding, quantization and consumption running on three threads.
+* The stages exchange the indexes of a fixed set of frame slots through SpscQueues, so frames and bitmaps are reused
+* and a slow stage makes the previous ones wait instead of piling frames up.
+* The bitmap handed to the sink has the dirty regions of its frame against the previous frame
+*/
+class Pipeline{
+
+    private:
+
+        struct FrameSlot{
+            cv::Mat frame;
+            Bitmap bitmap;
+            long index;
+            bool valid;
+            std::chrono::steady_clock::time_point t_start;
+        };
+
+        size_t depth;
+        std::vector<FrameSlot> slots;
+        PipelineStats stats;
+
+    public:
+
+        /**
+            @brief Prepares a pipeline with depth frames in flight
+            @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+            @param thresholds_v: the vector of uint8_t to use as thresholding to decide how to represent info
+            @param depth: how many frames can be between the decode and the sink stage (default=4)
+            @param luma_weights: the weights used to convert BGR(A) frames to grayscale (default=LUMA_BT601)
+        */
+        Pipeline(uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, size_t depth=4, const LumaWeights& luma_weights=LUMA_BT601);
+
+        /**
+            @brief Runs the source to exhaustion, every frame being quantized and handed to the sink in order.
+            A frame that fails to be quantized stops the pipeline: no frame is decoded after it
+            and the frames already in flight are not handed to the sink
+            @param source: the stream of frames
+            @param sink: the consumer of the bitmaps, called on its own thread
+            @return 0 if ok, 1 if a frame failed to be quantized
+        */
+        int run(const FrameSource& source, const BitmapSink& sink);
+
+        PipelineStats getStats() const;
+
+};
+
+
+
+
+
+
+}   //? End of p2b namespace
@@ -0,0 +1,451 @@
+#include "pyramid.hpp"
+#include "bitmap.hpp"
+#include "kernels.hpp"
+#include "threadpool.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <opencv2/core/mat.hpp>
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+//? Past this many pending regions a level only keeps their bounding box
+const size_t MAX_PENDING_RECTS = 64;
+
+
+
+//? A region of dst to compute, in rows and bytes, from the src_pixels pixels of each row of src
+struct ReduceJob{
+    const p2b::Bitmap* src;
+    long src_pixels;
+    uint8_t* dst_data;
+    long dst_stride;
+    long row;
+    long height;
+    long col;
+    long width;
+};
+
+//? Computes the rows [first, last) of the region of a job
+typedef void (*RowReducer)(const ReduceJob&, long, long);
+
+
+
+//? Maximum of two pixels in which the reserved value gives way to the other one, OR for masks
+template <int PIXEL_SIZE>
+static inline uint8_t maxKnownPixel(uint8_t a, uint8_t b){
+    constexpr uint8_t reserved = p2b::PixelTraits<PIXEL_SIZE>::pixel_values;
+    if constexpr (PIXEL_SIZE == 1) return a | b;
+    if (a == reserved) return b;
+    if (b == reserved) return a;
+    return max(a, b);
+}
+
+
+
+/*
+    Maximum of every GROUP adjacent pixels of a byte, the results packed from the most significant bits
+    and aligned to the least significant ones
+*/
+template <int PIXEL_SIZE, int GROUP>
+static const array<uint8_t, 256>& groupMaxTable(){
+    typedef p2b::PixelTraits<PIXEL_SIZE> T;
+    static const array<uint8_t, 256> table = [](){
+        array<uint8_t, 256> ret;
+        for (int x=0; x<256; ++x){
+            uint8_t v = 0;
+            for (int g=0; g<T::pixels_per_byte/GROUP; ++g){
+                uint8_t px = (x >> T::shift(g*GROUP)) & T::pixel_values;
+                for (int k=1; k<GROUP; ++k) px = maxKnownPixel<PIXEL_SIZE>(px, (x >> T::shift(g*GROUP+k)) & T::pixel_values);
+                v = (v << PIXEL_SIZE) | px;
+            }
+            ret[x] = v;
+        }
+        return ret;
+    }();
+    return table;
+}
+
+
+
+//? Folds whole 64 bit words, returning how many bytes it consumed
+template <int PIXEL_SIZE>
+static inline __attribute__((always_inline)) long maxWordsRow(uint8_t* acc, const uint8_t* src, long n_bytes){
+    typedef p2b::PackedWordOps<PIXEL_SIZE> F;
+    long j = 0;
+    for (; j+8 <= n_bytes; j+=8){
+        uint64_t wa, ws;
+        memcpy(&wa, acc+j, 8);
+        memcpy(&ws, src+j, 8);
+        if constexpr (PIXEL_SIZE == 1) wa |= ws;
+        else wa = F::maxKnown(wa, ws);
+        memcpy(acc+j, &wa, 8);
+    }
+    return j;
+}
+
+
+
+/*
+    Whole words go through the word loop, the last partial word through a copy padded with pixels that leave acc unchanged
+*/
+template <int PIXEL_SIZE>
+static void maxIntoRow(uint8_t* acc, const uint8_t* src, long n_bytes){
+    typedef p2b::PackedWordOps<PIXEL_SIZE> F;
+    long j = maxWordsRow<PIXEL_SIZE>(acc, src, n_bytes);
+    if (j < n_bytes){
+        const long n = n_bytes - j;
+        uint64_t wa, ws = (PIXEL_SIZE == 1) ? 0 : ~0ULL;
+        memcpy(&wa, acc+j, 8);
+        memcpy(&ws, src+j, n);
+        if constexpr (PIXEL_SIZE == 1) wa |= ws;
+        else wa = F::maxKnown(wa, ws);
+        memcpy(acc+j, &wa, 8);
+    }
+}
+
+
+
+/*
+    REDUCE_MAX: the FACTOR source rows of a destination row are folded into a scratch row padded to whole words,
+    then every FACTOR scratch bytes make a destination byte through the group maximum table.
+    The pixels past the width of src are set in the scratch row to the value that leaves a maximum unchanged.
+    When FACTOR is bigger than pixels_per_byte a table entry is a single pixel, folded with the next ones
+*/
+template <int PIXEL_SIZE, int FACTOR>
+static void reduceMaxRows(const ReduceJob& job, long first, long last){
+    typedef p2b::PixelTraits<PIXEL_SIZE> T;
+    constexpr int PPB = T::pixels_per_byte;
+    constexpr int GROUP = (FACTOR < PPB) ? FACTOR : PPB;
+    const array<uint8_t, 256>& group_max = groupMaxTable<PIXEL_SIZE, GROUP>();
+
+    const p2b::Bitmap& src = *job.src;
+    const long src_col = job.col*FACTOR;
+    const long n_bytes = job.width*FACTOR;
+    const long valid_pixels = max(0L, min(n_bytes*PPB, job.src_pixels - src_col*PPB));
+    const long valid_bytes = (valid_pixels + PPB - 1)/PPB;
+    const uint8_t padding = (valid_pixels % PPB != 0) ? (0xFF >> ((valid_pixels % PPB)*PIXEL_SIZE)) : 0;
+
+    static thread_local vector<uint8_t> acc;
+    for (long i=first; i<last; ++i){
+        const long dst_row = job.row + i;
+        acc.assign(((n_bytes + 7)/8)*8, (PIXEL_SIZE == 1) ? 0 : 255);
+        const long r_end = min((dst_row+1)*FACTOR, src.getRows());
+        for (long r=dst_row*FACTOR; r<r_end; ++r) maxIntoRow<PIXEL_SIZE>(acc.data(), src.getRow(r).data() + src_col, valid_bytes);
+        if (padding != 0){
+            if constexpr (PIXEL_SIZE == 1) acc[valid_bytes-1] &= ~padding;
+            else acc[valid_bytes-1] |= padding;
+        }
+
+        uint8_t* out = job.dst_data + dst_row*job.dst_stride + job.col;
+        const uint8_t* s = acc.data();
+        for (long b=0; b<job.width; ++b, s+=FACTOR){
+            unsigned v = 0;
+            if constexpr (FACTOR <= PPB){
+                for (int k=0; k<FACTOR; ++k) v = (v << (8/FACTOR)) | group_max[s[k]];
+            }
+            else {
+                constexpr int BYTES_PER_PIXEL = FACTOR/PPB;
+                for (int p=0; p<PPB; ++p){
+                    uint8_t px = group_max[s[p*BYTES_PER_PIXEL]];
+                    for (int q=1; q<BYTES_PER_PIXEL; ++q) px = maxKnownPixel<PIXEL_SIZE>(px, group_max[s[p*BYTES_PER_PIXEL+q]]);
+                    v = (v << PIXEL_SIZE) | px;
+                }
+            }
+            out[b] = (uint8_t) v;
+        }
+    }
+}
+
+
+
+/*
+    REDUCE_MAJORITY: the levels of every block are counted while walking its source rows, up to the width
+    of src, then the most frequent known level wins. Masks set the pixel when at least half of the block is set
+*/
+template <int PIXEL_SIZE, int FACTOR>
+static void reduceMajorityRows(const ReduceJob& job, long first, long last){
+    typedef p2b::PixelTraits<PIXEL_SIZE> T;
+    constexpr int PPB = T::pixels_per_byte;
+    constexpr int LEVELS = 1 << PIXEL_SIZE;
+
+    const p2b::Bitmap& src = *job.src;
+    const long src_col = job.col*FACTOR;
+    const long n_pixels = job.width*PPB;
+    const long valid_pixels = max(0L, min(n_pixels*FACTOR, job.src_pixels - src_col*PPB));
+    const long full_bytes = valid_pixels/PPB;
+
+    static thread_local vector<uint8_t> counts;
+    for (long i=first; i<last; ++i){
+        const long dst_row = job.row + i;
+        counts.assign(n_pixels*LEVELS, 0);
+        const long r_end = min((dst_row+1)*FACTOR, src.getRows());
+        for (long r=dst_row*FACTOR; r<r_end; ++r){
+            const uint8_t* s = src.getRow(r).data() + src_col;
+            for (long j=0; j<full_bytes; ++j){
+                for (int k=0; k<PPB; ++k) ++counts[((j*PPB + k)/FACTOR)*LEVELS + ((s[j] >> T::shift(k)) & T::pixel_values)];
+            }
+            for (long p=full_bytes*PPB; p<valid_pixels; ++p){
+                ++counts[(p/FACTOR)*LEVELS + ((s[p/PPB] >> T::shift(p%PPB)) & T::pixel_values)];
+            }
+        }
+
+        uint8_t* out = job.dst_data + dst_row*job.dst_stride + job.col;
+        const uint8_t* c = counts.data();
+        for (long b=0; b<job.width; ++b){
+            unsigned v = 0;
+            for (int p=0; p<PPB; ++p, c+=LEVELS){
+                uint8_t px = T::pixel_values;
+                if constexpr (PIXEL_SIZE == 1) px = (c[1] >= c[0]) ? 1 : 0;
+                else {
+                    uint8_t best = 0;
+                    for (int l=0; l<T::pixel_values; ++l){
+                        if (c[l] > 0 && c[l] >= best){
+                            best = c[l];
+                            px = l;
+                        }
+                    }
+                }
+                v = (v << PIXEL_SIZE) | px;
+            }
+            out[b] = (uint8_t) v;
+        }
+    }
+}
+
+
+
+template <int PIXEL_SIZE, int FACTOR>
+static RowReducer selectReducer(int mode){
+    return (mode == p2b::REDUCE_MAX) ? reduceMaxRows<PIXEL_SIZE, FACTOR> : reduceMajorityRows<PIXEL_SIZE, FACTOR>;
+}
+
+
+
+/*
+    Computes a region of dst from src in parallel over chunks of rows, sets the pixels padding
+    the last byte of the rows to the reserved value if the region reaches it and reports the region
+    as written, so that the count index, dirty regions and write log of dst follow it
+*/
+static void reduceRegion(const p2b::Bitmap& src, int factor, int mode, p2b::Bitmap* dst, long row, long height, long col, long width){
+    if (height <= 0 || width <= 0) return;
+
+    const uint8_t pixel_size = src.getPixelSize();
+    const int ppb = 8/pixel_size;
+    const RowReducer reducer =
+        (pixel_size == 1) ? ((factor == 2) ? selectReducer<1, 2>(mode) : selectReducer<1, 4>(mode)) :
+        (pixel_size == 2) ? ((factor == 2) ? selectReducer<2, 2>(mode) : selectReducer<2, 4>(mode)) :
+        ((factor == 2) ? selectReducer<4, 2>(mode) : selectReducer<4, 4>(mode));
+
+    const long dst_pixels = (src.getWidth() + factor - 1)/factor;
+    cv::Mat dst_view = dst->getMatView();
+    const ReduceJob job = { &src, src.getWidth(), dst_view.ptr<uint8_t>(0), (long) dst_view.step, row, height, col, width };
+    p2b::parallelRows(
+        height,
+        factor*factor*width,
+        [&](long first, long last) -> void { reducer(job, first, last); }
+    );
+
+    const int used = dst_pixels % ppb;
+    if (used != 0 && col + width == dst->getCols()){
+        const uint8_t padding = 0xFF >> (used*pixel_size);
+        for (long i=row; i<row+height; ++i) dst_view.ptr<uint8_t>(i)[col+width-1] |= padding;
+    }
+    dst->markWritten(row, col, height, width);
+}
+
+
+
+
+
+/*
+    Checks the arguments, reallocates dst if its geometry doesn't match and reduces the whole bitmap
+*/
+int p2b::downsample(const Bitmap& src, int factor, int mode, Bitmap* dst){
+
+    if (factor != 2 && factor != 4){
+        ERROR_MSG("factor must be 2 or 4");
+        return 1;
+    }
+    if (mode != REDUCE_MAX && mode != REDUCE_MAJORITY){
+        ERROR_MSG("mode must be REDUCE_MAX or REDUCE_MAJORITY");
+        return 1;
+    }
+    if (dst == &src){
+        ERROR_MSG("a bitmap can't be downsampled in place");
+        return 1;
+    }
+    if (dst->isReadOnly()){
+        ERROR_MSG("bitmap is a read-only mapping of a .p2b file, modify a copy of it instead");
+        return 1;
+    }
+
+    const uint8_t pixel_size = src.getPixelSize();
+    const long ppb = 8/pixel_size;
+    const long dst_rows = (src.getRows() + factor - 1)/factor;
+    const long dst_pixels = (src.getWidth() + factor - 1)/factor;
+    const long dst_cols = (dst_pixels + ppb - 1)/ppb;
+    if (dst->getRows() != dst_rows || dst->getCols() != dst_cols || dst->getPixelSize() != pixel_size){
+        *dst = Bitmap(dst_rows, dst_cols, pixel_size, src.getThresholds());
+    }
+    else dst->setThresholds(src.getThresholds());
+    dst->setLumaWeights(src.getLumaWeights());
+    dst->setWidth(dst_pixels);
+
+    reduceRegion(src, factor, mode, dst, 0, dst_rows, 0, dst_cols);
+    return 0;
+
+}
+
+
+
+
+
+p2b::BitmapPyramid::BitmapPyramid(int n_levels, int factor, int mode){
+    if (n_levels < 0){
+        ERROR_MSG("n_levels can't be negative");
+        exit(1);
+    }
+    if (factor != 2 && factor != 4){
+        ERROR_MSG("factor must be 2 or 4");
+        exit(1);
+    }
+    if (mode != REDUCE_MAX && mode != REDUCE_MAJORITY){
+        ERROR_MSG("mode must be REDUCE_MAX or REDUCE_MAJORITY");
+        exit(1);
+    }
+    this->n_levels = n_levels;
+    this->factor = factor;
+    this->mode = mode;
+    this->base = nullptr;
+    this->base_rows = 0;
+    this->base_cols = 0;
+    this->base_width = 0;
+    this->base_pixel_size = 0;
+    this->base_generation = 0;
+    this->clear();
+}
+
+
+
+/*
+    Collects the writes made to the base since the last call: they are added to the pending regions of every
+    level, converted to pixels. A different base, a new geometry or width or a restarted write log make every level stale
+*/
+void p2b::BitmapPyramid::sync(const Bitmap& base){
+    vector<DirtyRect> written;
+    const bool same_base = (
+        this->base == &base &&
+        this->base_rows == base.getRows() &&
+        this->base_cols == base.getCols() &&
+        this->base_width == base.getWidth() &&
+        this->base_pixel_size == base.getPixelSize()
+    );
+
+    if (!same_base || !base.getWritesSince(this->base_generation, &written)) this->invalidate();
+    else if (!written.empty()){
+        const long ppb = 8/base.getPixelSize();
+        for (size_t k=0; k<this->levels.size(); ++k){
+            if (this->stale[k]) continue;
+            vector<DirtyRect>& rects = this->pending[k];
+            for (const DirtyRect& rect : written) rects.push_back({rect.row, rect.col*ppb, rect.height, rect.width*ppb});
+            if (rects.size() > MAX_PENDING_RECTS){
+                DirtyRect box = rects[0];
+                for (const DirtyRect& rect : rects){
+                    const long row_end = max(box.row + box.height, rect.row + rect.height);
+                    const long col_end = max(box.col + box.width, rect.col + rect.width);
+                    box.row = min(box.row, rect.row);
+                    box.col = min(box.col, rect.col);
+                    box.height = row_end - box.row;
+                    box.width = col_end - box.col;
+                }
+                rects.assign(1, box);
+            }
+        }
+    }
+
+    this->base = &base;
+    this->base_rows = base.getRows();
+    this->base_cols = base.getCols();
+    this->base_width = base.getWidth();
+    this->base_pixel_size = base.getPixelSize();
+    this->base_generation = base.getWriteGeneration();
+}
+
+
+
+/*
+    Levels are refreshed from the top down to the requested one, each from the one above it.
+    A pixel of level k covers factor^k base pixels per side, so a written base region maps to the
+    level pixels whose blocks it touches, widened to whole bytes
+*/
+const p2b::Bitmap* p2b::BitmapPyramid::getLevel(const Bitmap& base, int level){
+    if (level < 0 || level > this->n_levels){
+        ERROR_MSG("level out of range");
+        return nullptr;
+    }
+    if (level == 0) return &base;
+
+    this->sync(base);
+
+    const long ppb = 8/base.getPixelSize();
+    long scale = 1;
+    for (int k=0; k<level; ++k){
+        const Bitmap& above = (k == 0) ? base : this->levels[k-1];
+        Bitmap& current = this->levels[k];
+        scale *= this->factor;
+
+        if (this->stale[k]){
+            downsample(above, this->factor, this->mode, &current);
+            this->stale[k] = false;
+            this->pending[k].clear();
+            continue;
+        }
+        if (current.getThresholds() != above.getThresholds()) current.setThresholds(above.getThresholds());
+        current.setLumaWeights(above.getLumaWeights());
+
+        for (const DirtyRect& rect : this->pending[k]){
+            const long row = rect.row/scale;
+            const long row_end = min((rect.row + rect.height + scale - 1)/scale, current.getRows());
+            const long col = (rect.col/scale)/ppb;
+            const long col_end = min(((rect.col + rect.width + scale - 1)/scale + ppb - 1)/ppb, current.getCols());
+            reduceRegion(above, this->factor, this->mode, &current, row, row_end - row, col, col_end - col);
+        }
+        this->pending[k].clear();
+    }
+
+    return &this->levels[level-1];
+}
+
+
+
+void p2b::BitmapPyramid::invalidate(){
+    this->stale.assign(this->n_levels, true);
+    for (vector<DirtyRect>& rects : this->pending) rects.clear();
+}
+
+void p2b::BitmapPyramid::clear(){
+    this->levels.assign(this->n_levels, Bitmap());
+    this->pending.assign(this->n_levels, {});
+    this->stale.assign(this->n_levels, true);
+    this->base = nullptr;
+}
+
+int p2b::BitmapPyramid::getLevelCount() const { return this->n_levels; }
+
+size_t p2b::BitmapPyramid::getAllocatedBytes() const {
+    size_t ret = 0;
+    for (const Bitmap& level : this->levels) ret += level.getAllocatedBytes();
+    return ret;
+}
@@ -0,0 +1,141 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Reduction modes of downsample: the highest known level of each block, or its most frequent one
+const int REDUCE_MAX = 0;
+const int REDUCE_MAJORITY = 1;
+
+
+
+/**
+    @brief Shrinks a bitmap by 2 or 4 in both directions working on the packed bytes, every pixel of dst
+    summarizing a factor x factor block of src.
+    REDUCE_MAX folds the rows of a block with per-pixel word operators, then the pixels of each byte through a table.
+    REDUCE_MAJORITY counts the levels of every block.
+    In 2 and 4 bit bitmaps the reserved value ("no information") never wins over a known level:
+    a block is reserved only if all its pixels are, majority ties go to the highest level.
+    1 bit bitmaps are masks as in the bitmap algebra, REDUCE_MAX being an OR of the block
+    and REDUCE_MAJORITY setting the pixel when at least half of the block is set.
+    Pixels past the width of src (padding its last byte) are left out, so blocks on the right and bottom
+    edges only contain the pixels that exist. The result is recorded as written in dst like the writes
+    of Bitmap's member functions (dirty regions, count index, write log)
+    @param src: the bitmap to shrink
+    @param factor: 2 or 4
+    @param mode: REDUCE_MAX or REDUCE_MAJORITY
+    @param dst: the destination, reallocated to ceil(rows/factor) rows and ceil(width/factor) pixels
+    if its geometry differs. It always takes the thresholds and luma weights of src, and width ceil(width/factor)
+    @return 0 if ok, 1 if factor or mode are not valid, dst is src or dst is read-only
+*/
+int downsample(const Bitmap& src, int factor, int mode, Bitmap* dst);
+
+
+
+/**
+* @brief Cached chain of downsampled copies of a bitmap, level 0 being the bitmap itself and level k+1
+* the downsample of level k. Levels are only computed when asked for: each one keeps the regions
+* written in the base bitmap since it was last refreshed (from Bitmap::getWritesSince) and reduces just those,
+* so a viewer zoomed out over a growing map only pays for what addImage or updateRegionFromImage changed.
+* Writes made through getMatView are seen once reported with Bitmap::markWritten, otherwise call invalidate after them. Not thread safe
+*/
+class BitmapPyramid{
+
+    private:
+
+        int n_levels;
+        int factor;
+        int mode;
+
+        //? levels[k] is level k+1, stale levels are rebuilt entirely and pending holds, for the others,
+        //? the regions of the base written since they were refreshed (in base rows and pixels)
+        std::vector<Bitmap> levels;
+        std::vector<bool> stale;
+        std::vector<std::vector<DirtyRect>> pending;
+
+        //? The base bitmap and the position in its write log the pending regions are up to date with
+        const Bitmap* base;
+        long base_rows;
+        long base_cols;
+        long base_width;
+        uint8_t base_pixel_size;
+        uint64_t base_generation;
+
+        void sync(const Bitmap& base);
+
+    public:
+
+        /**
+            @brief Creates an empty pyramid, nothing is computed until getLevel
+            @param n_levels: how many levels to keep below the base
+            @param factor: the downsample factor between two levels, 2 or 4 (default=2)
+            @param mode: REDUCE_MAX or REDUCE_MAJORITY (default=REDUCE_MAX)
+        */
+        BitmapPyramid(int n_levels, int factor=2, int mode=REDUCE_MAX);
+
+        /**
+            @brief Brings a level up to date with the base bitmap and returns it
+            @param base: the bitmap at the base of the pyramid, always the same one
+            @param level: 0 for base itself, up to getLevelCount
+            @return the level, valid until the next call modifying the pyramid, nullptr if level is out of range
+        */
+        const Bitmap* getLevel(const Bitmap& base, int level);
+
+        //? Marks every level to be rebuilt entirely on its next getLevel
+        void invalidate();
+        //? Frees every level
+        void clear();
+
+        int getLevelCount() const;
+        size_t getAllocatedBytes() const;
+
+};
+
+
+
+}   //? End of p2b namespace
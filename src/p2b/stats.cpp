@@ -0,0 +1,423 @@
+#include "stats.hpp"
+#include "bitmap.hpp"
+#include "kernels.hpp"
+#include "threadpool.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define P2B_X86 1
+#endif
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+//? Lowest bit of every pixel of a 64 bit word
+static constexpr uint64_t lowBits(int pixel_size){
+    return (pixel_size == 1) ? 0xFFFFFFFFFFFFFFFFULL : (pixel_size == 2) ? 0x5555555555555555ULL : 0x1111111111111111ULL;
+}
+
+//? The level repeated in every pixel of a 64 bit word
+static inline uint64_t broadcastLevel(int pixel_size, uint8_t level){
+    return lowBits(pixel_size) * level;
+}
+
+//? Lowest bit of every pixel of x that is all ones
+template <int PIXEL_SIZE>
+static inline uint64_t foldOnes(uint64_t x){
+    if constexpr (PIXEL_SIZE >= 2) x &= x >> 1;
+    if constexpr (PIXEL_SIZE == 4) x &= x >> 2;
+    return x & lowBits(PIXEL_SIZE);
+}
+
+static inline uint64_t loadWord(const uint8_t* p, long n){
+    uint64_t word = 0;
+    memcpy(&word, p, n);
+    return word;
+}
+
+
+
+/*
+    Counts of the levels 1 to pixel_values over whole 64 bit words, level 0 being what is left.
+    1 bit pixels are a single popcount, 2 bit pixels are split in their high and low bit planes
+*/
+template <int PIXEL_SIZE>
+static inline __attribute__((always_inline)) long countWords(const uint8_t* data, long n_bytes, uint64_t* level_counts){
+    long j = 0;
+    for (; j+8 <= n_bytes; j+=8){
+        uint64_t w;
+        memcpy(&w, data+j, 8);
+        if constexpr (PIXEL_SIZE == 1){
+            level_counts[1] += __builtin_popcountll(w);
+        }
+        else {
+            const uint64_t hi = (w >> 1) & lowBits(2);
+            const uint64_t lo = w & lowBits(2);
+            level_counts[1] += __builtin_popcountll(lo & ~hi);
+            level_counts[2] += __builtin_popcountll(hi & ~lo);
+            level_counts[3] += __builtin_popcountll(hi & lo);
+        }
+    }
+    return j;
+}
+
+//? Same as countWords, summing the pixels equal to a level folded on their lowest bit
+template <int PIXEL_SIZE>
+static inline __attribute__((always_inline)) long countLevelWords(const uint8_t* data, long n_bytes, uint64_t level_word, uint64_t* count){
+    long j = 0;
+    for (; j+8 <= n_bytes; j+=8){
+        uint64_t w;
+        memcpy(&w, data+j, 8);
+        *count += __builtin_popcountll(foldOnes<PIXEL_SIZE>(~(w ^ level_word)));
+    }
+    return j;
+}
+
+typedef long (*WordCounter)(const uint8_t*, long, uint64_t*);
+typedef long (*LevelWordCounter)(const uint8_t*, long, uint64_t, uint64_t*);
+
+
+
+#ifdef P2B_X86
+
+
+//? The same loops compiled with the popcnt instruction instead of the generic bit counting routine
+template <int PIXEL_SIZE>
+__attribute__((target("popcnt")))
+static long countWords_popcnt(const uint8_t* data, long n_bytes, uint64_t* level_counts){
+    return countWords<PIXEL_SIZE>(data, n_bytes, level_counts);
+}
+
+template <int PIXEL_SIZE>
+__attribute__((target("popcnt")))
+static long countLevelWords_popcnt(const uint8_t* data, long n_bytes, uint64_t level_word, uint64_t* count){
+    return countLevelWords<PIXEL_SIZE>(data, n_bytes, level_word, count);
+}
+
+
+#endif
+
+
+
+template <int PIXEL_SIZE>
+static long countWords_generic(const uint8_t* data, long n_bytes, uint64_t* level_counts){
+    return countWords<PIXEL_SIZE>(data, n_bytes, level_counts);
+}
+
+template <int PIXEL_SIZE>
+static long countLevelWords_generic(const uint8_t* data, long n_bytes, uint64_t level_word, uint64_t* count){
+    return countLevelWords<PIXEL_SIZE>(data, n_bytes, level_word, count);
+}
+
+//? Selected on every call like the kernels, following p2b::setSimdLevel
+template <int PIXEL_SIZE>
+static WordCounter selectWordCounter(){
+#ifdef P2B_X86
+    if (p2b::getSimdLevel() >= p2b::SIMD_SSE41 && __builtin_cpu_supports("popcnt")) return countWords_popcnt<PIXEL_SIZE>;
+#endif
+    return countWords_generic<PIXEL_SIZE>;
+}
+
+template <int PIXEL_SIZE>
+static LevelWordCounter selectLevelWordCounter(){
+#ifdef P2B_X86
+    if (p2b::getSimdLevel() >= p2b::SIMD_SSE41 && __builtin_cpu_supports("popcnt")) return countLevelWords_popcnt<PIXEL_SIZE>;
+#endif
+    return countLevelWords_generic<PIXEL_SIZE>;
+}
+
+
+
+/*
+    Adds the levels of n_bytes whole bytes to level_counts (levels 1 and up for 1 and 2 bit pixels)
+    or to byte_counts (every byte value, for 4 bit pixels: a single increment per pair of pixels,
+    spread over 4 tables so that repeated bytes do not wait on each other)
+*/
+template <int PIXEL_SIZE>
+static void countBytes(const uint8_t* data, long n_bytes, uint64_t* level_counts, uint64_t byte_counts[4][256]){
+    if constexpr (PIXEL_SIZE == 4){
+        long j = 0;
+        for (; j+4 <= n_bytes; j+=4){
+            byte_counts[0][data[j]]++;
+            byte_counts[1][data[j+1]]++;
+            byte_counts[2][data[j+2]]++;
+            byte_counts[3][data[j+3]]++;
+        }
+        for (; j<n_bytes; ++j) byte_counts[0][data[j]]++;
+    }
+    else {
+        const WordCounter word_counter = selectWordCounter<PIXEL_SIZE>();
+
+        long j = word_counter(data, n_bytes, level_counts);
+        if (j < n_bytes){
+            //? The zero padding of the last word only adds level 0 pixels, which are not counted here
+            uint64_t tail[4] = {0, 0, 0, 0};
+            uint8_t padded[8];
+            memset(padded, 0, 8);
+            memcpy(padded, data+j, n_bytes-j);
+            countWords<PIXEL_SIZE>(padded, 8, tail);
+            for (int v=1; v<(1 << PIXEL_SIZE); ++v) level_counts[v] += tail[v];
+        }
+    }
+}
+
+
+
+/*
+    Histogram of the pixels [px_a, px_b) of the rows [row_a, row_b), the partial bytes at the two
+    ends of every row are counted pixel by pixel and the whole bytes in between by countBytes
+*/
+template <int PIXEL_SIZE>
+static void histogramRows(const p2b::Bitmap& bitmap, long row_a, long row_b, long px_a, long px_b, long* hist){
+    constexpr int ppb = 8/PIXEL_SIZE;
+    constexpr int n_levels = 1 << PIXEL_SIZE;
+    constexpr uint8_t pixel_mask = n_levels - 1;
+
+    uint64_t level_counts[n_levels] = {};
+    uint64_t byte_counts[4][256];
+    if constexpr (PIXEL_SIZE == 4) memset(byte_counts, 0, sizeof(byte_counts));
+    long edge_counts[n_levels] = {};
+
+    const long byte_a = (px_a + ppb - 1)/ppb;
+    const long byte_b = px_b/ppb;
+
+    for (long i=row_a; i<row_b; ++i){
+        const uint8_t* row = bitmap.getRow(i).data();
+        if (byte_a > byte_b){
+            //? The whole range is inside a single byte
+            for (long p=px_a; p<px_b; ++p) edge_counts[(row[p/ppb] >> ((8-PIXEL_SIZE) - (p%ppb)*PIXEL_SIZE)) & pixel_mask]++;
+            continue;
+        }
+        for (long p=px_a; p<byte_a*ppb; ++p) edge_counts[(row[p/ppb] >> ((8-PIXEL_SIZE) - (p%ppb)*PIXEL_SIZE)) & pixel_mask]++;
+        countBytes<PIXEL_SIZE>(row + byte_a, byte_b - byte_a, level_counts, byte_counts);
+        for (long p=byte_b*ppb; p<px_b; ++p) edge_counts[(row[p/ppb] >> ((8-PIXEL_SIZE) - (p%ppb)*PIXEL_SIZE)) & pixel_mask]++;
+    }
+
+    if constexpr (PIXEL_SIZE == 4){
+        for (int b=0; b<256; ++b){
+            const uint64_t count = byte_counts[0][b] + byte_counts[1][b] + byte_counts[2][b] + byte_counts[3][b];
+            level_counts[b >> 4] += count;
+            level_counts[b & 15] += count;
+        }
+    }
+    else {
+        const long whole_bytes = (byte_b > byte_a) ? byte_b - byte_a : 0;
+        long counted = 0;
+        for (int v=1; v<n_levels; ++v) counted += level_counts[v];
+        level_counts[0] = (row_b - row_a)*whole_bytes*ppb - counted;
+    }
+
+    for (int v=0; v<n_levels; ++v) hist[v] += level_counts[v] + edge_counts[v];
+}
+
+
+
+/*
+    Every chunk of rows builds its own histogram, merged under a lock once per chunk
+*/
+static void parallelHistogram(const p2b::Bitmap& bitmap, long row, long col, long height, long width, vector<long>* hist){
+    const uint8_t pixel_size = bitmap.getPixelSize();
+    hist->assign((1 << pixel_size), 0);
+    mutex hist_mutex;
+
+    p2b::parallelRows(
+        height,
+        (width*pixel_size + 7)/8,
+        [&](long first, long last) -> void {
+            long chunk_hist[16] = {};
+            switch (pixel_size) {
+                case 1:
+                    histogramRows<1>(bitmap, row + first, row + last, col, col + width, chunk_hist);
+                    break;
+                case 2:
+                    histogramRows<2>(bitmap, row + first, row + last, col, col + width, chunk_hist);
+                    break;
+                default:
+                    histogramRows<4>(bitmap, row + first, row + last, col, col + width, chunk_hist);
+                    break;
+            }
+            lock_guard<mutex> lock(hist_mutex);
+            for (size_t v=0; v<hist->size(); ++v) (*hist)[v] += chunk_hist[v];
+        }
+    );
+}
+
+
+
+template <int PIXEL_SIZE>
+static long countRowLevel(const uint8_t* row, long n_bytes, uint8_t level){
+    const LevelWordCounter level_word_counter = selectLevelWordCounter<PIXEL_SIZE>();
+    const uint64_t level_word = broadcastLevel(PIXEL_SIZE, level);
+
+    uint64_t count = 0;
+    long j = level_word_counter(row, n_bytes, level_word, &count);
+    if (j < n_bytes){
+        //? Only the lowest n bytes of the last word are pixels of the row
+        const long n = n_bytes - j;
+        const uint64_t valid = (n == 8) ? ~0ULL : ((1ULL << (8*n)) - 1);
+        count += __builtin_popcountll(foldOnes<PIXEL_SIZE>(~(loadWord(row+j, n) ^ level_word)) & valid);
+    }
+    return (long) count;
+}
+
+
+
+/*
+    Table spreading the 8 bits of a byte over the 8 bytes of a word, the most significant bit to the
+    lowest byte: once the pixels equal to the level are folded on their lowest bit, adding the spread
+    bytes of a row counts up to 255 rows per column in 8 bit lanes.
+    Pixel p of a byte ends up in lane p*PIXEL_SIZE + PIXEL_SIZE-1
+*/
+static const uint64_t* spreadTable(){
+    static const vector<uint64_t> table = [](){
+        vector<uint64_t> ret_table(256, 0);
+        for (int b=0; b<256; ++b){
+            for (int t=0; t<8; ++t){
+                if (b & (1 << t)) ret_table[b] |= 1ULL << (8*(7-t));
+            }
+        }
+        return ret_table;
+    }();
+    return table.data();
+}
+
+
+
+template <int PIXEL_SIZE>
+static void countColumnsRows(const p2b::Bitmap& bitmap, long row_a, long row_b, uint8_t level, long* counts){
+    constexpr int ppb = 8/PIXEL_SIZE;
+    const uint64_t* spread = spreadTable();
+    const uint8_t level_byte = (uint8_t) broadcastLevel(PIXEL_SIZE, level);
+    const long cols = bitmap.getCols();
+
+    vector<uint64_t> lanes(cols, 0);
+    auto flush = [&lanes, counts, cols]() -> void {
+        for (long j=0; j<cols; ++j){
+            for (int p=0; p<ppb; ++p) counts[j*ppb + p] += (lanes[j] >> (8*(p*PIXEL_SIZE + PIXEL_SIZE-1))) & 0xFF;
+            lanes[j] = 0;
+        }
+    };
+
+    long pending = 0;
+    for (long i=row_a; i<row_b; ++i){
+        const uint8_t* row = bitmap.getRow(i).data();
+        for (long j=0; j<cols; ++j){
+            lanes[j] += spread[foldOnes<PIXEL_SIZE>((uint8_t) ~(row[j] ^ level_byte)) & 0xFF];
+        }
+        if (++pending == 255){
+            flush();
+            pending = 0;
+        }
+    }
+    if (pending > 0) flush();
+}
+
+
+
+
+
+vector<long> p2b::levelHistogram(const Bitmap& bitmap){
+    vector<long> ret_hist;
+    parallelHistogram(bitmap, 0, 0, bitmap.getRows(), bitmap.getCols()*(8/bitmap.getPixelSize()), &ret_hist);
+    return ret_hist;
+}
+
+
+
+int p2b::levelHistogram(const Bitmap& bitmap, long row, long col, long height, long width, vector<long>* hist){
+    const long img_cols = bitmap.getCols()*(8/bitmap.getPixelSize());
+    if (height <= 0 || width <= 0){
+        ERROR_MSG("height and width of the region must be positive values");
+        return 1;
+    }
+    if (row < 0 || col < 0 || row + height > bitmap.getRows() || col + width > img_cols){
+        ERROR_MSG("the region is not inside the bitmap");
+        return 1;
+    }
+    parallelHistogram(bitmap, row, col, height, width, hist);
+    return 0;
+}
+
+
+
+long p2b::countNoInformation(const Bitmap& bitmap){
+    vector<long> counts;
+    rowLevelCounts(bitmap, bitmap.getPixelValues(), &counts);
+    long ret_count = 0;
+    for (long count : counts) ret_count += count;
+    return ret_count;
+}
+
+
+
+int p2b::rowLevelCounts(const Bitmap& bitmap, uint8_t level, vector<long>* counts){
+    if (level > bitmap.getPixelValues()){
+        ERROR_MSG("level is above pixel_values");
+        return 1;
+    }
+
+    counts->assign(bitmap.getRows(), 0);
+    const uint8_t pixel_size = bitmap.getPixelSize();
+    const long cols = bitmap.getCols();
+    p2b::parallelRows(
+        bitmap.getRows(),
+        cols,
+        [&](long first, long last) -> void {
+            for (long i=first; i<last; ++i){
+                const uint8_t* row = bitmap.getRow(i).data();
+                (*counts)[i] = (pixel_size == 1) ? countRowLevel<1>(row, cols, level) :
+                               (pixel_size == 2) ? countRowLevel<2>(row, cols, level) :
+                                                   countRowLevel<4>(row, cols, level);
+            }
+        }
+    );
+    return 0;
+}
+
+
+
+int p2b::colLevelCounts(const Bitmap& bitmap, uint8_t level, vector<long>* counts){
+    if (level > bitmap.getPixelValues()){
+        ERROR_MSG("level is above pixel_values");
+        return 1;
+    }
+
+    const uint8_t pixel_size = bitmap.getPixelSize();
+    const long n_counts = bitmap.getCols()*(8/pixel_size);
+    counts->assign(n_counts, 0);
+    mutex counts_mutex;
+
+    //? Every chunk of rows counts its own columns, merged under a lock once per chunk
+    p2b::parallelRows(
+        bitmap.getRows(),
+        9*bitmap.getCols(),
+        [&](long first, long last) -> void {
+            vector<long> chunk_counts(n_counts, 0);
+            switch (pixel_size) {
+                case 1:
+                    countColumnsRows<1>(bitmap, first, last, level, chunk_counts.data());
+                    break;
+                case 2:
+                    countColumnsRows<2>(bitmap, first, last, level, chunk_counts.data());
+                    break;
+                default:
+                    countColumnsRows<4>(bitmap, first, last, level, chunk_counts.data());
+                    break;
+            }
+            lock_guard<mutex> lock(counts_mutex);
+            for (long k=0; k<n_counts; ++k) (*counts)[k] += chunk_counts[k];
+        }
+    );
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Statistics computed on the packed bytes without decoding them, in parallel over chunks of rows.
+//? Rows are counted up to cols*pixels_per_byte pixels, so the pixels padding the last byte of
+//? a row whose image width is not a multiple of pixels_per_byte count as having no information
+
+
+
+/**
+    @brief Number of pixels at every level: popcounts of 64 bit words for 1 and 2 bit bitmaps,
+    a table of byte counts folded into levels for 4 bit ones
+    @param bitmap: the bitmap to inspect
+    @return the histogram, pixel_values+1 entries with the pixels without information last
+*/
+std::vector<long> levelHistogram(const Bitmap& bitmap);
+
+/**
+    @brief Same as levelHistogram, restricted to a region
+    @param row, col: the top left pixel of the region
+    @param height, width: the size of the region in pixels
+    @param hist: the destination histogram, resized to pixel_values+1 entries
+    @return 0 if ok, 1 if the region is empty or not inside the bitmap
+*/
+int levelHistogram(const Bitmap& bitmap, long row, long col, long height, long width, std::vector<long>* hist);
+
+/**
+    @brief Number of pixels without information, those with the reserved all-ones value
+    @param bitmap: the bitmap to inspect
+    @return the count
+*/
+long countNoInformation(const Bitmap& bitmap);
+
+
+/**
+    @brief Number of pixels at a level in every row
+    @param bitmap: the bitmap to inspect
+    @param level: the level to count, pixel_values to count the pixels without information
+    @param counts: the destination vector, resized to rows entries
+    @return 0 if ok, 1 if level is above pixel_values
+*/
+int rowLevelCounts(const Bitmap& bitmap, uint8_t level, std::vector<long>* counts);
+
+/**
+    @brief Number of pixels at a level in every column, accumulated in 8 bit lanes of 64 bit words
+    @param bitmap: the bitmap to inspect
+    @param level: the level to count, pixel_values to count the pixels without information
+    @param counts: the destination vector, resized to cols*pixels_per_byte entries
+    @return 0 if ok, 1 if level is above pixel_values
+*/
+int colLevelCounts(const Bitmap& bitmap, uint8_t level, std::vector<long>* counts);
+
+
+
+}   //? End of p2b namespace
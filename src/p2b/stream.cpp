@@ -0,0 +1,156 @@
+#include "stream.hpp"
+#include "bitmap.hpp"
+#include "format.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/core/mat.hpp>
+
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+p2b::StripEncoder::StripEncoder(long img_rows, long img_cols, uint8_t pixel_size, const vector<uint8_t>& thresholds_v, const LumaWeights& luma_weights)
+    : bitmap(1, (img_cols + 8/pixel_size - 1)/(8/pixel_size), pixel_size, thresholds_v)
+{
+    this->img_rows = img_rows;
+    this->img_cols = img_cols;
+    this->rows_done = 0;
+    this->file = nullptr;
+    this->bitmap.setLumaWeights(luma_weights);
+}
+
+
+
+p2b::StripEncoder::~StripEncoder(){
+    if (this->file != nullptr) fclose(this->file);
+}
+
+
+
+long p2b::StripEncoder::getRowsDone() const { return this->rows_done; }
+
+
+
+/*
+    Bitmap with the same pixel_size, thresholds and luma weights as the one being built
+*/
+p2b::Bitmap p2b::StripEncoder::makeBitmap(long rows) const {
+    Bitmap ret_bm = Bitmap(rows, this->bitmap.getCols(), this->bitmap.getPixelSize(), this->bitmap.getThresholds());
+    ret_bm.setLumaWeights(this->bitmap.getLumaWeights());
+    ret_bm.setWidth(this->img_cols);
+    return ret_bm;
+}
+
+
+
+/*
+    The header is written right away since the dimensions are known, the payload is then appended strip by strip
+*/
+int p2b::StripEncoder::openFile(const string& path){
+
+    if (this->rows_done > 0 || this->file != nullptr){
+        ERROR_MSG("the output file must be opened before the first strip");
+        return 1;
+    }
+
+    const long cols = this->bitmap.getCols();
+    FileHeader header = makeHeader(
+        this->img_rows, cols, this->img_cols, this->bitmap.getPixelSize(), this->bitmap.getThresholds(), this->bitmap.getLumaWeights(),
+        0, 0, this->img_rows, cols
+    );
+
+    this->file = fopen(path.c_str(), "wb");
+    if (this->file == nullptr){
+        ERROR_MSG("unable to open " + path + " for writing");
+        return 1;
+    }
+    vector<uint8_t> padding(header.payload_offset - sizeof(FileHeader), 0);
+    if (
+        (fwrite(&header, sizeof(header), 1, this->file) != 1) ||
+        (fwrite(padding.data(), 1, padding.size(), this->file) != padding.size())
+    ){
+        ERROR_MSG("unable to write " + path);
+        fclose(this->file);
+        this->file = nullptr;
+        return 1;
+    }
+
+    this->file_path = path;
+    return 0;
+
+}
+
+
+
+int p2b::StripEncoder::pushStrip(cv::Mat* strip_ptr){
+
+    if (strip_ptr->cols != this->img_cols){
+        ERROR_MSG("strip width doesn't match the image width");
+        return 1;
+    }
+    if (this->rows_done + strip_ptr->rows > this->img_rows){
+        ERROR_MSG("strip goes past the last row of the image");
+        return 1;
+    }
+    if (strip_ptr->rows == 0) return 0;
+
+    if (this->file == nullptr){
+        //? The full size bitmap is only allocated once it is clear that no file will be used
+        if (this->rows_done == 0 && this->bitmap.getRows() != this->img_rows) this->bitmap = this->makeBitmap(this->img_rows);
+        if (this->bitmap.fromImageStrip(strip_ptr, this->rows_done) != 0) return 1;
+        this->rows_done += strip_ptr->rows;
+        return 0;
+    }
+
+    //? The scratch bitmap has no headroom, its rows are already laid out as in the file
+    if (strip_ptr->rows > this->bitmap.getRows()) this->bitmap = this->makeBitmap(strip_ptr->rows);
+    if (this->bitmap.fromImageStrip(strip_ptr, 0) != 0) return 1;
+
+    const size_t strip_bytes = (size_t) strip_ptr->rows * this->bitmap.getStride();
+    if (fwrite(this->bitmap.getData(), 1, strip_bytes, this->file) != strip_bytes){
+        ERROR_MSG("unable to write " + this->file_path);
+        return 1;
+    }
+    this->rows_done += strip_ptr->rows;
+    return 0;
+
+}
+
+
+
+int p2b::StripEncoder::finish(Bitmap* dst_ptr){
+
+    if (this->rows_done != this->img_rows){
+        ERROR_MSG("not every row of the image has been pushed");
+        return 1;
+    }
+
+    if (this->file != nullptr){
+        int ret = fclose(this->file);
+        this->file = nullptr;
+        if (ret != 0){
+            ERROR_MSG("unable to write " + this->file_path);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (dst_ptr == nullptr){
+        ERROR_MSG("a destination bitmap is required when not writing to a file");
+        return 1;
+    }
+    *dst_ptr = std::move(this->bitmap);
+    return 0;
+
+}
@@ -0,0 +1,118 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <opencv4/opencv2/core/mat.hpp>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+/**
+* @brief Converts an image that arrives as a sequence of row strips of any height (tiled readers, line-scan cameras):
+* every strip is quantized as soon as it is pushed, so the whole image is never in memory.
+* The packed rows go either in a Bitmap or straight to a .p2b file, in which case only one strip is ever held
+*/
+class StripEncoder{
+
+    private:
+
+        long img_rows;
+        long img_cols;
+        long rows_done;
+
+        //? The whole bitmap in memory mode, a scratch bitmap as tall as the tallest strip so far in file mode
+        Bitmap bitmap;
+
+        FILE* file;
+        std::string file_path;
+
+        Bitmap makeBitmap(long rows) const;
+
+    public:
+
+        /**
+            @brief Prepares the conversion of an image of img_rows x img_cols pixels
+            @param img_rows, img_cols: the dimensions of the whole image
+            @param pixel_size: how many bits to use per pixel (1, 2 or 4)
+            @param thresholds_v: the vector of uint8_t to use as thresholding to decide how to represent info
+            @param luma_weights: the weights used to convert BGR(A) strips to grayscale (default=LUMA_BT601)
+        */
+        StripEncoder(long img_rows, long img_cols, uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v, const LumaWeights& luma_weights=LUMA_BT601);
+        StripEncoder(const StripEncoder& other) = delete;
+        StripEncoder& operator=(const StripEncoder& other) = delete;
+        ~StripEncoder();
+
+        long getRowsDone() const;
+
+        /**
+            @brief Sends the packed rows to a .p2b file instead of keeping them, must be called before the first strip
+            @param path: the path of the file to create or overwrite
+            @return 0 if ok, 1 otherwise
+        */
+        int openFile(const std::string& path);
+
+        /**
+            @brief Quantizes the next rows of the image
+            @param strip_ptr: the strip, as wide as the image and with 1, 3 or 4 channels
+            @return 0 if ok, 1 otherwise
+        */
+        int pushStrip(cv::Mat* strip_ptr);
+
+        /**
+            @brief Ends the conversion once every row has been pushed
+            @param dst_ptr: where to move the bitmap in memory mode, ignored (may be nullptr) in file mode
+            @return 0 if ok, 1 otherwise
+        */
+        int finish(Bitmap* dst_ptr);
+
+};
+
+
+
+
+
+
+}   //? End of p2b namespace
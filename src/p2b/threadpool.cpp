@@ -0,0 +1,320 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+//? Pool and index of the worker running on this thread, nullptr and -1 outside of any pool
+static thread_local p2b::ThreadPool* tl_pool = nullptr;
+static thread_local long tl_worker_id = -1;
+
+//? Executor installed by setExecutor, nullptr for the shared pool
+static atomic<p2b::Executor*> custom_executor(nullptr);
+
+
+
+struct p2b::ThreadPool::ForState{
+    ThreadPool* pool;
+    const function<void(long)>* fn;
+    atomic<long> next;
+    atomic<long> done;
+    long n;
+    atomic<long> refs;      //? The caller and every helper task, the last one to leave recycles the state
+    mutex done_mutex;
+    condition_variable done_cv;
+};
+
+
+
+void p2b::ThreadPool::WorkerQueue::pushBack(const Task& task){
+    if (this->count == this->ring.size()){
+        vector<Task> grown(max((size_t) 16, 2*this->ring.size()));
+        for (size_t k=0; k<this->count; ++k) grown[k] = this->ring[(this->head + k) % this->ring.size()];
+        this->ring.swap(grown);
+        this->head = 0;
+    }
+    this->ring[(this->head + this->count) % this->ring.size()] = task;
+    ++this->count;
+}
+
+bool p2b::ThreadPool::WorkerQueue::popBack(Task* task){
+    if (this->count == 0) return false;
+    --this->count;
+    *task = this->ring[(this->head + this->count) % this->ring.size()];
+    return true;
+}
+
+bool p2b::ThreadPool::WorkerQueue::popFront(Task* task){
+    if (this->count == 0) return false;
+    *task = this->ring[this->head];
+    this->head = (this->head + 1) % this->ring.size();
+    --this->count;
+    return true;
+}
+
+
+
+p2b::ThreadPool::ThreadPool(size_t n_threads, bool pin_threads){
+    if (n_threads == 0) n_threads = thread::hardware_concurrency();
+    if (n_threads == 0) n_threads = 1;
+
+    this->pending = 0;
+    this->stopping = false;
+    for (size_t t=0; t<n_threads; ++t){
+        this->queues.push_back(make_unique<WorkerQueue>());
+    }
+    for (size_t t=0; t<n_threads; ++t){
+        this->workers.emplace_back(&ThreadPool::workerLoop, this, t);
+    }
+
+#ifdef __linux__
+    if (pin_threads){
+        const size_t n_cpus = max(1u, thread::hardware_concurrency());
+        for (size_t t=0; t<n_threads; ++t){
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(t % n_cpus, &cpu_set);
+            pthread_setaffinity_np(this->workers[t].native_handle(), sizeof(cpu_set), &cpu_set);
+        }
+    }
+#else
+    (void) pin_threads;
+#endif
+}
+
+
+
+p2b::ThreadPool::~ThreadPool(){
+    {
+        lock_guard<mutex> lock(this->sleep_mutex);
+        this->stopping = true;
+    }
+    this->sleep_cv.notify_all();
+    for (thread& worker : this->workers) worker.join();
+    for (ForState* state : this->free_states) delete state;
+}
+
+
+
+size_t p2b::ThreadPool::getThreadCount() const { return this->workers.size(); }
+size_t p2b::ThreadPool::getConcurrency() const { return this->workers.size() + 1; }    //? The caller of parallelFor works too
+
+
+
+/*
+    Own deque from the back (the most recently pushed task, still in cache), then the injection queue,
+    then the front of the other deques starting from the next worker
+*/
+bool p2b::ThreadPool::takeTask(long worker_id, Task* task){
+
+    auto popBack = [task](WorkerQueue& queue) -> bool {
+        lock_guard<mutex> lock(queue.queue_mutex);
+        return queue.popBack(task);
+    };
+    auto popFront = [task](WorkerQueue& queue) -> bool {
+        lock_guard<mutex> lock(queue.queue_mutex);
+        return queue.popFront(task);
+    };
+
+    const long n_queues = this->queues.size();
+    bool found = (worker_id >= 0 && popBack(*this->queues[worker_id])) || popFront(this->injected);
+    for (long k=1; !found && k<=n_queues; ++k){
+        long victim = (worker_id + k) % n_queues;
+        if (victim < 0) victim += n_queues;
+        if (victim != worker_id) found = popFront(*this->queues[victim]);
+    }
+
+    if (found) this->pending.fetch_sub(1);
+    return found;
+
+}
+
+
+
+void p2b::ThreadPool::workerLoop(size_t worker_id){
+    tl_pool = this;
+    tl_worker_id = worker_id;
+
+    Task task;
+    while (true){
+        if (this->takeTask(worker_id, &task)){
+            task.run(task.arg);
+            continue;
+        }
+
+        unique_lock<mutex> lock(this->sleep_mutex);
+        this->sleep_cv.wait(lock, [this](){ return this->stopping || this->pending.load() > 0; });
+        if (this->stopping && this->pending.load() == 0) return;    //? Queued tasks are drained first
+    }
+}
+
+
+
+void p2b::ThreadPool::submit(function<void()> task){
+    auto run = [](void* arg) -> void {
+        function<void()>* heap_task = (function<void()>*) arg;
+        (*heap_task)();
+        delete heap_task;
+    };
+    this->submitTask({run, new function<void()>(std::move(task))});
+}
+
+
+
+void p2b::ThreadPool::submitTask(const Task& task){
+    WorkerQueue& queue = (tl_pool == this) ? *this->queues[tl_worker_id] : this->injected;
+    {
+        lock_guard<mutex> lock(queue.queue_mutex);
+        queue.pushBack(task);
+    }
+    {
+        //? Taking the lock orders the increment with the check of a worker about to sleep
+        lock_guard<mutex> lock(this->sleep_mutex);
+        this->pending.fetch_add(1);
+    }
+    this->sleep_cv.notify_one();
+}
+
+
+
+p2b::ThreadPool::ForState* p2b::ThreadPool::acquireState(){
+    {
+        lock_guard<mutex> lock(this->free_states_mutex);
+        if (!this->free_states.empty()){
+            ForState* state = this->free_states.back();
+            this->free_states.pop_back();
+            return state;
+        }
+    }
+    ForState* state = new ForState();
+    state->pool = this;
+    return state;
+}
+
+void p2b::ThreadPool::releaseState(ForState* state){
+    if (state->refs.fetch_sub(1) != 1) return;
+    lock_guard<mutex> lock(this->free_states_mutex);
+    this->free_states.push_back(state);
+}
+
+
+
+//? Takes indexes until there are none left, the call that completes the last item wakes the caller
+static void drainItems(atomic<long>& next, atomic<long>& done, long n, const function<void(long)>& fn, mutex& done_mutex, condition_variable& done_cv){
+    long i;
+    while ((i = next.fetch_add(1)) < n){
+        fn(i);
+        if (done.fetch_add(1) + 1 == n){
+            lock_guard<mutex> lock(done_mutex);
+            done_cv.notify_all();
+        }
+    }
+}
+
+void p2b::ThreadPool::runHelper(void* arg){
+    ForState* state = (ForState*) arg;
+    drainItems(state->next, state->done, state->n, *state->fn, state->done_mutex, state->done_cv);
+    state->pool->releaseState(state);
+}
+
+
+
+/*
+    The state is shared with the helper tasks, which may start after the call has already returned:
+    completion is counted in items, not in helpers, so a call never waits for a helper to be scheduled.
+    A helper starting late finds no index left, and the state goes back to the free list when the last helper leaves
+*/
+void p2b::ThreadPool::parallelFor(long n, const function<void(long)>& fn){
+
+    if (n <= 0) return;
+
+    const long n_helpers = min((long) this->workers.size(), n - 1);
+    ForState* state = this->acquireState();
+    state->fn = &fn;    //? Only called while the call is running, since done < n until then
+    state->next = 0;
+    state->done = 0;
+    state->n = n;
+    state->refs = n_helpers + 1;
+
+    for (long h=0; h<n_helpers; ++h){
+        this->submitTask({runHelper, state});
+    }
+    drainItems(state->next, state->done, n, fn, state->done_mutex, state->done_cv);
+
+    {
+        unique_lock<mutex> lock(state->done_mutex);
+        state->done_cv.wait(lock, [state, n](){ return state->done.load() == n; });
+    }
+    this->releaseState(state);
+
+}
+
+
+
+p2b::ThreadPool& p2b::sharedThreadPool(){
+    static ThreadPool pool;
+    return pool;
+}
+
+void p2b::setExecutor(Executor* executor){ custom_executor.store(executor); }
+
+p2b::Executor& p2b::getExecutor(){
+    Executor* executor = custom_executor.load();
+    return (executor != nullptr) ? *executor : sharedThreadPool();
+}
+
+
+
+void p2b::parallelRows(long n_rows, long row_bytes, const function<void(long, long)>& fn){
+
+    if (n_rows <= 0) return;
+
+    Executor& executor = getExecutor();
+    const long concurrency = executor.getConcurrency();
+
+    long rows_per_chunk = max(MIN_ROWS_PER_CHUNK, CHUNK_BYTES / max(1L, row_bytes));
+    //? Small images are split more finely so that every thread gets some rows
+    if ((n_rows + rows_per_chunk - 1)/rows_per_chunk < concurrency){
+        rows_per_chunk = max(MIN_ROWS_PER_CHUNK, (n_rows + concurrency - 1)/concurrency);
+    }
+    const long n_chunks = (n_rows + rows_per_chunk - 1)/rows_per_chunk;
+
+    if (n_chunks <= 1){
+        fn(0, n_rows);
+        return;
+    }
+
+    //? A single captured reference keeps the std::function in its inline storage
+    struct Chunks{
+        const function<void(long, long)>* fn;
+        long rows_per_chunk;
+        long n_rows;
+    } chunks = {&fn, rows_per_chunk, n_rows};
+    executor.parallelFor(
+        n_chunks,
+        [&chunks](long c) -> void {
+            (*chunks.fn)(c*chunks.rows_per_chunk, min(chunks.n_rows, (c + 1)*chunks.rows_per_chunk));
+        }
+    );
+
+}
@@ -0,0 +1,211 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+/**
+* @brief Interface of whatever runs the parallel work of the library, implement it to run p2b on your own pool
+*/
+class Executor{
+
+    public:
+
+        virtual ~Executor() = default;
+
+        //? How many items can run at the same time, used to size the chunks
+        virtual size_t getConcurrency() const = 0;
+
+        /**
+            @brief Runs fn(i) for every i in [0, n), returning when all are done
+            @param n: how many items to process
+            @param fn: the function processing an item
+        */
+        virtual void parallelFor(long n, const std::function<void(long)>& fn) = 0;
+
+};
+
+
+
+/**
+* @brief Work-stealing pool: every worker owns a deque it pushes to and pops from at the back,
+* idle workers steal from the front of the others' deques, tasks submitted from outside
+* the pool go through a shared injection queue. Workers sleep when there is nothing to run.
+* Once warmed up parallelFor does not allocate: tasks are plain function pointers kept in ring buffers
+* that only grow, and the state shared by the helpers of a call is recycled
+*/
+class ThreadPool : public Executor{
+
+    private:
+
+        struct Task{
+            void (*run)(void*);
+            void* arg;
+        };
+
+        //? Deque of tasks as a ring buffer, it allocates only when it grows past its largest size so far
+        struct WorkerQueue{
+            std::mutex queue_mutex;
+            std::vector<Task> ring;
+            size_t head = 0;
+            size_t count = 0;
+
+            void pushBack(const Task& task);
+            bool popBack(Task* task);
+            bool popFront(Task* task);
+        };
+
+        //? State of a parallelFor call, shared with its helper tasks and recycled once all of them are done
+        struct ForState;
+
+        std::vector<std::thread> workers;
+        std::vector<std::unique_ptr<WorkerQueue>> queues;
+        WorkerQueue injected;
+
+        std::mutex free_states_mutex;
+        std::vector<ForState*> free_states;
+
+        //? Tasks pushed and not yet taken, workers sleep on sleep_cv while it is 0
+        std::atomic<long> pending;
+        std::mutex sleep_mutex;
+        std::condition_variable sleep_cv;
+        bool stopping;
+
+        void workerLoop(size_t worker_id);
+        bool takeTask(long worker_id, Task* task);
+        void submitTask(const Task& task);
+        ForState* acquireState();
+        void releaseState(ForState* state);
+        static void runHelper(void* state);
+
+    public:
+
+        /**
+            @brief Starts the worker threads
+            @param n_threads: how many workers to start, 0 to use one per hardware thread (default=0)
+            @param pin_threads: boolean flag to pin worker t to CPU t modulo the number of CPUs (default=false)
+        */
+        explicit ThreadPool(size_t n_threads=0, bool pin_threads=false);
+        ThreadPool(const ThreadPool& other) = delete;
+        ThreadPool& operator=(const ThreadPool& other) = delete;
+        ~ThreadPool();
+
+        size_t getThreadCount() const;
+        size_t getConcurrency() const override;
+
+        //? Queues a task, on the deque of the calling worker if it is one of ours. The task is moved to the heap
+        void submit(std::function<void()> task);
+
+        /**
+            @brief Runs fn(i) for every i in [0, n) on the workers and on the calling thread, returning when all are done.
+            Indexes are handed out one at a time, so uneven items balance themselves.
+            It can be called from inside a task: the caller keeps taking indexes instead of waiting for a worker
+            @param n: how many items to process
+            @param fn: the function processing an item
+        */
+        void parallelFor(long n, const std::function<void(long)>& fn) override;
+
+};
+
+
+
+/**
+    @brief The pool used by default by the library, started on first use with one worker per hardware thread
+    @return the shared pool
+*/
+ThreadPool& sharedThreadPool();
+
+/**
+    @brief Makes every parallel function of the library run on the given executor
+    @param executor: the executor to use, it must outlive its use; nullptr goes back to sharedThreadPool
+*/
+void setExecutor(Executor* executor);
+
+/**
+    @brief The executor the parallel functions of the library currently run on
+    @return the executor set by setExecutor, or sharedThreadPool
+*/
+Executor& getExecutor();
+
+
+
+//? Rows processed by a parallel kernel are split in chunks of about CHUNK_BYTES bytes (half of a typical L2)
+//? but never thinner than MIN_ROWS_PER_CHUNK rows
+const long CHUNK_BYTES = 128*1024;
+const long MIN_ROWS_PER_CHUNK = 16;
+
+/**
+    @brief Splits [0, n_rows) in cache sized chunks of whole rows and runs them on the current executor,
+    a single chunk being run directly on the calling thread
+    @param n_rows: how many rows to process
+    @param row_bytes: how many bytes a row reads and writes, used to size the chunks
+    @param fn: the function processing the rows [first, last) of a chunk
+*/
+void parallelRows(long n_rows, long row_bytes, const std::function<void(long, long)>& fn);
+
+//? Same as parallelRows, fn is wrapped by reference so that no std::function holding its captures is allocated
+template <typename Fn>
+void parallelRows(long n_rows, long row_bytes, const Fn& fn){
+    parallelRows(n_rows, row_bytes, std::function<void(long, long)>(std::cref(fn)));
+}
+
+/**
+    @brief Runs fn(i) for every i in [0, n) on the current executor, wrapping fn by reference
+    so that no std::function holding its captures is allocated
+    @param n: how many items to process
+    @param fn: the function processing an item
+*/
+template <typename Fn>
+void parallelFor(long n, const Fn& fn){
+    getExecutor().parallelFor(n, std::function<void(long)>(std::cref(fn)));
+}
+
+
+
+}   //? End of p2b namespace
@@ -0,0 +1,366 @@
+#include "tiled_bitmap.hpp"
+#include "bitmap.hpp"
+#include "kernels.hpp"
+#include "threadpool.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <opencv2/core/mat.hpp>
+#include <vector>
+
+
+
+using namespace std;
+
+
+// ----------------------------------------------------------------------
+
+
+
+//? Division rounding towards minus infinity, the grid extends to negative coordinates
+static long floorDiv(long a, long b){
+    return (a >= 0) ? a/b : -((-a + b - 1)/b);
+}
+
+
+
+
+
+p2b::TiledBitmap::TiledBitmap(uint8_t pixel_size, const vector<uint8_t>& thresholds_v){
+
+    if ((pixel_size < 1) || (pixel_size > 4) || (pixel_size & (pixel_size-1)) != 0){
+        ERROR_MSG("pixel_size is not one of {1, 2, 4}");
+        exit(1);
+    }
+    if (thresholds_v.size() != ((size_t) (1 << pixel_size) - 1)){
+        ERROR_MSG("thresholds_v is not a vector of 8/pixel_size thresholds to apply");
+        exit(1);
+    }
+    if (! is_sorted(thresholds_v.begin(), thresholds_v.end())){
+        ERROR_MSG("thresholds_v is not sorted in ascending order");
+        exit(1);
+    }
+
+    this->pixel_size = pixel_size;
+    this->pixels_per_byte = 8/pixel_size;
+    this->pixel_values = (1 << pixel_size) - 1;
+    this->thresholds_v = thresholds_v;
+    this->luma_weights = LUMA_BT601;
+
+    p2b::buildEncodeTables(this->pixel_size, this->thresholds_v.data(), nullptr, this->packed_lut);
+
+    this->min_r = 0;
+    this->max_r = 0;
+    this->min_c = 0;
+    this->max_c = 0;
+
+    this->last_add_r0 = -1;
+    this->last_add_c0 = -1;
+    this->last_add_height = -1;
+    this->last_add_width = -1;
+
+}
+
+
+
+uint64_t p2b::TiledBitmap::tileKey(long tile_r, long tile_c){
+    return ((uint64_t) (uint32_t) tile_r << 32) | (uint64_t) (uint32_t) tile_c;
+}
+
+
+
+/*
+    Returns the tile at (tile_r, tile_c), allocating it filled with 0b11111111 the first time it is written
+*/
+uint8_t* p2b::TiledBitmap::tileAt(long tile_r, long tile_c){
+    auto it = this->tiles.try_emplace(tileKey(tile_r, tile_c), TILE_ROWS*TILE_BYTES, 255).first;
+    return it->second.getData();
+}
+
+
+
+/*
+    Returns the tile at (tile_r, tile_c) or nullptr if it was never written
+*/
+const uint8_t* p2b::TiledBitmap::tileAt(long tile_r, long tile_c) const {
+    auto it = this->tiles.find(tileKey(tile_r, tile_c));
+    return (it != this->tiles.end()) ? it->second.getData() : nullptr;
+}
+
+
+
+
+
+long p2b::TiledBitmap::getRows() const { return this->max_r - this->min_r; }
+long p2b::TiledBitmap::getCols() const { return this->max_c - this->min_c; }
+uint8_t p2b::TiledBitmap::getPixelSize() const { return this->pixel_size; }
+uint8_t p2b::TiledBitmap::getPixelValues() const { return this->pixel_values; }
+const vector<uint8_t>& p2b::TiledBitmap::getThresholds() const { return this->thresholds_v; }
+size_t p2b::TiledBitmap::getTileCount() const { return this->tiles.size(); }
+size_t p2b::TiledBitmap::getAllocatedBytes() const { return this->tiles.size() * TILE_ROWS*TILE_BYTES; }
+p2b::LumaWeights p2b::TiledBitmap::getLumaWeights() const { return this->luma_weights; }
+void p2b::TiledBitmap::setLumaWeights(const LumaWeights& luma_weights){ this->luma_weights = luma_weights; }
+
+
+
+
+
+/*
+    Quantizes img into the tiles, its top-left pixel landing on grid row grid_row and grid pixel grid_pixel,
+    with the same merge_edges rules as Bitmap::encodeImage.
+    The tiles are allocated first on the calling thread, then every tile crossed by the image is filled independently
+*/
+void p2b::TiledBitmap::encodeImage(const cv::Mat& img, long grid_row, long grid_pixel, bool merge_edges, bool parallel){
+
+    struct TileJob{
+        uint8_t* tile;
+        long tile_r;
+        long tile_c;
+    };
+
+    const long tile_pixels = TILE_BYTES*this->pixels_per_byte;
+    const long tr0 = floorDiv(grid_row, TILE_ROWS);
+    const long tr1 = floorDiv(grid_row + img.rows - 1, TILE_ROWS);
+    const long tc0 = floorDiv(grid_pixel, tile_pixels);
+    const long tc1 = floorDiv(grid_pixel + img.cols - 1, tile_pixels);
+
+    vector<TileJob> jobs;
+    jobs.reserve((tr1 - tr0 + 1) * (tc1 - tc0 + 1));
+    for (long tr=tr0; tr<=tr1; ++tr){
+        for (long tc=tc0; tc<=tc1; ++tc){
+            jobs.push_back({this->tileAt(tr, tc), tr, tc});
+        }
+    }
+
+    auto encode_tiles = [this, &img, &jobs, grid_row, grid_pixel, tile_pixels, merge_edges](long j) -> void {
+        const TileJob& job = jobs[j];
+        long r_a = max(grid_row, job.tile_r*TILE_ROWS);
+        long r_b = min(grid_row + (long) img.rows, (job.tile_r + 1)*TILE_ROWS);
+        long p_a = max(grid_pixel, job.tile_c*tile_pixels);
+        long p_b = min(grid_pixel + (long) img.cols, (job.tile_c + 1)*tile_pixels);
+        long tile_pixel = p_a - job.tile_c*tile_pixels;
+
+        const uint8_t* img_data = img.ptr<uint8_t>(r_a - grid_row) + (p_a - grid_pixel)*img.channels();
+        uint8_t* bm_data = job.tile + (r_a - job.tile_r*TILE_ROWS)*TILE_BYTES + tile_pixel/this->pixels_per_byte;
+        if (merge_edges){
+            p2b::encodeRegionRows(
+                img_data, img.step[0], img.channels(), r_b - r_a, p_b - p_a,
+                bm_data, TILE_BYTES, tile_pixel%this->pixels_per_byte,
+                this->pixel_size, this->thresholds_v.data(), this->packed_lut, this->luma_weights
+            );
+        }
+        else {
+            p2b::encodeRows(
+                img_data, img.step[0], img.channels(), r_b - r_a, p_b - p_a,
+                bm_data, TILE_BYTES,
+                this->pixel_size, this->thresholds_v.data(), this->packed_lut, this->luma_weights
+            );
+        }
+    };
+
+    //? Tiles never overlap, so every tile is a task of its own
+    if (parallel) p2b::parallelFor(jobs.size(), encode_tiles);
+    else for (long j=0; j<(long) jobs.size(); ++j) encode_tiles(j);
+
+}
+
+
+
+
+
+/*
+    Same as Bitmap::updateRegionFromImage: start_row and start_col are image pixel indexes
+    relative to the top-left corner of the canvas and the region must lie inside it
+*/
+int p2b::TiledBitmap::updateRegionFromImage(cv::Mat* update_img_ptr, long start_row, long start_col){
+    if (start_row < 0 || start_col < 0){
+        ERROR_MSG("start_row and start_col must not be negative");
+        return 1;
+    }
+    if (
+        (start_row + update_img_ptr->rows > this->getRows()) || 
+        ((start_col + update_img_ptr->cols +this->pixels_per_byte-1)/this->pixels_per_byte > this->getCols())
+    ){
+        ERROR_MSG("total expected dimensions are bigger than bitmap dimensions");
+        return 1;
+    }
+    if (update_img_ptr->channels() == 2 || update_img_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
+    }
+    if (update_img_ptr->rows == 0 || update_img_ptr->cols == 0) return 0;
+
+    this->encodeImage(*update_img_ptr, this->min_r + start_row, this->min_c*this->pixels_per_byte + start_col, true, true);
+    return 0;
+}
+
+
+
+int p2b::TiledBitmap::addImage(cv::Mat* img_ptr, const int add_direction, bool minimal_resizing){
+    if (add_direction < 0 || add_direction > 3){
+        ERROR_MSG("invalid add_direction constant (UP=0, RIGHT=1, DOWN=2, LEFT=3)");
+        return 1;
+    }
+    if (img_ptr->channels() == 2 || img_ptr->channels() > 4){
+        ERROR_MSG("only grayscale, BGR and BGRA images can be converted");
+        return 1;
+    }
+    if (img_ptr->rows == 0 || img_ptr->cols == 0){
+        ERROR_MSG("cannot add an empty image");
+        return 1;
+    }
+
+    long img_rows = img_ptr->rows;
+    long img_cols = (img_ptr->cols + this->pixels_per_byte - 1)/this->pixels_per_byte;
+
+    long start_row = 0;
+    long start_col = 0;
+
+    //? The first image is placed at the origin of the grid, the next ones next to the last added
+    if (this->last_add_height != -1){
+        switch (add_direction) {
+            case p2b::DIR_UP:
+                start_row = this->last_add_r0 - img_rows;
+                start_col = this->last_add_c0;
+                break;
+            case p2b::DIR_RIGHT:
+                start_row = this->last_add_r0;
+                start_col = this->last_add_c0 + this->last_add_width;
+                break;
+            case p2b::DIR_DOWN:
+                start_row = this->last_add_r0 + this->last_add_height;
+                start_col = this->last_add_c0;
+                break;
+            case p2b::DIR_LEFT:
+                start_row = this->last_add_r0;
+                start_col = this->last_add_c0 - img_cols;
+                break;
+        }
+        //? Same growth as Bitmap::doubleSize, which only changes the extent of the canvas since tiles are allocated on write
+        while (
+            !minimal_resizing &&
+            (start_row < this->min_r || start_row + img_rows > this->max_r || start_col < this->min_c || start_col + img_cols > this->max_c)
+        ){
+            const long canvas_rows = this->getRows();
+            const long canvas_cols = this->getCols();
+            if (add_direction == p2b::DIR_UP) this->min_r -= canvas_rows;
+            else this->max_r += canvas_rows;
+            if (add_direction == p2b::DIR_LEFT) this->min_c -= canvas_cols;
+            else this->max_c += canvas_cols;
+        }
+        this->min_r = min(this->min_r, start_row);
+        this->max_r = max(this->max_r, start_row + img_rows);
+        this->min_c = min(this->min_c, start_col);
+        this->max_c = max(this->max_c, start_col + img_cols);
+    }
+    else {
+        this->max_r = img_rows;
+        this->max_c = img_cols;
+    }
+
+    //? Growing the canvas is free, only the tiles under the image are touched
+    this->encodeImage(*img_ptr, start_row, start_col*this->pixels_per_byte, false, true);
+
+    this->last_add_r0 = start_row;
+    this->last_add_c0 = start_col;
+    this->last_add_height = img_rows;
+    this->last_add_width = img_cols;
+
+    return 0;
+
+}
+
+
+
+
+
+/*
+    Expands the canvas tile row by tile row, the parts covered by tiles that were never
+    written are filled with 0 like the reserved value they stand for
+*/
+int p2b::TiledBitmap::toGrayscaleImage_linear(cv::Mat* dst_img, const vector<uint8_t>& grayscale_palette){
+
+    if (grayscale_palette.size() != this->pixel_values){
+        ERROR_MSG("grayscale_palette size doesn't match pixel_values");
+        return 1;
+    }
+
+    dst_img->create(this->getRows(), this->getCols()*this->pixels_per_byte, CV_8UC1);
+
+    uint8_t decode_table[256][8];
+    p2b::buildDecodeTable(this->pixel_size, grayscale_palette.data(), decode_table);
+
+    const long tr0 = floorDiv(this->min_r, TILE_ROWS);
+    const long tr1 = floorDiv(this->max_r - 1, TILE_ROWS);
+    for (long tr=tr0; tr<=tr1; ++tr){
+        this->decodeTileRow(dst_img, tr, decode_table);
+    }
+
+    return 0;
+
+}
+
+
+
+int p2b::TiledBitmap::toGrayscaleImage_parallel(cv::Mat* dst_img, const vector<uint8_t>& grayscale_palette){
+
+    if (grayscale_palette.size() != this->pixel_values){
+        ERROR_MSG("grayscale_palette size doesn't match pixel_values");
+        return 1;
+    }
+
+    dst_img->create(this->getRows(), this->getCols()*this->pixels_per_byte, CV_8UC1);
+
+    //? The table is built once per call and shared read-only by the workers
+    uint8_t decode_table[256][8];
+    p2b::buildDecodeTable(this->pixel_size, grayscale_palette.data(), decode_table);
+
+    //? Tile rows cover disjoint bands of the image, each worker gets whole tile rows
+    const long tr0 = floorDiv(this->min_r, TILE_ROWS);
+    const long tr1 = floorDiv(this->max_r - 1, TILE_ROWS);
+    p2b::parallelFor(
+        tr1 - tr0 + 1,
+        [this, dst_img, &decode_table, tr0](long i) -> void {
+            this->decodeTileRow(dst_img, tr0 + i, decode_table);
+        }
+    );
+
+    return 0;
+
+}
+
+
+
+/*
+    Expands the canvas rows covered by the tile row tile_r into dst_img
+*/
+void p2b::TiledBitmap::decodeTileRow(cv::Mat* dst_img, long tile_r, const uint8_t decode_table[256][8]) const {
+
+    const long r_a = max(this->min_r, tile_r*TILE_ROWS);
+    const long r_b = min(this->max_r, (tile_r + 1)*TILE_ROWS);
+    const long tc0 = floorDiv(this->min_c, TILE_BYTES);
+    const long tc1 = floorDiv(this->max_c - 1, TILE_BYTES);
+
+    for (long tc=tc0; tc<=tc1; ++tc){
+        const long c_a = max(this->min_c, tc*TILE_BYTES);
+        const long c_b = min(this->max_c, (tc + 1)*TILE_BYTES);
+        const long img_col = (c_a - this->min_c)*this->pixels_per_byte;
+        const uint8_t* tile = this->tileAt(tile_r, tc);
+
+        if (tile == nullptr){
+            for (long r=r_a; r<r_b; ++r){
+                memset(dst_img->ptr<uint8_t>(r - this->min_r) + img_col, 0, (c_b - c_a)*this->pixels_per_byte);
+            }
+            continue;
+        }
+
+        p2b::decodeRows(
+            tile + (r_a - tile_r*TILE_ROWS)*TILE_BYTES + (c_a - tc*TILE_BYTES), TILE_BYTES, r_b - r_a, c_b - c_a,
+            dst_img->ptr<uint8_t>(r_a - this->min_r) + img_col, dst_img->step[0], this->pixel_size, decode_table
+        );
+    }
+
+}
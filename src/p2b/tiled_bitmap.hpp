@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#pragma once
+
+#include "bitmap.hpp"
+#include "buffer.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+#include <opencv4/opencv2/core/mat.hpp>
+
+
+// ----------------------------------------------------------------------
+
+
+
+namespace p2b{
+
+
+
+//? Every tile holds TILE_ROWS rows of TILE_BYTES bitmap bytes (TILE_BYTES*8/pixel_size pixels)
+const long TILE_ROWS = 64;
+const long TILE_BYTES = 64;
+
+
+
+/**
+* @brief Sparse alternative to Bitmap for unbounded mosaics: the canvas is split in fixed size packed tiles
+* that are allocated only when written, so memory scales with the content instead of with the bounding box.
+* A tile that was never written reads as the reserved 1, 11, 1111 value everywhere
+*/
+class TiledBitmap{
+
+    private:
+
+        uint8_t pixel_size;
+        uint8_t pixels_per_byte;
+        uint8_t pixel_values;
+        std::vector<uint8_t> thresholds_v;
+
+        //? Same lookup table as Bitmap, the pixel value repeated in every position of a byte
+        uint8_t packed_lut[256];
+
+        //? Weights of the fused BGR(A) to grayscale conversion
+        LumaWeights luma_weights;
+
+        //? Tiles live in an unbounded grid of rows and bytes, the canvas is the bounding box
+        //? [min_r, max_r) x [min_c, max_c) of everything added so far: growing it never moves data
+        long min_r;
+        long max_r;
+        long min_c;
+        long max_c;
+
+        //? Values used to store informations about the last added image, in grid coordinates
+        long last_add_r0;
+        long last_add_c0;
+        long last_add_height;
+        long last_add_width;
+
+        //? Directory of the allocated tiles, indexed by tileKey(tile_row, tile_col)
+        std::unordered_map<uint64_t, Buffer> tiles;
+
+        static uint64_t tileKey(long tile_r, long tile_c);
+        uint8_t* tileAt(long tile_r, long tile_c);
+        const uint8_t* tileAt(long tile_r, long tile_c) const;
+        void encodeImage(const cv::Mat& img, long grid_row, long grid_pixel, bool merge_edges, bool parallel);
+        void decodeTileRow(cv::Mat* dst_img, long tile_r, const uint8_t decode_table[256][8]) const;
+
+    public:
+
+        TiledBitmap(uint8_t pixel_size, const std::vector<uint8_t>& thresholds_v);
+
+        long getRows() const;
+        long getCols() const;
+        uint8_t getPixelSize() const;
+        uint8_t getPixelValues() const;
+        const std::vector<uint8_t>& getThresholds() const;
+        size_t getTileCount() const;
+        size_t getAllocatedBytes() const;
+        LumaWeights getLumaWeights() const;
+        void setLumaWeights(const LumaWeights& luma_weights);
+
+        int updateRegionFromImage(cv::Mat* update_img_ptr, long start_row, long start_col);
+
+        //? Same placement and growth rules as Bitmap::addImage: with minimal_resizing the canvas grows by exactly
+        //? what the image needs, otherwise it doubles until the image fits, which allocates nothing here
+        int addImage(cv::Mat* add_img_ptr, const int add_direction, bool minimal_resizing);
+
+        int toGrayscaleImage_linear(cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette);
+        int toGrayscaleImage_parallel(cv::Mat* dst_img, const std::vector<uint8_t>& grayscale_palette);
+
+};
+
+
+
+
+
+
+}   //? End of p2b namespace
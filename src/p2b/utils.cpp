@@ -30,14 +30,12 @@ void p2b::ERROR_MSG(std::string msg){
 
 
 
-void p2b::PRINT_METRICS(cv::Mat img, p2b::Bitmap bitmap, long img2bmp_time_ms, long bmp2img_time_ms){
+void p2b::PRINT_METRICS(const cv::Mat& img, const p2b::Bitmap& bitmap, long img2bmp_time_ms, long bmp2img_time_ms){
 
     const unsigned max_len = 512; //? If more chars will ever be needed
     char out_msg[max_len] = "\0";
 
     const int channels = img.channels();
-    cv::Mat gs_img;
-    cv::cvtColor(img, gs_img, cv::COLOR_BGR2GRAY);
     
     size_t img_size = 0;
     size_t gsc_size = 0;
@@ -64,14 +62,13 @@ void p2b::PRINT_METRICS(cv::Mat img, p2b::Bitmap bitmap, long img2bmp_time_ms, l
     //? Grayscale image size calculation
     gsc_size += (
         img.rows * img.cols +
-        img.rows * sizeof(gs_img.at<uint8_t>(0)) +
+        img.rows * sizeof(uint8_t) +
         sizeof(img)
     );
 
-    //? Bitmap object size calculation
+    //? Bitmap object size calculation (single padded buffer, no per-row overhead)
     bmp_size += (
-        bitmap.getRows() * bitmap.getCols() +
-        bitmap.getRows() * sizeof(bitmap.getVec()[0]) +
+        bitmap.getAllocatedBytes() +
         sizeof(bitmap)
     );
 
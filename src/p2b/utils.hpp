@@ -14,7 +14,7 @@ namespace p2b {
 
 void DEBUG_MSG(std::string msg);
 void ERROR_MSG(std::string msg);
-void PRINT_METRICS(cv::Mat img, p2b::Bitmap bitmap, long img2bmp_time_ms, long bmp2img_time_ms);
+void PRINT_METRICS(const cv::Mat& img, const p2b::Bitmap& bitmap, long img2bmp_time_ms, long bmp2img_time_ms);
 long MAX_SIZE(long size_1, long size_2);
 
 
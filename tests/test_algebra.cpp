@@ -0,0 +1,136 @@
+#include "test_utils.hpp"
+
+#include "algebra.hpp"
+#include "core.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+
+
+const int MAX_WIDTH = 100;
+const int TEST_ROWS = 3;
+
+
+
+/*
+    Every operator of the algebra against its per-pixel definition, out of place and in place.
+    The pixels past the width must stay reserved, whatever the operator does to the others
+*/
+template <typename Op, typename Ref>
+static void checkBinary(const p2b::Bitmap& a, const p2b::Bitmap& b, Op op, Ref ref, const char* what){
+    p2b::Bitmap dst;
+    p2b::Bitmap in_place = a;
+    CHECK(op(a, b, &dst) == 0 && op(in_place, b, &in_place) == 0, "%s: failed", what);
+    CHECK(sameBytes(dst, in_place), "%s: in place result differs", what);
+    CHECK(dst.getWidth() == a.getWidth() && dst.getThresholds() == a.getThresholds(), "%s: dst didn't take the format of the first operand", what);
+
+    const int reserved = (1 << a.getPixelSize()) - 1;
+    for (long i=0; i<a.getRows(); ++i){
+        for (long p=0; p<a.getCols()*(8/a.getPixelSize()); ++p){
+            const int expected = (p < a.getWidth()) ? ref(getPixel(a, i, p), getPixel(b, i, p)) : reserved;
+            if (getPixel(dst, i, p) != expected){
+                CHECK(false, "%s: pixel_size %d, width %ld, pixel (%ld, %ld) is %d instead of %d",
+                    what, a.getPixelSize(), a.getWidth(), i, p, getPixel(dst, i, p), expected);
+                return;
+            }
+        }
+    }
+}
+
+static void testAlgebra(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+        const int reserved = (1 << pixel_size) - 1;
+        for (int width=1; width<=MAX_WIDTH; ++width){
+            const int rows = TEST_ROWS + width % 4;
+            cv::Mat img_a = randomImage(rows, width, 1, 0);
+            cv::Mat img_b = randomImage(rows, width, 1, 0);
+            cv::Mat img_m = randomImage(rows, width, 1, 0);
+            const p2b::Bitmap a = p2b::toBitmap(&img_a, pixel_size, thresholds_v);
+            const p2b::Bitmap b = p2b::toBitmap(&img_b, pixel_size, thresholds_v);
+            const p2b::Bitmap mask = p2b::toBitmap(&img_m, pixel_size, thresholds_v);
+            p2b::Bitmap dst;
+
+            if (pixel_size == 1){
+                checkBinary(a, b, p2b::bitmapAnd, [](int x, int y){ return x & y; }, "and");
+                checkBinary(a, b, p2b::bitmapOr, [](int x, int y){ return x | y; }, "or");
+                checkBinary(a, b, p2b::bitmapXor, [](int x, int y){ return x ^ y; }, "xor");
+                checkBinary(a, b, [](const p2b::Bitmap& x, const p2b::Bitmap&, p2b::Bitmap* d){ return p2b::bitmapNot(x, d); },
+                    [](int x, int){ return x ^ 1; }, "not");
+                if (width == 1) CHECK(p2b::bitmapMin(a, b, &dst) == 1, "min accepted 1 bit operands");
+                continue;
+            }
+
+            checkBinary(a, b, p2b::bitmapMin, [](int x, int y){ return min(x, y); }, "min");
+            checkBinary(a, b, p2b::bitmapMax,
+                [reserved](int x, int y){ return (x == reserved) ? y : (y == reserved) ? x : max(x, y); }, "max");
+            CHECK(p2b::bitmapSelect(mask, a, b, &dst) == 0, "select failed");
+            bool ok = true;
+            for (long i=0; i<a.getRows() && ok; ++i){
+                for (long p=0; p<a.getCols()*(8/pixel_size) && ok; ++p){
+                    const int m = getPixel(mask, i, p);
+                    const int expected = (p >= width || m == reserved) ? reserved : (m > 0) ? getPixel(a, i, p) : getPixel(b, i, p);
+                    ok = getPixel(dst, i, p) == expected;
+                }
+            }
+            CHECK(ok, "select: pixel_size %d, width %d", pixel_size, width);
+            if (width == 1) CHECK(p2b::bitmapAnd(a, b, &dst) == 1, "and accepted %d bit operands", pixel_size);
+        }
+    }
+}
+
+
+
+/*
+    A dst that already has the geometry of the operands is written in place: it takes the format
+    of the first operand and reports the whole result as written
+*/
+static void testExistingDst(){
+    cv::Mat img_a = randomImage(20, 77, 1, 0);
+    cv::Mat img_b = randomImage(20, 77, 1, 0);
+    const p2b::Bitmap a = p2b::toBitmap(&img_a, 2, testThresholds(2), true, p2b::LUMA_BT709);
+    const p2b::Bitmap b = p2b::toBitmap(&img_b, 2, testThresholds(2));
+
+    cv::Mat img_dst = randomImage(20, 80, 1, 0);
+    p2b::Bitmap dst = p2b::toBitmap(&img_dst, 2, {10, 20, 30});
+    const long dst_rows = dst.getRows();
+    const long dst_cols = dst.getCols();
+    dst.clearDirtyRects();
+    const uint64_t generation = dst.getWriteGeneration();
+    CHECK(p2b::bitmapMax(a, b, &dst) == 0, "max into an existing dst failed");
+    CHECK(dst.getRows() == dst_rows && dst.getCols() == dst_cols, "an existing dst of the same geometry was reallocated");
+    CHECK(dst.getThresholds() == a.getThresholds(), "dst kept its own thresholds");
+    CHECK(dst.getLumaWeights().b == p2b::LUMA_BT709.b && dst.getLumaWeights().g == p2b::LUMA_BT709.g, "dst kept its own luma weights");
+    CHECK(dst.getWidth() == 77, "dst kept its own width");
+
+    vector<p2b::DirtyRect> written;
+    const bool complete = dst.getWritesSince(generation, &written);
+    CHECK(complete && !written.empty() && !dst.getDirtyRects().empty(), "the result was not reported as written");
+    long covered_bytes = 0;
+    for (const p2b::DirtyRect& rect : written) covered_bytes += rect.height*rect.width;
+    CHECK(covered_bytes >= dst_rows*dst_cols, "the write log doesn't cover the whole result");
+
+    cv::Mat img_c = randomImage(21, 77, 1, 0);
+    const p2b::Bitmap c = p2b::toBitmap(&img_c, 2, testThresholds(2));
+    CHECK(p2b::bitmapMin(a, c, &dst) == 1, "min accepted operands of different rows");
+}
+
+
+
+int main(){
+
+    testAlgebra();
+    testExistingDst();
+
+    return report("test_algebra");
+
+}
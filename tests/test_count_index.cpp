@@ -0,0 +1,151 @@
+#include "test_utils.hpp"
+
+#include "algebra.hpp"
+#include "core.hpp"
+#include "delta.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    The count index against brute force counts of the decoded pixels, on bitmaps spanning several
+    tiles, after every kind of write and after copies. Each write is checked on random rectangles,
+    on rectangles ending on tile borders and on the whole bitmap
+*/
+
+
+
+static void checkCounts(const p2b::Bitmap& bitmap, const vector<uint8_t>& levels, const char* what){
+    const uint8_t pixel_size = bitmap.getPixelSize();
+    const long rows = bitmap.getRows();
+    const long n_pixels = bitmap.getCols()*(8/pixel_size);
+
+    for (int k=0; k<40; ++k){
+        long row = rng() % rows;
+        long col = rng() % n_pixels;
+        long height = 1 + rng() % (rows - row);
+        long width = 1 + rng() % (n_pixels - col);
+        if (k == 0){
+            row = 0;
+            col = 0;
+            height = rows;
+            width = n_pixels;
+        }
+        else if (k < 5){
+            //? Rectangles starting or ending next to a tile border
+            row = min(rows - 1, max(0L, (long) (rng() % 3)*p2b::COUNT_TILE + (k % 2) - 1));
+            col = min(n_pixels - 1, max(0L, (long) (rng() % 3)*p2b::COUNT_TILE + (k / 2) - 1));
+            height = min(rows - row, p2b::COUNT_TILE + (long) (k % 3) - 1);
+            width = min(n_pixels - col, p2b::COUNT_TILE + (long) (k % 3) - 1);
+        }
+        const uint8_t level = levels[k % levels.size()];
+
+        long expected = 0;
+        for (long i=row; i<row+height; ++i){
+            for (long p=col; p<col+width; ++p) expected += getPixel(bitmap, i, p) == level;
+        }
+        const long count = bitmap.countInRect(level, row, col, height, width);
+        if (count != expected){
+            CHECK(false, "%s: pixel_size %d, %ld instead of %ld pixels at level %d in (%ld, %ld, %ld, %ld)",
+                what, pixel_size, count, expected, level, row, col, height, width);
+            return;
+        }
+    }
+}
+
+
+
+static void testWriters(uint8_t pixel_size){
+    const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+    const uint8_t reserved = (uint8_t) ((1 << pixel_size) - 1);
+    const int ppb = 8/pixel_size;
+    vector<uint8_t> levels;
+    for (int value=0; value<=reserved; ++value) levels.push_back((uint8_t) value);
+
+    cv::Mat start_img = randomImage(150 + rng() % 200, 100 + rng() % 400, 1, 0);
+    p2b::Bitmap bitmap = p2b::toBitmap(&start_img, pixel_size, thresholds_v);
+    CHECK(bitmap.enableCountIndex(levels) == 0 && bitmap.hasCountIndex(), "pixel_size %d, enableCountIndex failed", pixel_size);
+    checkCounts(bitmap, levels, "build");
+
+    for (int k=0; k<6; ++k){
+        cv::Mat update_img = randomImage(1 + rng() % 100, 1 + rng() % 150, (k % 2 == 0) ? 1 : 3, 1);
+        bitmap.updateRegionFromImage(&update_img, rng() % (bitmap.getRows() - update_img.rows + 1), rng() % (bitmap.getCols()*ppb - update_img.cols + 1));
+        checkCounts(bitmap, levels, "updateRegionFromImage");
+    }
+
+    for (int direction=0; direction<4; ++direction){
+        cv::Mat add_img = randomImage(50 + rng() % 200, 50 + rng() % 300, 1, 0);
+        bitmap.addImage(&add_img, direction, rng() % 2);
+        checkCounts(bitmap, levels, "addImage");
+    }
+
+    cv::Mat full_img = randomImage(bitmap.getRows(), bitmap.getCols()*ppb, 1, 0);
+    bitmap.updateFromImage_incremental(&full_img);
+    checkCounts(bitmap, levels, "updateFromImage_incremental");
+    for (int k=0; k<30; ++k) full_img.ptr<uint8_t>(rng() % full_img.rows)[rng() % full_img.cols] ^= 0x80;
+    bitmap.updateFromImage_incremental(&full_img);
+    checkCounts(bitmap, levels, "updateFromImage_incremental");
+
+    cv::Mat other_img = randomImage(bitmap.getRows(), bitmap.getCols()*ppb, 1, 0);
+    const p2b::Bitmap other = p2b::toBitmap(&other_img, pixel_size, thresholds_v);
+    if (pixel_size == 1) p2b::bitmapXor(bitmap, other, &bitmap);
+    else p2b::bitmapMax(bitmap, other, &bitmap);
+    checkCounts(bitmap, levels, "algebra");
+
+    p2b::Bitmap next = bitmap;
+    cv::Mat update_img = randomImage(20, 40, 1, 0);
+    next.updateRegionFromImage(&update_img, 5, 7);
+    p2b::BitmapDelta delta;
+    p2b::computeDelta(bitmap, next, &delta);
+    p2b::applyDelta(&bitmap, delta);
+    checkCounts(bitmap, levels, "applyDelta");
+
+    cv::Mat view = bitmap.getMatView();
+    for (long i=3; i<3+p2b::COUNT_TILE; ++i){
+        for (long j=1; j<1+bitmap.getCols()/2; ++j) view.ptr<uint8_t>(i)[j] = (uint8_t) rng();
+    }
+    bitmap.markWritten(3, 1, p2b::COUNT_TILE, bitmap.getCols()/2);
+    checkCounts(bitmap, levels, "getMatView and markWritten");
+
+    const p2b::Bitmap copy = bitmap;
+    checkCounts(copy, levels, "copy");
+}
+
+
+
+static void testArguments(){
+    cv::Mat img = randomImage(40, 90, 1, 0);
+    p2b::Bitmap bitmap = p2b::toBitmap(&img, 2, testThresholds(2));
+
+    CHECK(bitmap.countInRect(0, 0, 0, 1, 1) == -1, "countInRect answered without an index");
+    CHECK(bitmap.enableCountIndex({}) == 1, "enableCountIndex accepted no levels");
+    CHECK(bitmap.enableCountIndex({4}) == 1, "enableCountIndex accepted a level above pixel_values");
+    CHECK(bitmap.enableCountIndex({3}) == 0, "enableCountIndex failed");
+    checkCounts(bitmap, {3}, "single level");
+    CHECK(bitmap.countInRect(0, 0, 0, 1, 1) == -1, "countInRect answered for a level that is not indexed");
+    CHECK(bitmap.countInRect(3, 0, 0, 0, 1) == -1, "countInRect accepted an empty rectangle");
+    CHECK(bitmap.countInRect(3, 0, 89, 1, 4) == -1, "countInRect accepted a rectangle past the last pixel");
+    CHECK(bitmap.countInRect(3, 39, 0, 2, 1) == -1, "countInRect accepted a rectangle past the last row");
+
+    bitmap.disableCountIndex();
+    CHECK(!bitmap.hasCountIndex() && bitmap.getCountIndexBytes() == 0, "disableCountIndex kept the tables");
+}
+
+
+
+int main(){
+
+    for (uint8_t pixel_size : {1, 2, 4}) testWriters(pixel_size);
+    testArguments();
+
+    return report("test_count_index");
+
+}
@@ -0,0 +1,118 @@
+#include "test_utils.hpp"
+
+#include "core.hpp"
+#include "delta.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    Deltas between a bitmap and a copy of it changed in a few scattered regions: applying the delta
+    must rebuild the copy and report the changed rows as written, and the changed pixel counts
+    must match a pixel by pixel comparison
+*/
+
+
+
+static long referenceChangedPixels(const p2b::Bitmap& a, const p2b::Bitmap& b){
+    long changed = 0;
+    for (long i=0; i<a.getRows(); ++i){
+        for (long p=0; p<a.getCols()*(8/a.getPixelSize()); ++p) changed += getPixel(a, i, p) != getPixel(b, i, p);
+    }
+    return changed;
+}
+
+static bool covered(const vector<p2b::DirtyRect>& rects, long row, long col){
+    for (const p2b::DirtyRect& rect : rects){
+        if (row >= rect.row && row < rect.row + rect.height && col >= rect.col && col < rect.col + rect.width) return true;
+    }
+    return false;
+}
+
+
+
+static void testDelta(uint8_t pixel_size, int n_updates){
+    const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+    const int ppb = 8/pixel_size;
+
+    cv::Mat base_img = randomImage(40 + rng() % 40, 30 + rng() % 300, 1, 0);
+    const p2b::Bitmap base = p2b::toBitmap(&base_img, pixel_size, thresholds_v);
+    p2b::Bitmap next = base;
+    for (int k=0; k<n_updates; ++k){
+        cv::Mat update_img = randomImage(1 + rng() % 5, 1 + rng() % 30, 1, 0);
+        next.updateRegionFromImage(&update_img, rng() % (next.getRows() - update_img.rows + 1), rng() % (next.getCols()*ppb - update_img.cols + 1));
+    }
+
+    p2b::BitmapDelta delta;
+    CHECK(p2b::computeDelta(base, next, &delta) == 0, "computeDelta failed");
+
+    //? Runs are in order, disjoint, separated by at least DELTA_MAX_GAP bytes and hold their XOR bytes back to back
+    size_t n_bytes = 0;
+    for (size_t k=0; k<delta.runs.size(); ++k){
+        const p2b::DeltaRun& run = delta.runs[k];
+        n_bytes += run.length;
+        CHECK(run.length > 0 && run.col >= 0 && run.col + run.length <= base.getCols(), "pixel_size %d, run %zu out of the row", pixel_size, k);
+        if (k > 0 && delta.runs[k-1].row == run.row){
+            CHECK(run.col - (delta.runs[k-1].col + delta.runs[k-1].length) >= p2b::DELTA_MAX_GAP, "pixel_size %d, runs %zu and %zu were not merged", pixel_size, k-1, k);
+        }
+    }
+    CHECK(n_bytes == delta.xor_bytes.size(), "pixel_size %d, the runs hold %zu bytes but the delta %zu", pixel_size, n_bytes, delta.xor_bytes.size());
+    if (n_updates == 0) CHECK(delta.runs.empty(), "pixel_size %d, a delta between equal bitmaps has runs", pixel_size);
+
+    const long expected = referenceChangedPixels(base, next);
+    CHECK(p2b::countChangedPixels(base, next) == expected, "pixel_size %d, countChangedPixels of the bitmaps is wrong", pixel_size);
+    CHECK(p2b::countChangedPixels(delta) == expected, "pixel_size %d, countChangedPixels of the delta is wrong", pixel_size);
+
+    p2b::Bitmap applied = base;
+    applied.clearDirtyRects();
+    const uint64_t generation = applied.getWriteGeneration();
+    CHECK(p2b::applyDelta(&applied, delta) == 0, "applyDelta failed");
+    CHECK(sameBytes(applied, next), "pixel_size %d, applyDelta didn't rebuild the next bitmap", pixel_size);
+
+    vector<p2b::DirtyRect> written;
+    CHECK(applied.getWritesSince(generation, &written), "pixel_size %d, applyDelta restarted the write log", pixel_size);
+    bool ok = true;
+    for (long i=0; i<base.getRows() && ok; ++i){
+        for (long j=0; j<base.getCols() && ok; ++j){
+            if (base.getRow(i)[j] == next.getRow(i)[j]) continue;
+            ok = covered(applied.getDirtyRects(), i, j) && covered(written, i, j);
+        }
+    }
+    CHECK(ok, "pixel_size %d, applyDelta changed bytes outside of the reported regions", pixel_size);
+}
+
+
+
+static void testMismatch(){
+    cv::Mat img = randomImage(10, 40, 1, 0);
+    const p2b::Bitmap a = p2b::toBitmap(&img, 2, testThresholds(2));
+    const p2b::Bitmap b = p2b::toBitmap(&img, 4, testThresholds(4));
+    cv::Mat taller_img = randomImage(11, 40, 1, 0);
+    p2b::Bitmap c = p2b::toBitmap(&taller_img, 2, testThresholds(2));
+
+    p2b::BitmapDelta delta;
+    CHECK(p2b::computeDelta(a, b, &delta) == 1, "computeDelta accepted different pixel sizes");
+    CHECK(p2b::computeDelta(a, c, &delta) == 1, "computeDelta accepted different rows");
+    CHECK(p2b::countChangedPixels(a, c) == -1, "countChangedPixels accepted different rows");
+    CHECK(p2b::computeDelta(a, a, &delta) == 0 && p2b::applyDelta(&c, delta) == 1, "applyDelta accepted a delta of another geometry");
+}
+
+
+
+int main(){
+
+    for (uint8_t pixel_size : {1, 2, 4}){
+        for (int n_updates : {0, 1, 4, 20}) testDelta(pixel_size, n_updates);
+    }
+    testMismatch();
+
+    return report("test_delta");
+
+}
@@ -0,0 +1,175 @@
+#include "test_utils.hpp"
+
+#include "core.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    Every function writing a bitmap has to report what it wrote: the dirty regions and the write log
+    must cover every changed byte, and updateGrayscaleImage, which only re-renders the dirty regions,
+    must give the same image as a full rendering. Each writer runs on 1, 2 and 4 bit bitmaps
+*/
+
+
+
+struct Tracked{
+    p2b::Bitmap bitmap;
+    vector<vector<uint8_t>> snapshot;
+    uint64_t generation;
+    cv::Mat rendering;
+};
+
+
+
+static vector<vector<uint8_t>> takeSnapshot(const p2b::Bitmap& bitmap){
+    vector<vector<uint8_t>> snapshot(bitmap.getRows());
+    for (long i=0; i<bitmap.getRows(); ++i) snapshot[i].assign(bitmap.getRow(i).begin(), bitmap.getRow(i).end());
+    return snapshot;
+}
+
+static bool covered(const vector<p2b::DirtyRect>& rects, long row, long col){
+    for (const p2b::DirtyRect& rect : rects){
+        if (row >= rect.row && row < rect.row + rect.height && col >= rect.col && col < rect.col + rect.width) return true;
+    }
+    return false;
+}
+
+static vector<uint8_t> testPalette(uint8_t pixel_size){
+    vector<uint8_t> palette((1 << pixel_size) - 1);
+    for (size_t k=0; k<palette.size(); ++k) palette[k] = (uint8_t) (1 + k*254/palette.size());
+    return palette;
+}
+
+
+
+//? Starts tracking the bitmap from a clean state: no dirty regions, a fresh snapshot, generation and rendering
+static void startTracking(Tracked* t){
+    t->bitmap.clearDirtyRects();
+    t->snapshot = takeSnapshot(t->bitmap);
+    t->generation = t->bitmap.getWriteGeneration();
+    t->bitmap.toGrayscaleImage_linear(&t->rendering, testPalette(t->bitmap.getPixelSize()));
+}
+
+/*
+    Checks what the bitmap reports after a write, then starts tracking again.
+    When the geometry changed the old bytes moved, so only the restart of the write log is checked
+*/
+static void checkWrite(Tracked* t, const char* what){
+    p2b::Bitmap& bitmap = t->bitmap;
+    const uint8_t pixel_size = bitmap.getPixelSize();
+    vector<p2b::DirtyRect> written;
+    const bool complete = bitmap.getWritesSince(t->generation, &written);
+
+    if ((long) t->snapshot.size() == bitmap.getRows() && (t->snapshot.empty() || (long) t->snapshot[0].size() == bitmap.getCols())){
+        CHECK(complete, "%s: pixel_size %d, the write log lost a single write", what, pixel_size);
+        bool ok = true;
+        for (long i=0; i<bitmap.getRows() && ok; ++i){
+            for (long j=0; j<bitmap.getCols() && ok; ++j){
+                if (bitmap.getRow(i)[j] == t->snapshot[i][j]) continue;
+                ok = covered(bitmap.getDirtyRects(), i, j) && covered(written, i, j);
+                CHECK(ok, "%s: pixel_size %d, byte (%ld, %ld) changed outside of the reported regions", what, pixel_size, i, j);
+            }
+        }
+
+        cv::Mat full;
+        bitmap.toGrayscaleImage_linear(&full, testPalette(pixel_size));
+        bitmap.updateGrayscaleImage(&t->rendering, testPalette(pixel_size));
+        ok = true;
+        for (int i=0; i<full.rows && ok; ++i){
+            for (int j=0; j<full.cols && ok; ++j) ok = full.ptr<uint8_t>(i)[j] == t->rendering.ptr<uint8_t>(i)[j];
+        }
+        CHECK(ok, "%s: pixel_size %d, updateGrayscaleImage differs from a full rendering", what, pixel_size);
+    }
+    else CHECK(!complete, "%s: pixel_size %d, the geometry changed but the write log was kept", what, pixel_size);
+
+    startTracking(t);
+}
+
+
+
+static void testWriters(uint8_t pixel_size){
+    const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+    const int ppb = 8/pixel_size;
+
+    cv::Mat start_img = randomImage(61, 203, 1, 0);
+    Tracked t = { p2b::toBitmap(&start_img, pixel_size, thresholds_v), {}, 0, cv::Mat() };
+    startTracking(&t);
+
+    for (int k=0; k<10; ++k){
+        cv::Mat update_img = randomImage(1 + rng() % 20, 1 + rng() % 50, (k % 2 == 0) ? 1 : 3, 1);
+        const long row = rng() % (t.bitmap.getRows() - update_img.rows + 1);
+        const long col = rng() % (t.bitmap.getCols()*ppb - update_img.cols + 1);
+        CHECK(t.bitmap.updateRegionFromImage(&update_img, row, col) == 0, "updateRegionFromImage failed");
+        checkWrite(&t, "updateRegionFromImage");
+    }
+
+    for (int k=0; k<8; ++k){
+        cv::Mat add_img = randomImage(10 + rng() % 30, 10 + rng() % 60, 1, 0);
+        CHECK(t.bitmap.addImage(&add_img, k % 4, k >= 4) == 0, "addImage failed");
+        checkWrite(&t, "addImage");
+    }
+
+    cv::Mat full_img = randomImage(t.bitmap.getRows(), t.bitmap.getCols()*ppb, 1, 0);
+    CHECK(t.bitmap.updateFromImage_incremental(&full_img) == 0, "updateFromImage_incremental failed");
+    checkWrite(&t, "updateFromImage_incremental");
+    for (int k=0; k<40; ++k) full_img.ptr<uint8_t>(rng() % full_img.rows)[rng() % full_img.cols] ^= 0x80;
+    CHECK(t.bitmap.updateFromImage_incremental(&full_img) == 0, "updateFromImage_incremental failed");
+    checkWrite(&t, "updateFromImage_incremental");
+
+    //? Writes through the view, reported with markWritten
+    for (int k=0; k<5; ++k){
+        cv::Mat view = t.bitmap.getMatView();
+        const long row = rng() % t.bitmap.getRows();
+        const long col = rng() % t.bitmap.getCols();
+        const long height = 1 + rng() % (t.bitmap.getRows() - row);
+        const long width = 1 + rng() % (t.bitmap.getCols() - col);
+        for (long i=row; i<row+height; ++i){
+            for (long j=col; j<col+width; ++j) view.ptr<uint8_t>(i)[j] = (uint8_t) rng();
+        }
+        CHECK(t.bitmap.markWritten(row, col, height, width) == 0, "markWritten failed");
+        checkWrite(&t, "getMatView and markWritten");
+    }
+
+    const long rows = t.bitmap.getRows();
+    const long cols = t.bitmap.getCols();
+    CHECK(t.bitmap.markWritten(0, 0, 0, 1) == 1, "markWritten accepted an empty region");
+    CHECK(t.bitmap.markWritten(-1, 0, 1, 1) == 1, "markWritten accepted a negative row");
+    CHECK(t.bitmap.markWritten(rows-1, 0, 2, 1) == 1, "markWritten accepted a region past the last row");
+    CHECK(t.bitmap.markWritten(0, cols-1, 1, 2) == 1, "markWritten accepted a region past the last byte");
+    CHECK(t.bitmap.getWriteGeneration() == t.generation, "a rejected markWritten was recorded");
+}
+
+
+
+static void testReadOnlyView(){
+    cv::Mat img = randomImage(13, 29, 1, 0);
+    const p2b::Bitmap bitmap = p2b::toBitmap(&img, 2, testThresholds(2));
+    const string path = "test_dirty_tracking.p2b";
+    CHECK(bitmap.save(path) == 0, "save failed");
+
+    p2b::Bitmap loaded;
+    CHECK(loaded.load(path) == 0, "load failed");
+    CHECK(loaded.isReadOnly(), "a loaded bitmap is not read-only");
+    CHECK(loaded.getMatView().empty(), "a read-only bitmap gave a writable view");
+    remove(path.c_str());
+}
+
+
+
+int main(){
+
+    for (uint8_t pixel_size : {1, 2, 4}) testWriters(pixel_size);
+    testReadOnlyView();
+
+    return report("test_dirty_tracking");
+
+}
@@ -0,0 +1,126 @@
+#include "test_utils.hpp"
+
+#include "core.hpp"
+#include "format.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    .p2b files saved and loaded back, then headers corrupted one field at a time: validateHeader must
+    reject every one of them, in particular sizes chosen so that the products and sums of the header
+    wrap around to values that would pass a check done with them
+*/
+
+
+
+static p2b::FileHeader readHeader(const string& path){
+    p2b::FileHeader header;
+    ifstream file(path, ios::binary);
+    file.read((char*) &header, sizeof(header));
+    return header;
+}
+
+
+
+static void testRoundTrip(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        cv::Mat img = randomImage(37, 101, 1, 0);
+        p2b::Bitmap bitmap = p2b::toBitmap(&img, pixel_size, testThresholds(pixel_size));
+        cv::Mat add_img = randomImage(20, 30, 1, 0);
+        bitmap.addImage(&add_img, 1, false);
+        const string path = "test_format.p2b";
+        CHECK(bitmap.save(path) == 0, "save failed");
+
+        p2b::Bitmap loaded;
+        CHECK(loaded.load(path) == 0, "pixel_size %d, load failed", pixel_size);
+        CHECK(sameBytes(loaded, bitmap) && loaded.getWidth() == bitmap.getWidth() && loaded.getThresholds() == bitmap.getThresholds(),
+            "pixel_size %d, the loaded bitmap differs from the saved one", pixel_size);
+        remove(path.c_str());
+    }
+}
+
+
+
+static void testCorruptedHeaders(){
+    cv::Mat img = randomImage(40, 90, 1, 0);
+    const p2b::Bitmap bitmap = p2b::toBitmap(&img, 2, testThresholds(2));
+    const string path = "test_format.p2b";
+    bitmap.save(path);
+    const p2b::FileHeader good = readHeader(path);
+    ifstream file(path, ios::binary | ios::ate);
+    const size_t file_size = file.tellg();
+    file.close();
+    remove(path.c_str());
+
+    CHECK(p2b::validateHeader(good, file_size) == 0, "validateHeader rejected a saved header");
+    CHECK(p2b::validateHeader(good, file_size - 1) == 1, "validateHeader accepted a truncated payload");
+
+    p2b::FileHeader header = good;
+    header.thresholds[0] = 200;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted unsorted thresholds");
+
+    header = good;
+    header.payload_offset = 0;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted a payload over the header");
+
+    header = good;
+    header.payload_offset = file_size + p2b::P2B_PAYLOAD_ALIGNMENT;
+    header.payload_size = 0;
+    header.rows = 0;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted a payload_offset past the end of the file");
+
+    //? payload_offset + payload_size wraps around to a size smaller than the file
+    header = good;
+    header.payload_offset = UINT64_MAX - p2b::P2B_PAYLOAD_ALIGNMENT + 1;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted a payload_offset wrapping around");
+
+    //? rows*stride wraps around to the size of the real payload
+    header = good;
+    header.stride = (int64_t) 1 << 32;
+    header.rows = ((int64_t) 1 << 32) + good.rows*good.stride/(int64_t) header.stride;
+    header.payload_size = (uint64_t) header.rows * header.stride;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted rows*stride wrapping around");
+
+    header = good;
+    header.rows = INT64_MAX;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted more rows than the file holds");
+
+    //? With no rows the payload doesn't bound cols, cols*(8/pixel_size) must still fit
+    header = good;
+    header.rows = 0;
+    header.payload_size = 0;
+    header.cols = INT64_MAX/2;
+    header.stride = INT64_MAX/2 - (INT64_MAX/2) % p2b::ROW_PADDING + p2b::ROW_PADDING;
+    header.width = 0;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted cols overflowing in pixels");
+
+    header = good;
+    header.width = good.cols*4 + 1;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted a width past the last byte");
+    header.width = (good.cols - 1)*4;
+    CHECK(p2b::validateHeader(header, file_size) == 1, "validateHeader accepted a width leaving the last byte empty");
+    header.width = (good.cols - 1)*4 + 1;
+    CHECK(p2b::validateHeader(header, file_size) == 0, "validateHeader rejected a width ending in the first pixel of the last byte");
+}
+
+
+
+int main(){
+
+    testRoundTrip();
+    testCorruptedHeaders();
+
+    return report("test_format");
+
+}
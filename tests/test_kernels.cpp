@@ -0,0 +1,171 @@
+#include "test_utils.hpp"
+
+#include "core.hpp"
+#include "kernels.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    Runs every dispatched kernel at every instruction set the CPU supports and checks its output
+    against a pixel by pixel reference and against the output of the scalar path:
+    encoding of grayscale, BGR and BGRA rows of every width from 1 to 100 at unaligned offsets,
+    region updates starting anywhere inside a byte and decoding
+*/
+
+
+
+const int MAX_WIDTH = 100;
+const int TEST_ROWS = 3;
+const vector<p2b::SimdLevel> SIMD_LEVELS = { p2b::SIMD_SCALAR, p2b::SIMD_SSE41, p2b::SIMD_AVX2 };
+
+
+
+//? Checks every pixel of a bitmap converted from img, and that the pixels padding the last byte are reserved
+static void checkEncoded(const p2b::Bitmap& bitmap, const cv::Mat& img, const char* what){
+    const uint8_t pixel_size = bitmap.getPixelSize();
+    const int reserved = (1 << pixel_size) - 1;
+    const int channels = img.channels();
+    const long n_pixels = bitmap.getCols()*(8/pixel_size);
+    CHECK(bitmap.getRows() == img.rows && bitmap.getWidth() == img.cols, "%s: geometry", what);
+    if (bitmap.getRows() != img.rows || bitmap.getWidth() != img.cols) return;
+
+    for (long i=0; i<img.rows; ++i){
+        for (long p=0; p<n_pixels; ++p){
+            const int expected = (p < img.cols)
+                ? referenceLevel(referenceGray(img.ptr<uint8_t>(i) + p*channels, channels, bitmap.getLumaWeights()), bitmap.getThresholds())
+                : reserved;
+            if (getPixel(bitmap, i, p) != expected){
+                CHECK(false, "%s: pixel_size %d, %d channels, width %d, pixel (%ld, %ld) is %d instead of %d",
+                    what, pixel_size, channels, img.cols, i, p, getPixel(bitmap, i, p), expected);
+                return;
+            }
+        }
+    }
+}
+
+
+
+static void testEncode(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+        for (int channels : {1, 3, 4}){
+            for (int width=1; width<=MAX_WIDTH; ++width){
+                cv::Mat img = randomImage(TEST_ROWS, width, channels, 1 + 2*(width % 3));
+
+                p2b::setSimdLevel(p2b::SIMD_SCALAR);
+                const p2b::Bitmap scalar = p2b::toBitmap(&img, pixel_size, thresholds_v, false);
+                checkEncoded(scalar, img, "scalar encode");
+
+                for (p2b::SimdLevel level : SIMD_LEVELS){
+                    if (p2b::setSimdLevel(level) != level) continue;
+                    for (bool parallel : {false, true}){
+                        const p2b::Bitmap bitmap = p2b::toBitmap(&img, pixel_size, thresholds_v, parallel);
+                        CHECK(sameBytes(bitmap, scalar), "encode at simd level %d: pixel_size %d, %d channels, width %d differs from scalar",
+                            (int) level, pixel_size, channels, width);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+
+/*
+    Regions starting at every position inside a byte: the pixels of the region take the new values,
+    the pixels sharing their first and last bytes keep the old ones
+*/
+static void testRegionUpdate(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+        const int ppb = 8/pixel_size;
+        for (int channels : {1, 3, 4}){
+            for (int width=1; width<=MAX_WIDTH; ++width){
+                const int start_col = width % (2*ppb);
+                cv::Mat base_img = randomImage(TEST_ROWS+2, start_col + width + ppb, 1, 0);
+                cv::Mat update_img = randomImage(TEST_ROWS, width, channels, 3);
+                const p2b::Bitmap base = p2b::toBitmap(&base_img, pixel_size, thresholds_v, false);
+
+                p2b::setSimdLevel(p2b::SIMD_SCALAR);
+                p2b::Bitmap scalar = base;
+                scalar.updateRegionFromImage(&update_img, 1, start_col);
+
+                bool ok = true;
+                for (long i=0; i<base.getRows() && ok; ++i){
+                    for (long p=0; p<base.getCols()*ppb && ok; ++p){
+                        const bool inside = i >= 1 && i < 1 + TEST_ROWS && p >= start_col && p < start_col + width;
+                        const int expected = inside
+                            ? referenceLevel(referenceGray(update_img.ptr<uint8_t>(i-1) + (p-start_col)*channels, channels, base.getLumaWeights()), thresholds_v)
+                            : getPixel(base, i, p);
+                        ok = getPixel(scalar, i, p) == expected;
+                    }
+                }
+                CHECK(ok, "region update: pixel_size %d, %d channels, width %d at column %d", pixel_size, channels, width, start_col);
+
+                for (p2b::SimdLevel level : SIMD_LEVELS){
+                    if (p2b::setSimdLevel(level) != level) continue;
+                    p2b::Bitmap bitmap = base;
+                    bitmap.updateRegionFromImage(&update_img, 1, start_col);
+                    CHECK(sameBytes(bitmap, scalar), "region update at simd level %d: pixel_size %d, %d channels, width %d at column %d differs from scalar",
+                        (int) level, pixel_size, channels, width, start_col);
+                }
+            }
+        }
+    }
+}
+
+
+
+static void testDecode(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+        const int reserved = (1 << pixel_size) - 1;
+        vector<uint8_t> palette(reserved);
+        for (uint8_t& value : palette) value = (uint8_t) (1 + rng() % 255);
+
+        for (int width=1; width<=MAX_WIDTH; ++width){
+            cv::Mat img = randomImage(TEST_ROWS, width, 1, width % 2);
+            p2b::Bitmap bitmap = p2b::toBitmap(&img, pixel_size, thresholds_v);
+
+            for (p2b::SimdLevel level : SIMD_LEVELS){
+                if (p2b::setSimdLevel(level) != level) continue;
+                for (bool parallel : {false, true}){
+                    cv::Mat decoded;
+                    if (parallel) bitmap.toGrayscaleImage_parallel(&decoded, palette);
+                    else bitmap.toGrayscaleImage_linear(&decoded, palette);
+
+                    bool ok = decoded.rows == bitmap.getRows() && decoded.cols == bitmap.getCols()*(8/pixel_size);
+                    for (long i=0; i<decoded.rows && ok; ++i){
+                        for (long p=0; p<decoded.cols && ok; ++p){
+                            const int value = getPixel(bitmap, i, p);
+                            ok = decoded.ptr<uint8_t>(i)[p] == ((value == reserved) ? 0 : palette[value]);
+                        }
+                    }
+                    CHECK(ok, "decode at simd level %d: pixel_size %d, width %d, %s", (int) level, pixel_size, width, parallel ? "parallel" : "linear");
+                }
+            }
+        }
+    }
+}
+
+
+
+int main(){
+
+    printf("test_kernels: highest simd level %d\n", (int) p2b::setSimdLevel(p2b::SIMD_AVX2));
+
+    testEncode();
+    testRegionUpdate();
+    testDecode();
+
+    return report("test_kernels");
+
+}
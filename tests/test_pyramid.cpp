@@ -0,0 +1,240 @@
+#include "test_utils.hpp"
+
+#include "algebra.hpp"
+#include "core.hpp"
+#include "pyramid.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    downsample and BitmapPyramid against a block by block reference over the pixels inside the width.
+    Besides the bytes, the result must have the width, thresholds and luma weights the reduction gives it
+    and report what it wrote, so that count indexes and pyramids built on top of it stay up to date
+*/
+
+
+
+const int MAX_WIDTH = 100;
+const int PYRAMID_LEVELS = 3;
+
+
+
+//? Reference reduction of a bitmap, block by block over the pixels inside its width
+static p2b::Bitmap referenceDownsample(const p2b::Bitmap& src, int factor, int mode){
+    const int pixel_size = src.getPixelSize();
+    const int ppb = 8/pixel_size;
+    const int reserved = (1 << pixel_size) - 1;
+    const long src_pixels = src.getWidth();
+    const long dst_rows = (src.getRows() + factor - 1)/factor;
+    const long dst_pixels = (src_pixels + factor - 1)/factor;
+    const long dst_cols = (dst_pixels + ppb - 1)/ppb;
+
+    p2b::Bitmap dst(dst_rows, dst_cols, pixel_size, src.getThresholds());
+    dst.setWidth(dst_pixels);
+    cv::Mat view = dst.getMatView();
+    for (long i=0; i<dst_rows; ++i){
+        for (long p=0; p<dst_cols*ppb; ++p){
+            int value = reserved;
+            if (p < dst_pixels){
+                long counts[16] = {0};
+                for (long r=i*factor; r<min((i+1)*factor, src.getRows()); ++r){
+                    for (long q=p*factor; q<min((p+1)*factor, src_pixels); ++q) ++counts[getPixel(src, r, q)];
+                }
+                if (pixel_size == 1){
+                    value = (mode == p2b::REDUCE_MAX) ? (counts[1] > 0) : (counts[1] >= counts[0]);
+                }
+                else {
+                    long best = 0;
+                    for (int l=0; l<reserved; ++l){
+                        if (counts[l] == 0) continue;
+                        if (mode == p2b::REDUCE_MAX || counts[l] >= best){
+                            best = counts[l];
+                            value = l;
+                        }
+                    }
+                }
+            }
+            setPixel(view.ptr<uint8_t>(i), pixel_size, p, value);
+        }
+    }
+    return dst;
+}
+
+//? Bitmap with regions without information, left by addImage around the images it adds
+static p2b::Bitmap testBitmap(uint8_t pixel_size, int rows, int width){
+    cv::Mat img = randomImage(rows, width, 1, 0);
+    p2b::Bitmap bitmap = p2b::toBitmap(&img, pixel_size, testThresholds(pixel_size), true, p2b::LUMA_BT709);
+    cv::Mat add_img = randomImage(max(1, rows/2), max(1, width/3), 1, 0);
+    bitmap.addImage(&add_img, rng() % 4, false);
+    return bitmap;
+}
+
+
+
+static void testDownsample(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        for (int width=1; width<=MAX_WIDTH; width+=3){
+            const p2b::Bitmap bitmap = testBitmap(pixel_size, 3 + width % 9, width);
+            for (int factor : {2, 4}){
+                for (int mode : {p2b::REDUCE_MAX, p2b::REDUCE_MAJORITY}){
+                    const p2b::Bitmap expected = referenceDownsample(bitmap, factor, mode);
+                    p2b::Bitmap reduced;
+                    CHECK(p2b::downsample(bitmap, factor, mode, &reduced) == 0, "downsample failed");
+                    CHECK(sameBytes(reduced, expected), "downsample: pixel_size %d, width %ld, factor %d, mode %d",
+                        pixel_size, bitmap.getWidth(), factor, mode);
+                    CHECK(reduced.getWidth() == expected.getWidth(), "downsample: pixel_size %d, width %ld gave width %ld instead of %ld",
+                        pixel_size, bitmap.getWidth(), reduced.getWidth(), expected.getWidth());
+                    CHECK(reduced.getThresholds() == bitmap.getThresholds() && reduced.getLumaWeights().g == p2b::LUMA_BT709.g,
+                        "downsample: pixel_size %d, dst didn't take the thresholds and luma weights of src", pixel_size);
+
+                    //? The padding of a reduced mask must survive the algebra, which relies on the width
+                    if (pixel_size == 1){
+                        p2b::Bitmap inverted;
+                        p2b::bitmapNot(reduced, &inverted);
+                        bool ok = true;
+                        for (long i=0; i<inverted.getRows() && ok; ++i){
+                            for (long p=reduced.getWidth(); p<reduced.getCols()*8 && ok; ++p) ok = getPixel(inverted, i, p) == 1;
+                        }
+                        CHECK(ok, "not of a reduced mask of width %ld cleared its padding", reduced.getWidth());
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+
+/*
+    A dst of the right geometry is written in place: it takes the format of src, reports the whole
+    result as written and its count index follows
+*/
+static void testExistingDst(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const p2b::Bitmap bitmap = testBitmap(pixel_size, 300, 517);
+        const uint8_t reserved = (uint8_t) ((1 << pixel_size) - 1);
+
+        p2b::Bitmap reduced;
+        p2b::downsample(bitmap, 2, p2b::REDUCE_MAJORITY, &reduced);
+        vector<uint8_t> other_thresholds = testThresholds(pixel_size);
+        other_thresholds[0] = 1;
+        reduced.setThresholds(other_thresholds);
+        reduced.setLumaWeights(p2b::LUMA_BT601);
+        reduced.enableCountIndex({0, reserved});
+        reduced.clearDirtyRects();
+        const uint64_t generation = reduced.getWriteGeneration();
+        const long rows = reduced.getRows();
+        const long cols = reduced.getCols();
+
+        CHECK(p2b::downsample(bitmap, 2, p2b::REDUCE_MAX, &reduced) == 0, "downsample into an existing dst failed");
+        CHECK(reduced.getRows() == rows && reduced.getCols() == cols, "an existing dst of the right geometry was reallocated");
+        CHECK(sameBytes(reduced, referenceDownsample(bitmap, 2, p2b::REDUCE_MAX)), "pixel_size %d, downsample into an existing dst", pixel_size);
+        CHECK(reduced.getThresholds() == bitmap.getThresholds(), "pixel_size %d, an existing dst kept its own thresholds", pixel_size);
+        CHECK(reduced.getLumaWeights().g == p2b::LUMA_BT709.g, "pixel_size %d, an existing dst kept its own luma weights", pixel_size);
+
+        vector<p2b::DirtyRect> written;
+        const bool complete = reduced.getWritesSince(generation, &written);
+        long written_bytes = 0;
+        for (const p2b::DirtyRect& rect : written) written_bytes += rect.height*rect.width;
+        CHECK(complete && written_bytes >= rows*cols && !reduced.getDirtyRects().empty(),
+            "pixel_size %d, downsample didn't report what it wrote", pixel_size);
+
+        const long n_pixels = cols*(8/pixel_size);
+        for (uint8_t level : {(uint8_t) 0, reserved}){
+            long expected = 0;
+            for (long i=0; i<rows; ++i){
+                for (long p=0; p<n_pixels; ++p) expected += getPixel(reduced, i, p) == level;
+            }
+            CHECK(reduced.countInRect(level, 0, 0, rows, n_pixels) == expected, "pixel_size %d, the count index of dst is stale", pixel_size);
+        }
+    }
+}
+
+
+
+//? Every level of a pyramid against the reference applied level after level
+static void checkPyramid(p2b::BitmapPyramid* pyramid, const p2b::Bitmap& base, int factor, int mode, const char* what){
+    p2b::Bitmap expected = base;
+    for (int level=1; level<=PYRAMID_LEVELS; ++level){
+        expected = referenceDownsample(expected, factor, mode);
+        const p2b::Bitmap* cached = pyramid->getLevel(base, level);
+        CHECK(cached != nullptr && sameBytes(*cached, expected) && cached->getWidth() == expected.getWidth(),
+            "%s: pixel_size %d, factor %d, mode %d, level %d differs from the reference", what, base.getPixelSize(), factor, mode, level);
+    }
+}
+
+static void testPyramid(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const int ppb = 8/pixel_size;
+        for (int factor : {2, 4}){
+            for (int mode : {p2b::REDUCE_MAX, p2b::REDUCE_MAJORITY}){
+                p2b::Bitmap base = testBitmap(pixel_size, 50 + rng() % 100, 30 + rng() % 200);
+                p2b::BitmapPyramid pyramid(PYRAMID_LEVELS, factor, mode);
+                checkPyramid(&pyramid, base, factor, mode, "build");
+
+                //? A pyramid over the first level only sees its partial refreshes through its write log
+                p2b::BitmapPyramid upper(1, factor, mode);
+                upper.getLevel(*pyramid.getLevel(base, 1), 1);
+
+                for (int k=0; k<6; ++k){
+                    cv::Mat update_img = randomImage(1 + rng() % 30, 1 + rng() % 50, 1, 0);
+                    base.updateRegionFromImage(&update_img, rng() % (base.getRows() - update_img.rows + 1), rng() % (base.getCols()*ppb - update_img.cols + 1));
+                    if (k % 2 == 1) checkPyramid(&pyramid, base, factor, mode, "updateRegionFromImage");
+                }
+                checkPyramid(&pyramid, base, factor, mode, "updateRegionFromImage");
+                const p2b::Bitmap* level_1 = pyramid.getLevel(base, 1);
+                CHECK(sameBytes(*upper.getLevel(*level_1, 1), referenceDownsample(*level_1, factor, mode)),
+                    "pixel_size %d, factor %d, mode %d, a pyramid over a level missed its partial refreshes", pixel_size, factor, mode);
+
+                cv::Mat add_img = randomImage(30, 40, 1, 0);
+                base.addImage(&add_img, rng() % 4, rng() % 2);
+                checkPyramid(&pyramid, base, factor, mode, "addImage");
+
+                cv::Mat full_img = randomImage(base.getRows(), base.getCols()*ppb, 1, 0);
+                base.updateFromImage_incremental(&full_img);
+                checkPyramid(&pyramid, base, factor, mode, "updateFromImage_incremental");
+
+                cv::Mat view = base.getMatView();
+                for (long j=0; j<base.getCols(); ++j) view.ptr<uint8_t>(base.getRows()/2)[j] = (uint8_t) rng();
+                base.markWritten(base.getRows()/2, 0, 1, base.getCols());
+                checkPyramid(&pyramid, base, factor, mode, "getMatView and markWritten");
+            }
+        }
+    }
+}
+
+
+
+static void testArguments(){
+    const p2b::Bitmap bitmap = testBitmap(2, 20, 30);
+    p2b::Bitmap reduced;
+    CHECK(p2b::downsample(bitmap, 3, p2b::REDUCE_MAX, &reduced) == 1, "downsample accepted factor 3");
+    CHECK(p2b::downsample(bitmap, 2, 2, &reduced) == 1, "downsample accepted an unknown mode");
+    p2b::Bitmap self = bitmap;
+    CHECK(p2b::downsample(self, 2, p2b::REDUCE_MAX, &self) == 1, "downsample accepted dst == src");
+    p2b::BitmapPyramid pyramid(2);
+    CHECK(pyramid.getLevel(bitmap, 3) == nullptr && pyramid.getLevel(bitmap, -1) == nullptr, "getLevel accepted a level out of range");
+    CHECK(pyramid.getLevel(bitmap, 0) == &bitmap, "level 0 is not the base");
+}
+
+
+
+int main(){
+
+    testDownsample();
+    testExistingDst();
+    testPyramid();
+    testArguments();
+
+    return report("test_pyramid");
+
+}
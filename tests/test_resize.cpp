@@ -0,0 +1,110 @@
+#include "test_utils.hpp"
+
+#include "core.hpp"
+#include "threadpool.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    Growths of heap and file backed bitmaps with their rows copied and moved through parallelRows.
+    A sequence of addImage in every direction runs on an executor running the chunks in order, which gives
+    the reference, then on one running them in reverse order and on a thread pool: any chunk that moves rows
+    over sources another chunk has not moved yet gives different bytes
+*/
+
+
+
+//? Runs the items one after the other, first to last or last to first
+class OrderedExecutor : public p2b::Executor{
+
+    public:
+
+        OrderedExecutor(size_t concurrency, bool reverse) : concurrency(concurrency), reverse(reverse){}
+
+        size_t getConcurrency() const override{
+            return this->concurrency;
+        }
+
+        void parallelFor(long n, const function<void(long)>& fn) override{
+            for (long k=0; k<n; ++k) fn(this->reverse ? n - 1 - k : k);
+        }
+
+    private:
+
+        size_t concurrency;
+        bool reverse;
+
+};
+
+
+
+struct Step{
+    cv::Mat img;
+    int direction;
+    bool overlap;
+};
+
+
+
+//? The images are taken by value, copying only the cv::Mat headers
+static vector<p2b::Bitmap> runSteps(uint8_t pixel_size, cv::Mat start_img, vector<Step> steps, bool file_backed){
+    const string path = "test_resize.p2b";
+    p2b::Bitmap bitmap = p2b::toBitmap(&start_img, pixel_size, testThresholds(pixel_size));
+    if (file_backed) CHECK(bitmap.useFileStorage(path) == 0 && bitmap.isFileBacked(), "useFileStorage failed");
+
+    vector<p2b::Bitmap> states;
+    for (Step& step : steps){
+        CHECK(bitmap.addImage(&step.img, step.direction, step.overlap) == 0, "addImage failed");
+        states.push_back(bitmap);
+    }
+    remove(path.c_str());
+    return states;
+}
+
+
+
+static void testGrowth(uint8_t pixel_size){
+    const cv::Mat start_img = randomImage(150 + rng() % 100, 200 + rng() % 300, 1, 0);
+    vector<Step> steps;
+    for (int k=0; k<12; ++k) steps.push_back({randomImage(20 + rng() % 300, 20 + rng() % 500, 1, 0), k % 4, (k/4) % 2 == 1});
+
+    OrderedExecutor in_order(1, false);
+    p2b::setExecutor(&in_order);
+    const vector<p2b::Bitmap> expected = runSteps(pixel_size, start_img, steps, false);
+
+    OrderedExecutor reverse_order(8, true);
+    p2b::ThreadPool pool(4);
+    for (p2b::Executor* executor : {(p2b::Executor*) &reverse_order, (p2b::Executor*) &pool}){
+        p2b::setExecutor(executor);
+        for (bool file_backed : {false, true}){
+            const vector<p2b::Bitmap> states = runSteps(pixel_size, start_img, steps, file_backed);
+            for (size_t k=0; k<steps.size(); ++k){
+                if (sameBytes(states[k], expected[k])) continue;
+                CHECK(false, "pixel_size %d, %s, %s executor, step %zu differs from growing in order",
+                    pixel_size, file_backed ? "file backed" : "heap", (executor == &pool) ? "thread pool" : "reverse order", k);
+                break;
+            }
+        }
+    }
+    p2b::setExecutor(nullptr);
+}
+
+
+
+int main(){
+
+    for (uint8_t pixel_size : {1, 2, 4}) testGrowth(pixel_size);
+
+    return report("test_resize");
+
+}
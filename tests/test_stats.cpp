@@ -0,0 +1,110 @@
+#include "test_utils.hpp"
+
+#include "core.hpp"
+#include "kernels.hpp"
+#include "stats.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+using namespace p2b_test;
+using namespace std;
+
+// ----------------------------------------------------------------------
+
+/*
+    Statistics on packed bitmaps against counts of the decoded pixels, with and without
+    the popcount instruction
+*/
+
+
+
+const int MAX_WIDTH = 100;
+const int TEST_ROWS = 3;
+const vector<p2b::SimdLevel> SIMD_LEVELS = { p2b::SIMD_SCALAR, p2b::SIMD_SSE41, p2b::SIMD_AVX2 };
+
+
+
+//? Histograms and per row and per column counts, the padding pixels counting as without information
+static void testStats(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const vector<uint8_t> thresholds_v = testThresholds(pixel_size);
+        const int n_levels = 1 << pixel_size;
+        for (int width=1; width<=MAX_WIDTH; ++width){
+            cv::Mat img = randomImage(TEST_ROWS + width % 5, width, 3, 1);
+            const p2b::Bitmap bitmap = p2b::toBitmap(&img, pixel_size, thresholds_v);
+            const long n_pixels = bitmap.getCols()*(8/pixel_size);
+
+            vector<long> hist(n_levels, 0);
+            vector<vector<long>> row_counts(n_levels, vector<long>(bitmap.getRows(), 0));
+            vector<vector<long>> col_counts(n_levels, vector<long>(n_pixels, 0));
+            for (long i=0; i<bitmap.getRows(); ++i){
+                for (long p=0; p<n_pixels; ++p){
+                    const int value = getPixel(bitmap, i, p);
+                    ++hist[value];
+                    ++row_counts[value][i];
+                    ++col_counts[value][p];
+                }
+            }
+
+            for (p2b::SimdLevel level : SIMD_LEVELS){
+                if (p2b::setSimdLevel(level) != level) continue;
+                CHECK(p2b::levelHistogram(bitmap) == hist, "histogram at simd level %d: pixel_size %d, width %d", (int) level, pixel_size, width);
+                CHECK(p2b::countNoInformation(bitmap) == hist[n_levels-1], "no information count at simd level %d: pixel_size %d, width %d",
+                    (int) level, pixel_size, width);
+                for (int value=0; value<n_levels; ++value){
+                    vector<long> counts;
+                    p2b::rowLevelCounts(bitmap, (uint8_t) value, &counts);
+                    CHECK(counts == row_counts[value], "row counts at simd level %d: pixel_size %d, width %d, level %d", (int) level, pixel_size, width, value);
+                    p2b::colLevelCounts(bitmap, (uint8_t) value, &counts);
+                    CHECK(counts == col_counts[value], "column counts at simd level %d: pixel_size %d, width %d, level %d", (int) level, pixel_size, width, value);
+                }
+            }
+        }
+    }
+}
+
+
+
+static void testRegionHistogram(){
+    for (uint8_t pixel_size : {1, 2, 4}){
+        const int n_levels = 1 << pixel_size;
+        cv::Mat img = randomImage(37, 251, 1, 0);
+        const p2b::Bitmap bitmap = p2b::toBitmap(&img, pixel_size, testThresholds(pixel_size));
+        const long n_pixels = bitmap.getCols()*(8/pixel_size);
+
+        for (int k=0; k<50; ++k){
+            const long row = rng() % bitmap.getRows();
+            const long col = rng() % n_pixels;
+            const long height = 1 + rng() % (bitmap.getRows() - row);
+            const long width = 1 + rng() % (n_pixels - col);
+            vector<long> expected(n_levels, 0);
+            for (long i=row; i<row+height; ++i){
+                for (long p=col; p<col+width; ++p) ++expected[getPixel(bitmap, i, p)];
+            }
+            vector<long> hist;
+            CHECK(p2b::levelHistogram(bitmap, row, col, height, width, &hist) == 0 && hist == expected,
+                "region histogram: pixel_size %d, region (%ld, %ld, %ld, %ld)", pixel_size, row, col, height, width);
+        }
+
+        vector<long> hist;
+        CHECK(p2b::levelHistogram(bitmap, 0, 0, 0, 1, &hist) == 1, "region histogram accepted an empty region");
+        CHECK(p2b::levelHistogram(bitmap, 0, n_pixels-1, 1, 2, &hist) == 1, "region histogram accepted a region past the last pixel");
+        vector<long> counts;
+        CHECK(p2b::rowLevelCounts(bitmap, (uint8_t) n_levels, &counts) == 1, "row counts accepted a level above pixel_values");
+        CHECK(p2b::colLevelCounts(bitmap, (uint8_t) n_levels, &counts) == 1, "column counts accepted a level above pixel_values");
+    }
+}
+
+
+
+int main(){
+
+    testStats();
+    testRegionHistogram();
+
+    return report("test_stats");
+
+}
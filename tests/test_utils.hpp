@@ -0,0 +1,146 @@
+/*
+ *  Copyright (C) 2023 Simone Palmieri <github dot com/sudo-simon>
+ *  All rights reserved.
+ *
+ *  This file is part of a project released under the GNU GENERAL PUBLIC LICENSE Version 3.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *  *  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  *  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#pragma once
+
+#include "bitmap.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <opencv2/core.hpp>
+#include <random>
+#include <vector>
+
+
+// ----------------------------------------------------------------------
+
+/*
+    Helpers shared by the test executables: each test counts its failed checks
+    and main returns their number, so that ctest sees any of them as a failure
+*/
+
+
+
+//? Counts a failed check and prints where it happened and why
+#define CHECK(cond, ...) do{ \
+    if (!(cond)){ \
+        ++p2b_test::failures; \
+        if (p2b_test::failures <= p2b_test::MAX_REPORTED){ \
+            fprintf(stderr, "%s:%d: check failed: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+        } \
+    } \
+} while(0)
+
+
+
+namespace p2b_test{
+
+
+
+//? Only the first failures are printed, the later ones are just counted
+const int MAX_REPORTED = 20;
+
+inline int failures = 0;
+inline std::mt19937 rng(2023);
+
+
+
+//? Thresholds spread over the whole range, the last level (reserved) being reached by the brightest pixels
+inline std::vector<uint8_t> testThresholds(uint8_t pixel_size){
+    const int n_thresholds = (1 << pixel_size) - 1;
+    std::vector<uint8_t> thresholds_v(n_thresholds);
+    for (int k=0; k<n_thresholds; ++k) thresholds_v[k] = (uint8_t) ((k+1)*256/(n_thresholds+1));
+    return thresholds_v;
+}
+
+//? Value of a pixel read bit by bit, the first pixel of a byte being in its most significant bits
+inline int getPixel(const p2b::Bitmap& bitmap, long row, long px){
+    const int pixel_size = bitmap.getPixelSize();
+    const int ppb = 8/pixel_size;
+    const uint8_t byte = bitmap.getRow(row)[px/ppb];
+    return (byte >> ((8-pixel_size) - (px % ppb)*pixel_size)) & ((1 << pixel_size) - 1);
+}
+
+inline void setPixel(uint8_t* row, int pixel_size, long px, int value){
+    const int ppb = 8/pixel_size;
+    const int shift = (8-pixel_size) - (px % ppb)*pixel_size;
+    const uint8_t mask = (uint8_t) (((1 << pixel_size) - 1) << shift);
+    row[px/ppb] = (uint8_t) ((row[px/ppb] & ~mask) | (value << shift));
+}
+
+//? Level of a grayscale value: the number of thresholds it reaches
+inline int referenceLevel(int gray, const std::vector<uint8_t>& thresholds_v){
+    int level = 0;
+    for (uint8_t threshold : thresholds_v) if (gray >= threshold) ++level;
+    return level;
+}
+
+//? Grayscale value of a pixel with 1, 3 or 4 channels, same rounding as the fixed point kernels
+inline int referenceGray(const uint8_t* px, int channels, const p2b::LumaWeights& luma_weights){
+    if (channels == 1) return px[0];
+    return (px[0]*luma_weights.b + px[1]*luma_weights.g + px[2]*luma_weights.r + (1 << (p2b::LUMA_SHIFT-1))) >> p2b::LUMA_SHIFT;
+}
+
+/*
+    Random image with 1, 3 or 4 channels, returned as a view of a larger image starting offset pixels
+    into its second row, so that the kernels see unaligned rows and a step that differs from the width
+*/
+inline cv::Mat randomImage(int rows, int cols, int channels, int offset){
+    const int type = (channels == 1) ? CV_8UC1 : (channels == 3) ? CV_8UC3 : CV_8UC4;
+    cv::Mat full(rows+2, cols+offset+1, type);
+    for (int i=0; i<full.rows; ++i){
+        uint8_t* row = full.ptr<uint8_t>(i);
+        for (int j=0; j<full.cols*channels; ++j) row[j] = (uint8_t) rng();
+    }
+    return full(cv::Rect(offset, 1, cols, rows));
+}
+
+inline bool sameBytes(const p2b::Bitmap& a, const p2b::Bitmap& b){
+    if (a.getRows() != b.getRows() || a.getCols() != b.getCols() || a.getPixelSize() != b.getPixelSize()) return false;
+    for (long i=0; i<a.getRows(); ++i){
+        for (long j=0; j<a.getCols(); ++j) if (a.getRow(i)[j] != b.getRow(i)[j]) return false;
+    }
+    return true;
+}
+
+inline int report(const char* test_name){
+    if (p2b_test::failures == 0) printf("%s: ok\n", test_name);
+    else printf("%s: %d failed checks\n", test_name, p2b_test::failures);
+    return p2b_test::failures;
+}
+
+
+
+}   //? End of p2b_test namespace